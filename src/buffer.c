@@ -0,0 +1,280 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "buffer.h"
+
+/* Released buffers over this size are freed when pool has no limit */
+#define BUFFER_CACHE_SIZE	(32UL << 20) /* 32MB */
+
+/* Size of arena chunk, bigger allocations get own chunk */
+#define ARENA_CHUNK_SIZE	4096
+
+struct buffer_entry {
+	void * data;
+	size_t size;
+	int used;
+	struct buffer_entry * next;
+};
+
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer_entry * buffer_entries;
+static size_t buffer_limit;
+
+/* Bytes in used and cached buffers */
+static size_t buffer_used;
+static size_t buffer_cached;
+
+static uint64_t buffer_allocs;
+static uint64_t buffer_reuses;
+static uint64_t buffer_failed;
+static size_t buffer_peak;
+static uint64_t arena_bytes;
+static size_t arena_peak;
+
+/* Free cached buffers until size bytes fit under limit, called with lock */
+static void buffer_release(size_t size, size_t limit) {
+
+	struct buffer_entry ** entry = &buffer_entries;
+	struct buffer_entry * next;
+
+	while ( *entry && buffer_used + buffer_cached + size > limit ) {
+		if ( (*entry)->used ) {
+			entry = &(*entry)->next;
+			continue;
+		}
+		next = (*entry)->next;
+		buffer_cached -= (*entry)->size;
+		free((*entry)->data);
+		free(*entry);
+		*entry = next;
+	}
+
+}
+
+void * buffer_alloc(size_t size) {
+
+	struct buffer_entry * entry;
+	struct buffer_entry * best = NULL;
+	void * data = NULL;
+
+	size = ( size + BUFFER_ALIGN - 1 ) / BUFFER_ALIGN * BUFFER_ALIGN;
+	if ( size == 0 )
+		size = BUFFER_ALIGN;
+
+	pthread_mutex_lock(&buffer_lock);
+
+	/* Smallest cached buffer which is big enough */
+	for ( entry = buffer_entries; entry; entry = entry->next )
+		if ( ! entry->used && entry->size >= size && ( ! best || entry->size < best->size ) )
+			best = entry;
+
+	if ( best ) {
+		best->used = 1;
+		buffer_cached -= best->size;
+		buffer_used += best->size;
+		++buffer_reuses;
+		data = best->data;
+		goto out;
+	}
+
+	if ( buffer_limit ) {
+		buffer_release(size, buffer_limit);
+		if ( buffer_used + buffer_cached + size > buffer_limit ) {
+			++buffer_failed;
+			goto out;
+		}
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if ( ! entry ) {
+		++buffer_failed;
+		goto out;
+	}
+
+	if ( posix_memalign(&entry->data, BUFFER_ALIGN, size) != 0 ) {
+		free(entry);
+		++buffer_failed;
+		goto out;
+	}
+
+	entry->size = size;
+	entry->used = 1;
+	entry->next = buffer_entries;
+	buffer_entries = entry;
+	buffer_used += size;
+	++buffer_allocs;
+	data = entry->data;
+
+out:
+	if ( buffer_used > buffer_peak )
+		buffer_peak = buffer_used;
+	pthread_mutex_unlock(&buffer_lock);
+	return data;
+
+}
+
+void buffer_free(void * buf) {
+
+	struct buffer_entry * entry;
+
+	if ( ! buf )
+		return;
+
+	pthread_mutex_lock(&buffer_lock);
+
+	for ( entry = buffer_entries; entry; entry = entry->next )
+		if ( entry->data == buf )
+			break;
+
+	if ( entry && entry->used ) {
+		entry->used = 0;
+		buffer_used -= entry->size;
+		buffer_cached += entry->size;
+		if ( ! buffer_limit && buffer_cached > BUFFER_CACHE_SIZE )
+			buffer_release(0, buffer_used + BUFFER_CACHE_SIZE);
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+
+}
+
+void buffer_set_limit(size_t limit) {
+
+	pthread_mutex_lock(&buffer_lock);
+	buffer_limit = limit;
+	if ( limit )
+		buffer_release(0, limit);
+	pthread_mutex_unlock(&buffer_lock);
+
+}
+
+void buffer_trim(void) {
+
+	pthread_mutex_lock(&buffer_lock);
+	buffer_release(0, buffer_used);
+	pthread_mutex_unlock(&buffer_lock);
+
+}
+
+void buffer_print(void) {
+
+	pthread_mutex_lock(&buffer_lock);
+
+	if ( buffer_allocs || arena_peak ) {
+		printf("Buffer pool:\n");
+		printf("  allocated %llu, reused %llu, failed %llu, peak %llu kB", (unsigned long long int)buffer_allocs, (unsigned long long int)buffer_reuses, (unsigned long long int)buffer_failed, (unsigned long long int)(buffer_peak >> 10));
+		if ( buffer_limit )
+			printf(" (limit %llu kB)", (unsigned long long int)(buffer_limit >> 10));
+		printf("\n");
+		printf("  arena peak %llu kB\n", (unsigned long long int)(arena_peak >> 10));
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+
+}
+
+struct arena_chunk {
+	struct arena_chunk * next;
+	size_t size;
+	size_t used;
+	/* Data follows, aligned for any type */
+	union {
+		long double ld;
+		void * ptr;
+		uint64_t u64;
+	} data[];
+};
+
+void * arena_alloc(struct arena * arena, size_t size) {
+
+	struct arena_chunk * chunk = arena->chunk;
+	size_t align = sizeof(chunk->data[0]);
+	size_t total;
+	char * ptr;
+
+	size = ( size + align - 1 ) / align * align;
+	if ( size == 0 )
+		size = align;
+
+	if ( ! chunk || chunk->size - chunk->used < size ) {
+
+		total = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(*chunk) + total);
+		if ( ! chunk )
+			return NULL;
+
+		chunk->size = total;
+		chunk->used = 0;
+
+		/* Keep partially used chunk on top when new one is for one big allocation */
+		if ( arena->chunk && total == size && arena->chunk->size - arena->chunk->used > 0 ) {
+			chunk->next = arena->chunk->next;
+			arena->chunk->next = chunk;
+		} else {
+			chunk->next = arena->chunk;
+			arena->chunk = chunk;
+		}
+
+		pthread_mutex_lock(&buffer_lock);
+		arena_bytes += total;
+		if ( arena_bytes > arena_peak )
+			arena_peak = arena_bytes;
+		pthread_mutex_unlock(&buffer_lock);
+
+	}
+
+	ptr = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+
+}
+
+char * arena_strdup(struct arena * arena, const char * str) {
+
+	size_t len = strlen(str) + 1;
+	char * ret;
+
+	ret = arena_alloc(arena, len);
+	if ( ret )
+		memcpy(ret, str, len);
+
+	return ret;
+
+}
+
+void arena_free(struct arena * arena) {
+
+	struct arena_chunk * chunk;
+
+	while ( arena->chunk ) {
+		chunk = arena->chunk;
+		arena->chunk = chunk->next;
+		pthread_mutex_lock(&buffer_lock);
+		arena_bytes -= chunk->size;
+		pthread_mutex_unlock(&buffer_lock);
+		free(chunk);
+	}
+
+}
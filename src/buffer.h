@@ -0,0 +1,59 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/* Buffers are page aligned, so they can be used with O_DIRECT */
+#define BUFFER_ALIGN		4096
+
+/*
+ * Pool of transfer buffers shared by all threads. Released buffers are kept
+ * for next allocation, so repeated operations do not touch allocator.
+ * Returns NULL when limit would be exceeded.
+ */
+void * buffer_alloc(size_t size);
+void buffer_free(void * buf);
+
+/* Largest usage of one operation (parallel eMMC and NAND dump), lower limit would fail it */
+#define BUFFER_MIN_LIMIT	(32UL << 20) /* 32MB */
+
+/* Limit bytes held by pool (used and cached), 0 means no limit */
+void buffer_set_limit(size_t limit);
+
+/* Free all cached buffers */
+void buffer_trim(void);
+
+/* Print pool usage */
+void buffer_print(void);
+
+struct arena_chunk;
+
+/* Arena for temporaries of one operation, everything is freed at once */
+struct arena {
+	struct arena_chunk * chunk;
+};
+
+void * arena_alloc(struct arena * arena, size_t size);
+char * arena_strdup(struct arena * arena, const char * str);
+void arena_free(struct arena * arena);
+
+#endif
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -40,15 +41,12 @@
 #endif
 
 #include "cal.h"
+#include "buffer.h"
 
 #define MAX_SIZE	393216
-#define INDEX_LAST	(0xFF + 1)
 #define HDR_MAGIC	"ConF"
-
-struct cal {
-	ssize_t size;
-	void * mem;
-};
+#define INDEX_SIZE	256	/* Must be power of 2 */
+#define PAGE_SIZE	2048	/* Program unit when CAL is not on mtd */
 
 struct header {
 	char magic[4];		/* Magic sequence */
@@ -61,13 +59,206 @@ struct header {
 	uint32_t hdrsum;	/* Header CRC32 checksum */
 } __attribute__((__packed__));
 
+/* Latest valid version of one section */
+struct section {
+	char name[CAL_MAX_NAME_LEN + 1];
+	int index;
+	int last; /* Highest index, also of invalid versions */
+	int valid;
+	struct header * hdr;
+};
+
+/* Staged write, stored by cal_flush() */
+struct pending {
+	char name[CAL_MAX_NAME_LEN + 1];
+	uint16_t flags;
+	void * data;
+	unsigned long len;
+	struct pending * next;
+};
+
+struct cal {
+	ssize_t size;
+	void * mem;
+	int mapped;
+	char * file;
+	int mtd;
+	uint32_t page;
+	uint32_t erasesize;
+	size_t end;
+	struct section index[INDEX_SIZE];
+	struct pending * pending;
+	/* Staged writes are allocated from arena, freed after cal_flush() */
+	struct arena arena;
+};
+
+
+static uint32_t crc32_table[256];
+
+static uint32_t crc32(uint32_t crc, const void * _data, size_t size) {
+
+	const uint8_t * data = _data;
+	const uint32_t poly = 0xEDB88320;
+	uint32_t value;
+	unsigned int bit;
+	size_t i;
+
+	if ( ! crc32_table[1] ) {
+		for ( i = 0; i < 256; i++ ) {
+			value = i;
+			for ( bit = 8; bit; bit-- )
+				value = ( value & 1 ) ? ( value >> 1 ) ^ poly : value >> 1;
+			crc32_table[i] = value;
+		}
+	}
+
+	for ( i = 0; i < size; i++ )
+		crc = ( crc >> 8 ) ^ crc32_table[( crc ^ data[i] ) & 0xFF];
+
+	return crc;
+
+}
+
+static unsigned int name_hash(const char * name) {
+
+	unsigned int hash = 5381;
+
+	while ( *name )
+		hash = hash * 33 + (unsigned char)*name++;
+
+	return hash & ( INDEX_SIZE - 1 );
+
+}
+
+static struct section * index_slot(struct cal * cal, const char * name) {
+
+	unsigned int slot = name_hash(name);
+	unsigned int i;
+
+	for ( i = 0; i < INDEX_SIZE; i++ ) {
+		struct section * section = &cal->index[( slot + i ) & ( INDEX_SIZE - 1 )];
+		if ( ! section->hdr || strcmp(section->name, name) == 0 )
+			return section;
+	}
+
+	return NULL;
+
+}
+
+static int cal_section_valid(struct header * hdr) {
+
+	if ( crc32(0, hdr, sizeof(*hdr) - 4) != hdr->hdrsum )
+		return 0;
+	if ( crc32(0, (uint8_t *)hdr + sizeof(struct header), hdr->length) != hdr->datasum )
+		return 0;
+	return 1;
+
+}
+
+/* One pass over CAL, for every name remember valid section with highest index */
+static void cal_build_index(struct cal * cal) {
+
+	uint8_t * data = cal->mem;
+	uint8_t * ptr;
+	size_t offset = 0;
+	size_t count = cal->size;
+	struct header * hdr;
+	struct section * section;
+	char name[CAL_MAX_NAME_LEN + 1] = { 0, };
+	int valid;
+
+	memset(cal->index, 0, sizeof(cal->index));
+	cal->end = 0;
+
+	while ( count >= sizeof(struct header) ) {
+
+		/* Find header start */
+		ptr = memchr(data + offset, HDR_MAGIC[0], count - sizeof(struct header) + 1);
+		if ( ! ptr )
+			break;
+
+		count -= ptr - ( data + offset );
+		offset = ptr - data;
+
+		if ( memcmp(ptr, HDR_MAGIC, sizeof(hdr->magic)) != 0 ) {
+			count--;
+			offset++;
+			continue;
+		}
+
+		hdr = (struct header *)ptr;
+
+		if ( count - sizeof(struct header) < hdr->length )
+			break;
+
+		memcpy(name, hdr->name, sizeof(hdr->name));
+
+		section = index_slot(cal, name);
+		if ( section ) {
+			valid = cal_section_valid(hdr);
+			if ( ! section->hdr || (int)hdr->index > section->last )
+				section->last = hdr->index;
+			/* Corrupted newer version must not hide older valid one */
+			if ( ! section->hdr || ( valid && ! section->valid ) || ( valid == section->valid && (int)hdr->index > section->index ) ) {
+				memcpy(section->name, name, sizeof(name));
+				section->index = hdr->index;
+				section->valid = valid;
+				section->hdr = hdr;
+			}
+		}
+
+		count -= sizeof(struct header) + hdr->length;
+		offset += sizeof(struct header) + hdr->length;
+		cal->end = offset;
+
+	}
+
+}
+
+static void cal_unload(struct cal * cal) {
+
+	if ( cal->mapped )
+		munmap(cal->mem, cal->size);
+	else
+		free(cal->mem);
+
+	cal->mem = NULL;
+	cal->mapped = 0;
+
+}
+
+static int cal_load(struct cal * cal, int fd) {
+
+	void * mem;
+
+	/* mtd char device supports mmap only on NOR, so read NAND to memory */
+	mem = mmap(NULL, cal->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if ( mem != MAP_FAILED ) {
+		cal->mapped = 1;
+	} else {
+		mem = malloc(cal->size);
+		if ( ! mem )
+			return -1;
+		if ( pread(fd, mem, cal->size, 0) != cal->size ) {
+			free(mem);
+			return -1;
+		}
+		cal->mapped = 0;
+	}
+
+	cal->mem = mem;
+
+	cal_build_index(cal);
+	return 0;
+
+}
 
 int cal_init_file(const char * file, struct cal ** cal_out) {
 
 	int fd = -1;
 	uint64_t blksize = 0;
 	ssize_t size = 0;
-	void * mem = NULL;
 	struct cal * cal = NULL;
 	struct stat st;
 #ifdef __linux__
@@ -120,21 +311,29 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 	if ( size == 0 || size > MAX_SIZE )
 		goto err;
 
-	mem = malloc(size);
+	cal = calloc(1, sizeof(struct cal));
 
-	if ( ! mem )
+	if ( ! cal )
 		goto err;
 
-	if ( read(fd, mem, size) != size )
-		goto err;
+	cal->size = size;
+	cal->mtd = -1;
+	cal->page = PAGE_SIZE;
+	cal->erasesize = size;
 
-	cal = malloc(sizeof(struct cal));
+#ifdef __linux__
+	/* /dev/mtdN has minor 2*N and /dev/mtdNro has 2*N+1 */
+	if ( S_ISCHR(st.st_mode) ) {
+		cal->mtd = minor(st.st_rdev) / 2;
+		cal->page = mtd_info.writesize ? mtd_info.writesize : 1;
+		cal->erasesize = mtd_info.erasesize ? mtd_info.erasesize : size;
+	}
+#endif
 
-	if ( ! cal )
-		goto err;
+	cal->file = strdup(file);
 
-	cal->mem = mem;
-	cal->size = size;
+	if ( ! cal->file || cal_load(cal, fd) != 0 )
+		goto err;
 
 	close(fd);
 
@@ -143,7 +342,8 @@ int cal_init_file(const char * file, struct cal ** cal_out) {
 
 err:
 	close(fd);
-	free(mem);
+	if ( cal )
+		free(cal->file);
 	free(cal);
 	return -1;
 
@@ -158,138 +358,268 @@ int cal_init(struct cal ** cal_out) {
 void cal_finish(struct cal * cal) {
 
 	if ( cal ) {
-		free(cal->mem);
+		cal->pending = NULL;
+		arena_free(&cal->arena);
+		cal_unload(cal);
+		free(cal->file);
 		free(cal);
 	}
 
 }
 
-static uint32_t crc32(uint32_t crc, const void * _data, size_t size) {
+int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags) {
 
-	const uint8_t * data = _data;
-	uint8_t value;
-	unsigned int bit;
-	size_t i;
-	const uint32_t poly = 0xEDB88320;
+	struct section * section;
 
-	for ( i = 0; i < size; i++ ) {
-		value = data[i];
-		for ( bit = 8; bit; bit-- ) {
-			if ( (crc & 1) != (value & 1) )
-				crc = (crc >> 1) ^ poly;
-			else
-				crc >>= 1;
-			value >>= 1;
-		}
+	if ( strlen(name) > CAL_MAX_NAME_LEN )
+		return -1;
+
+	section = index_slot(cal, name);
+	if ( ! section || ! section->hdr || ! section->valid )
+		return -1;
+
+	if ( flags && section->hdr->flags != flags )
+		return -1;
+
+	*ptr = (uint8_t *)section->hdr + sizeof(struct header);
+	*len = section->hdr->length;
+
+	return 0;
+
+}
+
+int cal_write_block(struct cal * cal, const char * name, const void * ptr, unsigned long len, unsigned long flags) {
+
+	struct section * section;
+	struct pending * pending;
+	struct pending ** last;
+	void * data;
+
+	if ( strlen(name) > CAL_MAX_NAME_LEN || len > (unsigned long)cal->size )
+		return -1;
+
+	section = index_slot(cal, name);
+	if ( ! section )
+		return -1;
+
+	if ( section->hdr && section->valid && ( section->hdr->flags & CAL_FLAG_WRITE_ONCE ) )
+		return -1;
+
+	data = arena_alloc(&cal->arena, len);
+	if ( ! data )
+		return -1;
+
+	memcpy(data, ptr, len);
+
+	/* Newer value of already staged section replaces older */
+	for ( last = &cal->pending; *last; last = &(*last)->next )
+		if ( strcmp((*last)->name, name) == 0 )
+			break;
+
+	pending = *last;
+
+	if ( ! pending ) {
+		pending = arena_alloc(&cal->arena, sizeof(struct pending));
+		if ( ! pending )
+			return -1;
+		memset(pending, 0, sizeof(struct pending));
+		strcpy(pending->name, name);
+		*last = pending;
 	}
 
-	return crc;
+	pending->data = data;
+	pending->len = len;
+	pending->flags = ( section->hdr && section->valid ) ? section->hdr->flags : flags;
+
+	return 0;
 
 }
 
-static int is_header(void *data, size_t size) {
+static size_t cal_put_section(struct cal * cal, uint8_t * buf, size_t offset, const char * name, uint8_t type, uint8_t index, uint16_t flags, const void * data, unsigned long len) {
 
-	struct header * hdr = data;
+	struct header hdr;
 
-	if ( size < sizeof(struct header) )
-		return 0;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HDR_MAGIC, sizeof(hdr.magic));
+	hdr.type = type;
+	hdr.index = index;
+	hdr.flags = flags;
+	memcpy(hdr.name, name, strlen(name));
+	hdr.length = len;
+	hdr.datasum = crc32(0, data, len);
+	hdr.hdrsum = crc32(0, &hdr, sizeof(hdr) - 4);
 
-	if ( memcmp(hdr->magic, HDR_MAGIC, sizeof(hdr->magic)) != 0 )
-		return 0;
+	memcpy(buf + offset, &hdr, sizeof(hdr));
+	memcpy(buf + offset + sizeof(hdr), data, len);
 
-	return 1;
+	/* Every section starts on new page, NAND page can be programmed only once */
+	offset += sizeof(hdr) + len;
+	return ( offset + cal->page - 1 ) / cal->page * cal->page;
 
 }
 
-static int64_t find_section(void *start, uint64_t count, int want_index, const char *want_name) {
+static int cal_is_erased(const uint8_t * buf, size_t size) {
 
-	int64_t offset = 0, found_offset = -1;
-	uint8_t * data = start;
-	struct header *hdr;
-	char sectname[sizeof(hdr->name) + 1] = { 0, };
-	uint32_t payload_len;
-	int previous_index = -1;
+	size_t i;
 
-	while ( 1 ) {
+	for ( i = 0; i < size; i++ )
+		if ( buf[i] != 0xFF )
+			return 0;
 
-		/* Find header start */
-		if ( count < sizeof(struct header) )
-			break;
+	return 1;
 
-		if ( ! is_header(data + offset, count) ) {
-			count--;
-			offset++;
-			continue;
-		}
+}
 
-		hdr = (struct header *)(data + offset);
-		payload_len = hdr->length;
+static int cal_open_write(struct cal * cal) {
 
-		if ( count - sizeof(struct header) < payload_len )
-			return -1;
+	char buf[64];
 
-		memcpy(sectname, hdr->name, sizeof(hdr->name));
+	if ( cal->mtd < 0 )
+		return open(cal->file, O_RDWR);
 
-		if ( want_index == INDEX_LAST ) {
-			if ( (int)hdr->index <= previous_index )
-				goto next;
-		} else {
-			if ( want_index >= 0 && want_index != hdr->index )
-				goto next;
-		}
+	snprintf(buf, sizeof(buf), "/dev/mtd%d", cal->mtd);
+	return open(buf, O_RDWR);
 
-		if ( want_name && strcmp(sectname, want_name) != 0 )
-			goto next;
+}
 
-		/* Found it */
-		found_offset = offset;
-		if ( want_index == INDEX_LAST )
-			previous_index = hdr->index;
-		else
-			break;
+static int cal_erase(struct cal * cal, int fd) {
 
-next:
-		count -= sizeof(struct header) + payload_len;
-		offset += sizeof(struct header) + payload_len;
+#ifdef __linux__
+	struct erase_info_user erase;
+	ssize_t offset;
 
+	if ( cal->mtd < 0 )
+		return 0;
+
+	for ( offset = 0; offset < cal->size; offset += cal->erasesize ) {
+		erase.start = offset;
+		erase.length = cal->erasesize;
+		if ( ioctl(fd, MEMERASE, &erase) != 0 )
+			return -1;
 	}
+#else
+	(void)cal;
+	(void)fd;
+#endif
 
-	return found_offset;
+	return 0;
 
 }
 
-int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags) {
+int cal_flush(struct cal * cal) {
 
-	int64_t find_offset;
-	uint64_t filelen = cal->size;
-	uint8_t * data = cal->mem;
-	struct header * hdr;
-	void * offset;
+	struct pending * pending;
+	struct section * section;
+	uint8_t * buf = NULL;
+	size_t start, size, offset;
+	int compact = 0;
+	int fd = -1;
+	int ret = -1;
+	unsigned int i;
+
+	if ( ! cal->pending )
+		return 0;
 
-	find_offset = find_section(data, filelen, INDEX_LAST, name);
-	if ( find_offset < 0 )
+	buf = buffer_alloc(cal->size);
+	if ( ! buf )
 		return -1;
 
-	hdr = (struct header *)(data + find_offset);
+	memset(buf, 0xFF, cal->size);
 
-	if ( flags && hdr->flags != flags )
-		return -1;
+	/* Append new versions of sections to free space after last section */
+	start = ( cal->end + cal->page - 1 ) / cal->page * cal->page;
+	size = 0;
 
-	if ( crc32(0, hdr, sizeof(*hdr) - 4) != hdr->hdrsum )
-		return -1;
+	for ( pending = cal->pending; pending; pending = pending->next ) {
+		size += ( sizeof(struct header) + pending->len + cal->page - 1 ) / cal->page * cal->page;
+		section = index_slot(cal, pending->name);
+		if ( section && section->hdr && section->last >= 0xFF )
+			compact = 1;
+	}
 
-	offset = data + find_offset + sizeof(struct header);
+	if ( start + size > (size_t)cal->size || ! cal_is_erased((uint8_t *)cal->mem + start, size) )
+		compact = 1;
 
-	if ( crc32(0, offset, hdr->length) != hdr->datasum )
-		return -1;
+	if ( ! compact ) {
 
-	*ptr = malloc(hdr->length);
-	if (!*ptr)
-		return -1;
+		offset = 0;
+		for ( pending = cal->pending; pending; pending = pending->next ) {
+			section = index_slot(cal, pending->name);
+			if ( section && section->hdr )
+				offset = cal_put_section(cal, buf, offset, pending->name, section->hdr->type, section->last + 1, pending->flags, pending->data, pending->len);
+			else
+				offset = cal_put_section(cal, buf, offset, pending->name, 0, 0, pending->flags, pending->data, pending->len);
+		}
 
-	memcpy(*ptr, offset, hdr->length);
-	*len = hdr->length;
+	} else {
 
-	return 0;
+		/* Area is full, store only latest versions of all sections */
+		start = 0;
+		offset = 0;
+		size = 0;
+
+		for ( i = 0; i < INDEX_SIZE; i++ ) {
+			section = &cal->index[i];
+			if ( ! section->hdr || ! section->valid )
+				continue;
+			for ( pending = cal->pending; pending; pending = pending->next )
+				if ( strcmp(pending->name, section->name) == 0 )
+					break;
+			if ( pending )
+				continue;
+			size += ( sizeof(struct header) + section->hdr->length + cal->page - 1 ) / cal->page * cal->page;
+		}
+
+		for ( pending = cal->pending; pending; pending = pending->next )
+			size += ( sizeof(struct header) + pending->len + cal->page - 1 ) / cal->page * cal->page;
+
+		if ( size > (size_t)cal->size )
+			goto clean;
+
+		for ( i = 0; i < INDEX_SIZE; i++ ) {
+			section = &cal->index[i];
+			if ( ! section->hdr || ! section->valid )
+				continue;
+			for ( pending = cal->pending; pending; pending = pending->next )
+				if ( strcmp(pending->name, section->name) == 0 )
+					break;
+			if ( pending )
+				continue;
+			offset = cal_put_section(cal, buf, offset, section->name, section->hdr->type, 0, section->hdr->flags, (uint8_t *)section->hdr + sizeof(struct header), section->hdr->length);
+		}
+
+		for ( pending = cal->pending; pending; pending = pending->next ) {
+			section = index_slot(cal, pending->name);
+			offset = cal_put_section(cal, buf, offset, pending->name, ( section && section->hdr ) ? section->hdr->type : 0, 0, pending->flags, pending->data, pending->len);
+		}
+
+	}
+
+	fd = cal_open_write(cal);
+	if ( fd < 0 )
+		goto clean;
+
+	if ( compact ) {
+		if ( cal_erase(cal, fd) != 0 )
+			goto clean;
+		if ( cal->mtd < 0 )
+			size = cal->size;
+	}
+
+	/* All sections are stored by one program operation */
+	if ( pwrite(fd, buf, size, start) != (ssize_t)size )
+		goto clean;
+
+	cal->pending = NULL;
+	arena_free(&cal->arena);
+
+	cal_unload(cal);
+	ret = cal_load(cal, fd);
+
+clean:
+	if ( fd >= 0 )
+		close(fd);
+	buffer_free(buf);
+	return ret;
 
 }
@@ -30,6 +30,11 @@ struct cal;
 int cal_init(struct cal ** cal_out);
 int cal_init_file(const char * file, struct cal ** cal_out);
 void cal_finish(struct cal * cal);
+/* Returned ptr points to CAL memory and is valid until cal_finish() */
 int cal_read_block(struct cal * cal, const char * name, void ** ptr, unsigned long * len, unsigned long flags);
 
+/* Stage new version of section, all staged sections are appended to CAL by one write in cal_flush() */
+int cal_write_block(struct cal * cal, const char * name, const void * ptr, unsigned long len, unsigned long flags);
+int cal_flush(struct cal * cal);
+
 #endif
@@ -0,0 +1,403 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "global.h"
+#include "fiasco.h"
+#include "daemon.h"
+
+#define DAEMON_MAX_JOB	4096
+#define DAEMON_MAX_ARGS	64
+#define DAEMON_MAX_OPTS	8
+
+/* glibc resets its internal state of previous option parsing only with 0 */
+#ifdef __GLIBC__
+#define DAEMON_OPTIND	0
+#else
+#define DAEMON_OPTIND	1
+#endif
+
+/* Listening socket of daemon, closed in jobs */
+static int daemon_sock = -1;
+
+/* Set in forked job process and while running line of batch file */
+static int daemon_job;
+
+/* Set while running line of batch file */
+static int daemon_batch;
+
+int daemon_is_job(void) {
+
+	return daemon_job;
+
+}
+
+int daemon_is_batch(void) {
+
+	return daemon_batch;
+
+}
+
+/* Read job from client, returns number of options stored to argv (after program name) */
+static int daemon_read_job(int conn, char * buf, size_t size, char ** argv, int max) {
+
+	size_t len = 0;
+	size_t start;
+	ssize_t ret;
+	int argc;
+
+	while ( 1 ) {
+
+		/* Find terminating empty option */
+		argc = 0;
+		start = 0;
+		while ( start < len ) {
+			if ( buf[start] == 0 )
+				return argc;
+			if ( ! memchr(buf + start, 0, len - start) )
+				break;
+			if ( argc == max ) {
+				ERROR("Too many options in job");
+				return -1;
+			}
+			argv[argc++] = buf + start;
+			start += strlen(buf + start) + 1;
+		}
+
+		if ( len == size ) {
+			ERROR("Job is too long");
+			return -1;
+		}
+
+		ret = read(conn, buf + len, size - len);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		len += ret;
+
+	}
+
+}
+
+/* Store global options and options of job to args, parse its fiasco files to cache, returns number of args */
+static int daemon_prepare_job(char ** args, int argc, char ** argv, char ** opts) {
+
+	int i;
+	int n;
+
+	/* Global options of daemon are inserted before options of job */
+	n = 0;
+	args[n++] = argv[0];
+	for ( i = 0; opts && opts[i] && i < DAEMON_MAX_OPTS; ++i )
+		args[n++] = opts[i];
+	for ( i = 1; i < argc; ++i )
+		args[n++] = argv[i];
+	args[n] = NULL;
+
+	/* Parse fiasco file only once, next jobs get its copy from cache */
+	for ( i = 1; i < n; ++i ) {
+		if ( strcmp(args[i], "-M") == 0 && i + 1 < n )
+			fiasco_cache_file(args[i + 1]);
+		else if ( strncmp(args[i], "-M", 2) == 0 && args[i][2] )
+			fiasco_cache_file(args[i] + 2);
+	}
+
+	return n;
+
+}
+
+/* Run job in forked process with output to out, returns its exit status */
+static int daemon_exec_job(int out, int argc, char ** argv, char ** opts, daemon_job_func job) {
+
+	char * args[DAEMON_MAX_OPTS + DAEMON_MAX_ARGS + 2];
+	pid_t pid;
+	int ret;
+
+	argc = daemon_prepare_job(args, argc, argv, opts);
+	argv = args;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if ( pid < 0 ) {
+		ERROR_INFO("Cannot fork job");
+		return -1;
+	}
+
+	if ( pid == 0 ) {
+		daemon_job = 1;
+		if ( daemon_sock >= 0 )
+			close(daemon_sock);
+		dup2(out, 1);
+		dup2(out, 2);
+		close(out);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		optind = DAEMON_OPTIND;
+		ret = job(argc, argv);
+		fflush(stdout);
+		_exit(ret);
+	}
+
+	while ( waitpid(pid, &ret, 0) < 0 ) {
+		if ( errno != EINTR )
+			return -1;
+	}
+
+	if ( ! WIFEXITED(ret) )
+		return -1;
+
+	return WEXITSTATUS(ret);
+
+}
+
+/*
+ * Run line of batch file in this process, so it gets device left connected
+ * by previous line and needs not detect and identify it again
+ */
+static int daemon_call_job(int argc, char ** argv, char ** opts, daemon_job_func job) {
+
+	char * args[DAEMON_MAX_OPTS + DAEMON_MAX_ARGS + 2];
+	int ret;
+
+	argc = daemon_prepare_job(args, argc, argv, opts);
+
+	daemon_job = 1;
+	daemon_batch = 1;
+	optind = DAEMON_OPTIND;
+	ret = job(argc, args);
+	daemon_job = 0;
+	daemon_batch = 0;
+
+	fflush(stdout);
+	return ret;
+
+}
+
+static void daemon_run_job(int conn, char ** opts, daemon_job_func job) {
+
+	char buf[DAEMON_MAX_JOB];
+	char * argv[DAEMON_MAX_ARGS + 2];
+	char status[64];
+	int argc;
+	int ret;
+
+	argc = daemon_read_job(conn, buf, sizeof(buf), argv + 1, DAEMON_MAX_ARGS);
+	if ( argc < 0 )
+		return;
+
+	argv[0] = "0xFFFF";
+	argv[++argc] = NULL;
+
+	ret = daemon_exec_job(conn, argc, argv, opts, job);
+
+	snprintf(status, sizeof(status), "Exit status: %d\n", ret);
+	if ( write(conn, status, strlen(status)) < 0 )
+		ERROR_INFO("Cannot send job status");
+
+	printf("Job finished with status %d\n", ret);
+
+}
+
+/* Split line to options by white spaces, options with spaces can be in double quotes */
+static int daemon_split_line(char * line, char ** argv, int max) {
+
+	char * ptr = line;
+	char * out;
+	int argc = 0;
+	int quote;
+
+	while ( 1 ) {
+
+		while ( *ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n' )
+			++ptr;
+
+		if ( ! *ptr || *ptr == '#' )
+			return argc;
+
+		if ( argc == max ) {
+			ERROR("Too many options on line");
+			return -1;
+		}
+
+		argv[argc++] = out = ptr;
+		quote = 0;
+
+		while ( *ptr && ( quote || ( *ptr != ' ' && *ptr != '\t' && *ptr != '\r' && *ptr != '\n' ) ) ) {
+			if ( *ptr == '"' )
+				quote = ! quote;
+			else
+				*out++ = *ptr;
+			++ptr;
+		}
+
+		if ( quote ) {
+			ERROR("Unterminated quote on line");
+			return -1;
+		}
+
+		if ( *ptr )
+			++ptr;
+		*out = 0;
+
+	}
+
+}
+
+int daemon_run_file(const char * file, char ** opts, daemon_job_func job) {
+
+	char buf[DAEMON_MAX_JOB];
+	char * argv[DAEMON_MAX_ARGS + 2];
+	FILE * fp;
+	int line = 0;
+	int argc;
+	int ret = 0;
+
+	fp = fopen(file, "r");
+	if ( ! fp ) {
+		ERROR_INFO("Cannot open batch file %s", file);
+		return -1;
+	}
+
+	while ( fgets(buf, sizeof(buf), fp) ) {
+
+		++line;
+
+		argc = daemon_split_line(buf, argv + 1, DAEMON_MAX_ARGS);
+		if ( argc < 0 ) {
+			ERROR("Invalid line %d in batch file %s", line, file);
+			ret = -1;
+			break;
+		}
+
+		if ( argc == 0 )
+			continue;
+
+		argv[0] = "0xFFFF";
+		argv[++argc] = NULL;
+
+		printf("Batch line %d\n", line);
+
+		ret = daemon_call_job(argc, argv, opts, job);
+		if ( ret != 0 ) {
+			ERROR("Batch line %d failed with status %d", line, ret);
+			break;
+		}
+
+		printf("\n");
+
+	}
+
+	fclose(fp);
+
+	return ret == 0 ? 0 : -1;
+
+}
+
+int daemon_run(const char * path, char ** opts, daemon_job_func job) {
+
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct stat st;
+	mode_t mask;
+	int sock;
+	int conn;
+	int ret;
+
+	if ( strlen(path) >= sizeof(addr.sun_path) ) {
+		ERROR("Socket path %s is too long", path);
+		return -1;
+	}
+
+	/* Client can disconnect in middle of job, flashing must not be interrupted */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( sock < 0 ) {
+		ERROR_INFO("Cannot create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Remove stale socket of previous daemon, but never other files */
+	if ( lstat(path, &st) == 0 ) {
+		if ( ! S_ISSOCK(st.st_mode) ) {
+			ERROR("File %s exists and is not socket", path);
+			close(sock);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	/* Jobs can flash and write files, allow only owner to connect */
+	mask = umask(077);
+	ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+
+	if ( ret < 0 || listen(sock, 8) < 0 ) {
+		ERROR_INFO("Cannot listen on socket %s", path);
+		close(sock);
+		return -1;
+	}
+
+	daemon_sock = sock;
+
+	printf("Waiting for jobs on %s...\n", path);
+
+	/* Jobs are run one by one, there is only one device */
+	while ( 1 ) {
+
+		conn = accept(sock, NULL, NULL);
+		if ( conn < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			ERROR_INFO("Cannot accept connection");
+			break;
+		}
+
+		daemon_run_job(conn, opts, job);
+		close(conn);
+
+	}
+
+	daemon_sock = -1;
+	close(sock);
+	unlink(path);
+
+	return -1;
+
+}
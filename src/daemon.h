@@ -0,0 +1,55 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+typedef int (*daemon_job_func)(int argc, char ** argv);
+
+/*
+ * opts is NULL terminated list of global options (e.g. -s) given together
+ * with -J or -B, they are passed to every job before its own options.
+ */
+
+/*
+ * Listen on unix socket and run jobs sent by clients. Job is list of
+ * command line options, each terminated by zero byte, and whole list is
+ * terminated by empty option. Every job runs in forked process with output
+ * sent back to client, followed by line "Exit status: <ret>".
+ * Fiasco files are parsed only once and kept in memory for next jobs.
+ */
+int daemon_run(const char * path, char ** opts, daemon_job_func job);
+
+/*
+ * Run jobs from batch file, one job per line with options separated by
+ * spaces (options with spaces can be in double quotes), # starts comment.
+ * Lines run one after another in this process and stop on first failed
+ * one. They share parsed fiasco files and the connected device, so every
+ * line continues in mode in which previous line left device and switches
+ * it only when its own operations need other mode.
+ */
+int daemon_run_file(const char * file, char ** opts, daemon_job_func job);
+
+/* Returns 1 when running in forked job of daemon or in line of batch file */
+int daemon_is_job(void);
+
+/* Returns 1 when running in line of batch file */
+int daemon_is_batch(void);
+
+#endif
@@ -94,6 +94,18 @@ int hwrev_is_valid(const int16_t * hwrevs, int16_t hwrev) {
 
 }
 
+int device_hwrev_is_valid(const struct device_list * device, int16_t hwrev) {
+
+	if ( ! device->hwrev_bits )
+		return hwrev_is_valid(device->hwrevs, hwrev);
+
+	if ( hwrev < 0 || hwrev >= HWREV_COUNT )
+		return 0;
+
+	return ( device->hwrev_bits[hwrev / 8] >> ( hwrev % 8 ) ) & 1;
+
+}
+
 int16_t * hwrevs_alloc_from_string(const char * str) {
 
 	const char * ptr = str;
@@ -161,6 +173,26 @@ char * hwrevs_alloc_to_string(const int16_t * hwrevs) {
 
 }
 
+uint8_t * hwrevs_alloc_to_bits(const int16_t * hwrevs) {
+
+	uint8_t * ret;
+	int i;
+
+	if ( ! hwrevs )
+		return NULL;
+
+	ret = calloc(1, HWREV_COUNT / 8);
+	if ( ! ret )
+		return NULL;
+
+	for ( i = 0; hwrevs[i] != -1; ++i )
+		if ( hwrevs[i] >= 0 && hwrevs[i] < HWREV_COUNT )
+			ret[hwrevs[i] / 8] |= 1 << ( hwrevs[i] % 8 );
+
+	return ret;
+
+}
+
 #define MAX_HWREVS 29
 
 char ** device_list_alloc_to_bufs(const struct device_list * device_list) {
@@ -327,6 +359,58 @@ struct device_list * device_list_alloc_from_buf(const char * buf, size_t size) {
 	}
 
 	ret->hwrevs[i] = -1;
+	ret->hwrev_bits = hwrevs_alloc_to_bits(ret->hwrevs);
 	return ret;
 
 }
+
+size_t device_hwrev_to_buf(const struct device_list * device, int16_t hwrev, char * buf, size_t size) {
+
+	const char * str = device_to_string(device->device);
+	size_t len;
+	int group = -1;
+	int count;
+	int i, n;
+
+	if ( ! str || ! device->hwrevs || ! device_hwrev_is_valid(device, hwrev) )
+		return 0;
+
+	/* Find group of MAX_HWREVS hwrevs which contains hwrev */
+	n = 0;
+	for ( i = 0; device->hwrevs[i] != -1; ++i ) {
+		if ( device->hwrevs[i] < 0 || device->hwrevs[i] >= HWREV_COUNT )
+			continue;
+		if ( device->hwrevs[i] == hwrev ) {
+			group = n / MAX_HWREVS;
+			break;
+		}
+		++n;
+	}
+
+	if ( group < 0 )
+		return 0;
+
+	len = 16;
+	count = 0;
+	n = 0;
+
+	memset(buf, 0, size);
+	if ( size < len )
+		return 0;
+	strncpy(buf, str, 16);
+
+	for ( i = 0; device->hwrevs[i] != -1 && count < MAX_HWREVS; ++i ) {
+		if ( device->hwrevs[i] < 0 || device->hwrevs[i] >= HWREV_COUNT )
+			continue;
+		if ( n++ / MAX_HWREVS != group )
+			continue;
+		if ( len + 8 > size )
+			return 0;
+		snprintf(buf + len, 8, "%d", device->hwrevs[i]);
+		len += 8;
+		++count;
+	}
+
+	return len;
+
+}
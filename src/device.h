@@ -39,10 +39,14 @@ enum device {
   hwrevs - array of int16_t
          - terminated by -1
          - valid numbers: 0-9999
+  hwrev_bits - bitmap of hwrevs for O(1) lookup (optional)
 */
+#define HWREV_COUNT 10000
+
 struct device_list {
 	enum device device;
 	int16_t * hwrevs;
+	uint8_t * hwrev_bits;
 	struct device_list * next;
 };
 
@@ -51,11 +55,16 @@ const char * device_to_string(enum device device);
 const char * device_to_long_string(enum device device);
 
 int hwrev_is_valid(const int16_t * hwrevs, int16_t hwrev);
+int device_hwrev_is_valid(const struct device_list * device, int16_t hwrev);
 
 int16_t * hwrevs_alloc_from_string(const char * str);
 char * hwrevs_alloc_to_string(const int16_t * hwrevs);
+uint8_t * hwrevs_alloc_to_bits(const int16_t * hwrevs);
 
 char ** device_list_alloc_to_bufs(const struct device_list * device_list);
 struct device_list * device_list_alloc_from_buf(const char * buf, size_t size);
 
+/* Write device & hwrevs buffer (as in fiasco) which contains hwrev, returns its length or 0 if hwrev is not there */
+size_t device_hwrev_to_buf(const struct device_list * device, int16_t hwrev, char * buf, size_t size);
+
 #endif
@@ -16,6 +16,11 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* O_DIRECT is Linux extension */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <fcntl.h>
 #include <libgen.h>
 #include <unistd.h>
@@ -39,8 +44,11 @@
 #include "device.h"
 #include "usb-device.h"
 #include "printf-utils.h"
-
-static char global_buf[1UL << 22]; /* 4MB */
+#include "report.h"
+#include "dump.h"
+#include "scan.h"
+#include "verify.h"
+#include "buffer.h"
 
 int disk_open_dev(int maj, int min, int partition, int readonly) {
 
@@ -199,29 +207,19 @@ int disk_open_dev(int maj, int min, int partition, int readonly) {
 
 }
 
-int disk_dump_dev(int fd, const char * file) {
-
-	int fd2;
-	int ret;
-	char * path;
-	uint64_t blksize;
-	size_t need, sent;
-	ssize_t size;
-	struct statvfs buf;
-
-	printf("Dump block device to file %s...\n", file);
+static int disk_dev_size(int fd, uint64_t * blksize) {
 
 #ifdef __linux__
 
-	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
+	if ( ioctl(fd, BLKGETSIZE64, blksize) != 0 ) {
 		ERROR_INFO("Cannot get size of block device");
 		return -1;
 	}
 
 #else
 
-	blksize = lseek(fd, 0, SEEK_END);
-	if ( (off_t)blksize == (off_t)-1 ) {
+	*blksize = lseek(fd, 0, SEEK_END);
+	if ( (off_t)*blksize == (off_t)-1 ) {
 		ERROR_INFO("Cannot get size of block device");
 		return -1;
 	}
@@ -233,11 +231,243 @@ int disk_dump_dev(int fd, const char * file) {
 
 #endif
 
-	if ( blksize == 0 ) {
+	if ( *blksize == 0 ) {
 		ERROR("Block device has zero size");
 		return -1;
 	}
 
+	return 0;
+
+}
+
+/* Allocated clusters of FAT filesystem */
+struct disk_fat {
+	uint64_t data;
+	uint32_t cluster;
+	uint32_t count;
+	unsigned char * used;
+};
+
+static uint16_t disk_le16(const unsigned char * ptr) {
+
+	return ptr[0] | (ptr[1] << 8);
+
+}
+
+static uint32_t disk_le32(const unsigned char * ptr) {
+
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+
+}
+
+static int disk_fat_map(void * priv, uint64_t pos, size_t * count) {
+
+	struct disk_fat * fat = priv;
+	uint64_t num;
+	uint64_t end;
+	int used;
+
+	/* Boot sector, reserved sectors, FATs and FAT12/16 root directory */
+	if ( pos < fat->data ) {
+		if ( *count > fat->data - pos )
+			*count = fat->data - pos;
+		return 1;
+	}
+
+	num = ( pos - fat->data ) / fat->cluster;
+
+	/* Space after last cluster is not used by filesystem */
+	if ( num >= fat->count )
+		return 0;
+
+	used = ( fat->used[num / 8] >> ( num % 8 ) ) & 1;
+
+	end = fat->data + ( num + 1 ) * fat->cluster;
+	while ( end - pos < *count && ++num < fat->count && ( ( fat->used[num / 8] >> ( num % 8 ) ) & 1 ) == used )
+		end += fat->cluster;
+
+	if ( *count > end - pos )
+		*count = end - pos;
+
+	return used;
+
+}
+
+/* Read boot sector and first FAT, returns -1 if device does not contain FAT filesystem */
+static int disk_fat_read(int fd, uint64_t blksize, struct disk_fat * fat) {
+
+	unsigned char boot[512];
+	unsigned char * table;
+	uint32_t sector;
+	uint32_t reserved;
+	uint32_t root;
+	uint32_t fats;
+	uint32_t fatsize;
+	uint64_t total;
+	uint64_t start;
+	uint64_t num;
+	uint64_t size;
+	uint64_t chunk;
+	uint64_t off;
+	uint64_t i;
+	uint32_t entry;
+	int bits;
+
+	if ( pread(fd, boot, sizeof(boot), 0) != (ssize_t)sizeof(boot) )
+		return -1;
+
+	if ( boot[510] != 0x55 || boot[511] != 0xAA )
+		return -1;
+
+	sector = disk_le16(boot + 11);
+	reserved = disk_le16(boot + 14);
+	fats = boot[16];
+	root = disk_le16(boot + 17);
+	total = disk_le16(boot + 19);
+	fatsize = disk_le16(boot + 22);
+
+	if ( total == 0 )
+		total = disk_le32(boot + 32);
+	if ( fatsize == 0 )
+		fatsize = disk_le32(boot + 36);
+
+	if ( sector < 512 || sector > 4096 || ( sector & ( sector - 1 ) ) || boot[13] == 0 || ( boot[13] & ( boot[13] - 1 ) ) )
+		return -1;
+
+	if ( reserved == 0 || fats == 0 || fatsize == 0 || total == 0 )
+		return -1;
+
+	fat->cluster = sector * boot[13];
+	start = (uint64_t)reserved * sector;
+	fat->data = start + (uint64_t)fats * fatsize * sector + ( ( (uint64_t)root * 32 + sector - 1 ) / sector ) * sector;
+
+	if ( fat->data >= total * sector || total * sector > blksize )
+		return -1;
+
+	num = ( total * sector - fat->data ) / fat->cluster;
+
+	if ( num < 4085 )
+		bits = 12;
+	else if ( num < 65525 )
+		bits = 16;
+	else
+		bits = 32;
+
+	/* Clusters are numbered from 2 and FAT can be shorter than data area */
+	if ( num > (uint64_t)fatsize * sector * 8 / bits - 2 )
+		num = (uint64_t)fatsize * sector * 8 / bits - 2;
+
+	fat->count = num;
+	fat->used = calloc(num / 8 + 1, 1);
+	if ( ! fat->used )
+		ALLOC_ERROR_RETURN(-1);
+
+	size = ( ( num + 2 ) * bits + 7 ) / 8;
+
+	/* FAT12 entries cross byte boundary, it is small so read it at once */
+	chunk = bits == 12 ? size : 1UL << 20;
+
+	table = malloc(chunk);
+	if ( ! table ) {
+		free(fat->used);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	for ( off = 0; off < size; off += chunk ) {
+
+		if ( chunk > size - off )
+			chunk = size - off;
+
+		if ( pread(fd, table, chunk, start + off) != (ssize_t)chunk ) {
+			ERROR_INFO("Cannot read FAT");
+			free(table);
+			free(fat->used);
+			return -1;
+		}
+
+		for ( i = off * 8 / bits; i < ( off + chunk ) * 8 / bits && i < num + 2; ++i ) {
+
+			if ( i < 2 )
+				continue;
+
+			if ( bits == 12 ) {
+				entry = disk_le16(table + i * 3 / 2);
+				entry = ( i % 2 ) ? entry >> 4 : entry & 0xFFF;
+			} else if ( bits == 16 ) {
+				entry = disk_le16(table + i * 2 - off);
+			} else {
+				entry = disk_le32(table + i * 4 - off) & 0x0FFFFFFF;
+			}
+
+			if ( entry )
+				fat->used[(i - 2) / 8] |= 1 << ( (i - 2) % 8 );
+
+		}
+
+	}
+
+	free(table);
+
+	return 0;
+
+}
+
+/* Copy block device to out, with dump_fat only metadata and allocated clusters of FAT filesystem are read */
+static int disk_dump_copy(int fd, uint64_t blksize, int out, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	struct disk_fat fat;
+	uint64_t used = 0;
+	uint32_t i;
+	int ret;
+
+	/* Same alignment as image_align() uses for mmc images */
+	if ( ! dump_fat )
+		return dump_copy(fd, blksize, out, offset, 8, length, hash);
+
+	if ( disk_fat_read(fd, blksize, &fat) != 0 ) {
+		WARNING("Block device does not contain FAT filesystem, dumping whole device");
+		return dump_copy(fd, blksize, out, offset, 8, length, hash);
+	}
+
+	for ( i = 0; i < fat.count; ++i )
+		if ( ( fat.used[i / 8] >> ( i % 8 ) ) & 1 )
+			++used;
+
+	printf("FAT filesystem has %llu MB in %llu of %llu clusters allocated, other clusters are dumped as zeros\n", (unsigned long long int)(used * fat.cluster >> 20), (unsigned long long int)used, (unsigned long long int)fat.count);
+
+	ret = dump_copy_map(fd, blksize, out, offset, 8, disk_fat_map, &fat, length, hash);
+
+	free(fat.used);
+
+	return ret;
+
+}
+
+int disk_dump_dev_to_fd(int fd, int out, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	uint64_t blksize;
+
+	if ( disk_dev_size(fd, &blksize) != 0 )
+		return -1;
+
+	return disk_dump_copy(fd, blksize, out, offset, length, hash);
+
+}
+
+int disk_dump_dev(int fd, const char * file) {
+
+	int fd2;
+	int ret;
+	char * path;
+	uint64_t blksize;
+	uint64_t length;
+	struct statvfs buf;
+
+	printf("Dump block device to file %s...\n", file);
+
+	if ( disk_dev_size(fd, &blksize) != 0 )
+		return -1;
+
 	path = strdup(file);
 	if ( ! path ) {
 		ALLOC_ERROR();
@@ -248,10 +478,9 @@ int disk_dump_dev(int fd, const char * file) {
 
 	free(path);
 
-	if ( ret == 0 && buf.f_bsize * buf.f_bfree < blksize ) {
-		ERROR("Not enough free space (have: %llu, need: %llu)", (unsigned long long int)(buf.f_bsize) * buf.f_bfree, (unsigned long long int)blksize);
-		return -1;
-	}
+	/* Dump is sparse and trimmed, so it usually needs much less space */
+	if ( ret == 0 && buf.f_bsize * buf.f_bfree < blksize )
+		WARNING("Free space may not be enough (have: %llu, device size: %llu)", (unsigned long long int)(buf.f_bsize) * buf.f_bfree, (unsigned long long int)blksize);
 
 	fd2 = creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
@@ -260,41 +489,248 @@ int disk_dump_dev(int fd, const char * file) {
 		return -1;
 	}
 
-	sent = 0;
-	printf_progressbar(0, blksize);
-
-	while ( sent < blksize ) {
-		need = blksize - sent;
-		if ( need > sizeof(global_buf) )
-			need = sizeof(global_buf);
-		size = read(fd, global_buf, need);
-		if ( size == 0 )
-			break;
-		if ( size < 0 ) {
-			PRINTF_ERROR("Reading from block device failed");
-			close(fd2);
+	ret = disk_dump_copy(fd, blksize, fd2, 0, &length, NULL);
+
+	close(fd2);
+
+	if ( ret == 0 && length == 0 ) {
+		printf("File %s is empty, removing it...\n", file);
+		unlink(file);
+	} else if ( ret == 0 && length != blksize ) {
+		printf("Trimmed file %s to %llu bytes\n", file, (unsigned long long int)length);
+	}
+
+	return ret;
+
+}
+
+/* Size of one write request, blocks of DISK_COMPARE_SIZE are compared separately */
+#define DISK_WRITE_SIZE		(1UL << 22) /* 4MB */
+#define DISK_COMPARE_SIZE	(1UL << 16) /* 64kB */
+
+/* Differential mode is disabled if less than 1/8 of first 64MB was identical */
+#define DISK_DIFF_PROBE		(1ULL << 26)
+
+static int disk_pwrite(int fd, const char * buf, size_t count, off_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = pwrite(fd, buf + done, count - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
 			return -1;
-		}
-		if ( write(fd2, global_buf, size) != size ) {
-			PRINTF_ERROR("Dumping image failed");
-			close(fd2);
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static ssize_t disk_pread(int fd, char * buf, size_t count, off_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = pread(fd, buf + done, count - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret < 0 )
 			return -1;
+		if ( ret == 0 )
+			break;
+		done += ret;
+	}
+
+	return done;
+
+}
+
+static int disk_flash_from_image(int fd, struct image * image) {
+
+	uint64_t blksize;
+	uint64_t sent;
+	uint64_t written;
+	uint64_t skipped;
+	char * wbuf = NULL;
+	char * rbuf = NULL;
+	size_t need;
+	size_t done;
+	size_t off;
+	size_t len;
+	size_t run;
+	int sector;
+	int flags;
+	int direct;
+	int diff;
+	int ret = -1;
+
+#ifdef __linux__
+
+	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+	if ( ioctl(fd, BLKSSZGET, &sector) != 0 || sector <= 0 )
+		sector = 512;
+
+#else
+
+	blksize = lseek(fd, 0, SEEK_END);
+	if ( (off_t)blksize == (off_t)-1 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+	sector = 512;
+
+#endif
+
+	if ( image->size > blksize ) {
+		ERROR("Image is bigger than block device (image: %u, device: %llu)", image->size, (unsigned long long int)blksize);
+		return -1;
+	}
+
+	wbuf = buffer_alloc(DISK_WRITE_SIZE);
+	rbuf = buffer_alloc(DISK_WRITE_SIZE);
+	if ( ! wbuf || ! rbuf ) {
+		buffer_free(wbuf);
+		buffer_free(rbuf);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	direct = 0;
+
+#ifdef __linux__
+	if ( flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0 )
+		direct = 1;
+#endif
+
+	printf("Flashing image to block device...\n");
+
+	diff = 1;
+	sent = 0;
+	written = 0;
+	skipped = 0;
+	image_seek(image, 0);
+	printf_progressbar(0, image->size);
+
+	while ( sent < image->size ) {
+
+		need = image->size - sent;
+		if ( need > DISK_WRITE_SIZE )
+			need = DISK_WRITE_SIZE;
+
+		done = 0;
+		while ( done < need ) {
+			len = image_read(image, wbuf + done, need - done);
+			if ( len == 0 )
+				break;
+			done += len;
+		}
+
+		if ( done != need ) {
+			PRINTF_ERROR("Reading image failed");
+			goto clean;
+		}
+
+#ifdef __linux__
+		/* O_DIRECT needs whole sectors, write unaligned tail via page cache */
+		if ( direct && need % sector != 0 ) {
+			fcntl(fd, F_SETFL, flags);
+			direct = 0;
+		}
+#endif
+
+		/* Read target first and write only blocks which differ */
+		if ( diff && disk_pread(fd, rbuf, need, sent) != (ssize_t)need )
+			diff = 0;
+
+		run = 0;
+		for ( off = 0; off < need; off += len ) {
+
+			len = need - off;
+			if ( len > DISK_COMPARE_SIZE )
+				len = DISK_COMPARE_SIZE;
+
+			if ( ! diff || memcmp(wbuf + off, rbuf + off, len) != 0 )
+				continue;
+
+			if ( off > run && ! simulate && disk_pwrite(fd, wbuf + run, off - run, sent + run) < 0 ) {
+				PRINTF_ERROR("Writing to block device failed");
+				goto clean;
+			}
+
+			written += off - run;
+			skipped += len;
+			run = off + len;
+
 		}
-		sent += size;
-		printf_progressbar(sent, blksize);
+
+		if ( off > run && ! simulate && disk_pwrite(fd, wbuf + run, off - run, sent + run) < 0 ) {
+			PRINTF_ERROR("Writing to block device failed");
+			goto clean;
+		}
+
+		written += off - run;
+		sent += need;
+
+		/* Reading target costs USB bandwidth, stop when nearly nothing is skipped */
+		if ( diff && sent >= DISK_DIFF_PROBE && skipped < sent / 8 ) {
+			VERBOSE("\nDisabling differential write, only %llu of %llu bytes were identical\n", (unsigned long long int)skipped, (unsigned long long int)sent);
+			diff = 0;
+		}
+
+		printf_progressbar(sent, image->size);
+
 	}
 
-	close(fd2);
-	return 0;
+	if ( ! simulate ) {
+		printf("Syncing block device...\n");
+		if ( fsync(fd) != 0 ) {
+			ERROR_INFO("Cannot sync block device");
+			goto clean;
+		}
+#ifdef __linux__
+		if ( ioctl(fd, BLKFLSBUF, 0) != 0 )
+			WARNING("Cannot flush block device buffers");
+#endif
+	}
+
+	printf("Written %llu MB, skipped %llu MB of identical data\n", (unsigned long long int)(written >> 20), (unsigned long long int)(skipped >> 20));
+	printf("Done\n");
+	ret = 0;
+
+clean:
+	if ( flags != -1 )
+		fcntl(fd, F_SETFL, flags);
+
+	buffer_free(wbuf);
+	buffer_free(rbuf);
+	return ret;
 
 }
 
 int disk_flash_dev(int fd, const char * file) {
 
-	ERROR("Not implemented yet");
-	(void)fd;
-	(void)file;
-	return -1;
+	struct image * image;
+	int ret;
+
+	printf("Flash file %s to block device...\n", file);
+
+	image = image_alloc_from_file(file, "mmc", NULL, NULL, NULL, NULL);
+	if ( ! image )
+		return -1;
+
+	ret = disk_flash_from_image(fd, image);
+
+	image_free(image);
+	return ret;
 
 }
 
@@ -308,6 +744,7 @@ int disk_init(struct usb_device_info * dev) {
 	int min1;
 	int min2;
 	int tmp;
+	int partition;
 
 	maj1 = -1;
 	maj2 = -1;
@@ -412,16 +849,25 @@ int disk_init(struct usb_device_info * dev) {
 		maj2 = tmp;
 	}
 
-	/* TODO: change 1 to 0 when disk_flash_dev will be implemented */
-
 	/* RX-51 and RM-680 export MyDocs in first usb device and just first partion, so host system see whole device without MBR table */
-	if ( dev->device == DEVICE_RX_51 || dev->device == DEVICE_RM_680 )
-		fd = disk_open_dev(maj1, min1, -1, 1);
+	if ( dev->device == DEVICE_RX_51 || dev->device == DEVICE_RM_680 ) {
+		partition = -1;
 	/* Other devices can export SD card as first partition and export whole mmc device, so host system will see MBR table */
-	else if ( maj2 != -1 && min2 != -1 )
-		fd = disk_open_dev(maj2, min2, 1, 1);
-	else
-		fd = disk_open_dev(maj1, min1, 1, 1);
+	} else if ( maj2 != -1 && min2 != -1 ) {
+		maj1 = maj2;
+		min1 = min2;
+		partition = 1;
+	} else {
+		partition = 1;
+	}
+
+	fd = disk_open_dev(maj1, min1, partition, 0);
+
+	/* Dumping is still possible without write access */
+	if ( fd < 0 && ( errno == EACCES || errno == EROFS ) ) {
+		WARNING("Opening block device read-only, flashing will not be possible");
+		fd = disk_open_dev(maj1, min1, partition, 1);
+	}
 
 	if ( fd < 0 )
 		return -1;
@@ -454,10 +900,26 @@ enum device disk_get_device(struct usb_device_info * dev) {
 
 int disk_flash_image(struct usb_device_info * dev, struct image * image) {
 
-	ERROR("Not implemented yet");
-	(void)dev;
-	(void)image;
-	return -1;
+	int ret;
+	int id;
+
+	if ( image->type != IMAGE_MMC )
+		ERROR_RETURN("Only mmc images are supported", -1);
+
+	id = report_begin("data transfer", image->type);
+	ret = disk_flash_from_image(dev->data, image);
+	report_end(id, ret == 0 ? image->size : 0, ret);
+
+	return ret;
+
+}
+
+int disk_verify_image(struct usb_device_info * dev, struct image * image) {
+
+	if ( image->type != IMAGE_MMC )
+		ERROR_RETURN("Only mmc images are supported", -1);
+
+	return verify_image_fd(image, dev->data);
 
 }
 
@@ -470,11 +932,31 @@ int disk_dump_image(struct usb_device_info * dev, enum image_type image, const c
 
 }
 
+int disk_dump_image_to_fd(struct usb_device_info * dev, enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	if ( image != IMAGE_MMC )
+		ERROR_RETURN("Only mmc images are supported", -1);
+
+	return disk_dump_dev_to_fd(dev->data, out, offset, length, hash);
+
+}
+
+int disk_check_dev(int fd) {
+
+	uint64_t blksize;
+
+	if ( disk_dev_size(fd, &blksize) != 0 )
+		return -1;
+
+	return scan_dev(fd, blksize);
+
+}
+
 int disk_check_badblocks(struct usb_device_info * dev, const char * device) {
 
-	ERROR("Not implemented yet");
-	(void)dev;
-	(void)device;
-	return -1;
+	if ( device )
+		ERROR_RETURN("Only exported mmc device can be checked", -1);
+
+	return disk_check_dev(dev->data);
 
 }
@@ -19,6 +19,9 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "image.h"
 #include "device.h"
 #include "usb-device.h"
@@ -30,10 +33,14 @@ enum device disk_get_device(struct usb_device_info * dev);
 
 int disk_open_dev(int maj, int min, int partition, int readonly);
 int disk_dump_dev(int fd, const char * file);
+int disk_dump_dev_to_fd(int fd, int out, off_t offset, uint64_t * length, uint16_t * hash);
 int disk_flash_dev(int fd, const char * file);
+int disk_check_dev(int fd);
 
 int disk_flash_image(struct usb_device_info * dev, struct image * image);
+int disk_verify_image(struct usb_device_info * dev, struct image * image);
 int disk_dump_image(struct usb_device_info * dev, enum image_type image, const char * file);
+int disk_dump_image_to_fd(struct usb_device_info * dev, enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash);
 int disk_check_badblocks(struct usb_device_info * dev, const char * device);
 
 #endif
@@ -0,0 +1,664 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* O_DIRECT and sync_file_range are Linux extensions */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "printf-utils.h"
+#include "dump.h"
+#include "buffer.h"
+
+/* Ring of aligned buffers, reader fills them and writer thread drains them */
+#define DUMP_BUFFERS		4
+#define DUMP_BUFFER_SIZE	(1UL << 22) /* 4MB */
+
+/* Granularity of zero (hole) and 0xFF detection */
+#define DUMP_BLOCK		4096
+
+/* Output is flushed and dropped from page cache in windows of this size */
+#define DUMP_SYNC_WINDOW	(1UL << 25) /* 32MB */
+
+struct dump_buffer {
+	char * data;
+	size_t len;
+	uint64_t pos;
+	int full;
+};
+
+struct dump_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dump_buffer buf[DUMP_BUFFERS];
+	int out;
+	off_t offset;
+	int done;
+	int error;
+	uint64_t written;
+	/* Trimming state, see dump_track() */
+	uint64_t p1;
+	uint64_t p2;
+	uint64_t nonzero;
+	/* Bytes before p2 and nonzero, needed for hash of trimmed dump */
+	unsigned char p2_byte;
+	unsigned char nonzero_byte;
+	/* Pending run of 0xFF blocks which is written only when followed by other data */
+	uint64_t ff_start;
+	uint64_t ff_end;
+	char * ff;
+	/* xor of bytes at even and odd positions, see dump_hash() */
+	unsigned char hash[2];
+};
+
+/* Combined progress of all dumps which are running in parallel */
+static pthread_mutex_t dump_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dump_progress_total;
+static uint64_t dump_progress_done;
+static int dump_progress_count;
+
+static void dump_progress_begin(uint64_t size) {
+
+	pthread_mutex_lock(&dump_progress_lock);
+	if ( dump_progress_count++ == 0 ) {
+		dump_progress_total = 0;
+		dump_progress_done = 0;
+	}
+	dump_progress_total += size;
+	printf_progressbar(dump_progress_done, dump_progress_total);
+	pthread_mutex_unlock(&dump_progress_lock);
+
+}
+
+static void dump_progress_update(uint64_t * reported, uint64_t done) {
+
+	if ( done <= *reported )
+		return;
+
+	pthread_mutex_lock(&dump_progress_lock);
+	dump_progress_done += done - *reported;
+	*reported = done;
+	if ( dump_progress_done < dump_progress_total )
+		printf_progressbar(dump_progress_done, dump_progress_total);
+	pthread_mutex_unlock(&dump_progress_lock);
+
+}
+
+/* Source can be shorter than expected, line is printed after bar */
+static void dump_progress_end(uint64_t expected, uint64_t size, uint64_t reported, const char * line) {
+
+	pthread_mutex_lock(&dump_progress_lock);
+	dump_progress_total -= expected - size;
+	if ( size > reported )
+		dump_progress_done += size - reported;
+	if ( --dump_progress_count == 0 ) {
+		if ( line ) {
+			printf_progressbar(dump_progress_total, dump_progress_total);
+			printf("%s", line);
+		} else {
+			PRINTF_BACK();
+		}
+	} else {
+		/* Print line above the bar of other still running dumps */
+		PRINTF_BACK();
+		if ( line )
+			printf("%s", line);
+		printf_progressbar(dump_progress_done, dump_progress_total);
+	}
+	pthread_mutex_unlock(&dump_progress_lock);
+
+}
+
+enum dump_block {
+	DUMP_BLOCK_ZERO,
+	DUMP_BLOCK_FF,
+	DUMP_BLOCK_DATA,
+};
+
+/* Check whole block word by word, compiler can vectorize this loop */
+static enum dump_block dump_block_kind(const char * data, size_t len) {
+
+	const uint64_t * words = (const uint64_t *)data;
+	uint64_t or = 0;
+	uint64_t and = ~0ULL;
+	size_t count = len / sizeof(uint64_t);
+	size_t i;
+
+	for ( i = 0; i < count; ++i ) {
+		or |= words[i];
+		and &= words[i];
+	}
+
+	for ( i = count * sizeof(uint64_t); i < len; ++i ) {
+		or |= (unsigned char)data[i];
+		and &= (unsigned char)data[i] | ~0xFFULL;
+	}
+
+	if ( or == 0 )
+		return DUMP_BLOCK_ZERO;
+	if ( and == ~0ULL )
+		return DUMP_BLOCK_FF;
+	return DUMP_BLOCK_DATA;
+
+}
+
+/*
+ * Track trailing trim in same pass: p1 is end of last byte which is not
+ * 0xFF, p2 is end of last nonzero byte before p1 and nonzero is end of
+ * last nonzero byte at all. Dump is trimmed to p2 rounded up to alignment,
+ * which is the same as stripping trailing 0xFF and then trailing 0x00.
+ */
+static void dump_track(struct dump_ring * ring, const unsigned char * data, size_t len, uint64_t pos, enum dump_block kind) {
+
+	size_t q1;
+	size_t q2;
+
+	if ( kind == DUMP_BLOCK_FF ) {
+		ring->nonzero = pos + len;
+		ring->nonzero_byte = 0xFF;
+		return;
+	}
+
+	if ( kind == DUMP_BLOCK_ZERO ) {
+		ring->p1 = pos + len;
+		ring->p2 = ring->nonzero;
+		ring->p2_byte = ring->nonzero_byte;
+		return;
+	}
+
+	for ( q1 = len; q1 > 0 && data[q1-1] == 0xFF; --q1 );
+	for ( q2 = q1; q2 > 0 && data[q2-1] == 0x00; --q2 );
+
+	ring->p1 = pos + q1;
+	if ( q2 ) {
+		ring->p2 = pos + q2;
+		ring->p2_byte = data[q2-1];
+	} else {
+		ring->p2 = ring->nonzero;
+		ring->p2_byte = ring->nonzero_byte;
+	}
+
+	for ( q2 = len; q2 > 0 && data[q2-1] == 0x00; --q2 );
+	if ( q2 ) {
+		ring->nonzero = pos + q2;
+		ring->nonzero_byte = data[q2-1];
+	}
+
+}
+
+/* Same xor16 hash as image_hash_from_data(), computed per byte lane so chunks can have any position */
+static void dump_hash(unsigned char hash[2], const char * data, size_t len, uint64_t pos) {
+
+	const unsigned char * ptr = (const unsigned char *)data;
+	unsigned char lanes[sizeof(uint64_t)];
+	uint64_t acc = 0;
+	uint64_t word;
+	size_t i;
+
+	if ( len > 0 && pos % 2 ) {
+		hash[1] ^= *ptr++;
+		--len;
+	}
+
+	for ( i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t) ) {
+		memcpy(&word, ptr + i, sizeof(word));
+		acc ^= word;
+	}
+
+	memcpy(lanes, &acc, sizeof(lanes));
+	for ( ; i < len; ++i )
+		lanes[i % sizeof(lanes)] ^= ptr[i];
+
+	for ( i = 0; i < sizeof(lanes); ++i )
+		hash[i % 2] ^= lanes[i];
+
+}
+
+static int dump_write(int out, const char * data, size_t len, off_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < len ) {
+		ret = pwrite(out, data + done, len - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+/* 0xFF run cannot be hole (hole reads as zeros), so write it now */
+static int dump_write_ff(struct dump_ring * ring) {
+
+	size_t need;
+
+	if ( ring->ff_end == ring->ff_start )
+		return 0;
+
+	if ( ! ring->ff ) {
+		ring->ff = malloc(DUMP_BUFFER_SIZE);
+		if ( ! ring->ff )
+			return -1;
+		memset(ring->ff, 0xFF, DUMP_BUFFER_SIZE);
+	}
+
+	while ( ring->ff_start < ring->ff_end ) {
+		need = ring->ff_end - ring->ff_start;
+		if ( need > DUMP_BUFFER_SIZE )
+			need = DUMP_BUFFER_SIZE;
+		if ( dump_write(ring->out, ring->ff, need, ring->offset + ring->ff_start) < 0 )
+			return -1;
+		ring->ff_start += need;
+	}
+
+	return 0;
+
+}
+
+/* Write buffer block by block, zero blocks become holes in output file */
+static int dump_write_buffer(struct dump_ring * ring, struct dump_buffer * buf) {
+
+	enum dump_block kind;
+	size_t run = 0;
+	size_t off;
+	size_t len;
+
+	for ( off = 0; off < buf->len; off += len ) {
+
+		len = buf->len - off;
+		if ( len > DUMP_BLOCK )
+			len = DUMP_BLOCK;
+
+		kind = dump_block_kind(buf->data + off, len);
+		dump_track(ring, (unsigned char *)buf->data + off, len, buf->pos + off, kind);
+
+		if ( kind != DUMP_BLOCK_DATA ) {
+			if ( off > run && dump_write(ring->out, buf->data + run, off - run, ring->offset + buf->pos + run) < 0 )
+				return -1;
+			run = off + len;
+		}
+
+		if ( kind == DUMP_BLOCK_FF ) {
+			if ( ring->ff_end != buf->pos + off )
+				ring->ff_start = buf->pos + off;
+			ring->ff_end = buf->pos + off + len;
+		} else if ( dump_write_ff(ring) < 0 ) {
+			return -1;
+		}
+
+	}
+
+	if ( off > run && dump_write(ring->out, buf->data + run, off - run, ring->offset + buf->pos + run) < 0 )
+		return -1;
+
+	return 0;
+
+}
+
+static void dump_drop_window(int out, off_t start, off_t len, int wait) {
+
+#ifdef __linux__
+	if ( wait )
+		sync_file_range(out, start, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	else
+		sync_file_range(out, start, len, SYNC_FILE_RANGE_WRITE);
+#endif
+
+	if ( wait )
+		posix_fadvise(out, start, len, POSIX_FADV_DONTNEED);
+
+}
+
+static void * dump_writer(void * arg) {
+
+	struct dump_ring * ring = arg;
+	struct dump_buffer * buf;
+	off_t window = ring->offset;
+	off_t end = ring->offset;
+	int ret;
+	int idx = 0;
+
+	while ( 1 ) {
+
+		buf = &ring->buf[idx];
+
+		pthread_mutex_lock(&ring->lock);
+		while ( ! buf->full && ! ring->done )
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if ( ! buf->full ) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		ret = dump_write_buffer(ring, buf);
+
+		dump_hash(ring->hash, buf->data, buf->len, buf->pos);
+
+		end = ring->offset + buf->pos + buf->len;
+
+		/* Start writeback of finished window and drop previous one from cache */
+		if ( end - window >= (off_t)DUMP_SYNC_WINDOW ) {
+			dump_drop_window(ring->out, window, end - window, 0);
+			if ( window >= ring->offset + (off_t)DUMP_SYNC_WINDOW )
+				dump_drop_window(ring->out, window - DUMP_SYNC_WINDOW, DUMP_SYNC_WINDOW, 1);
+			window = end;
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		if ( ret < 0 )
+			ring->error = 1;
+		buf->full = 0;
+		ring->written += buf->len;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+
+		if ( ret < 0 )
+			break;
+
+		idx = (idx + 1) % DUMP_BUFFERS;
+
+	}
+
+	dump_drop_window(ring->out, ring->offset, end - ring->offset, 1);
+	return NULL;
+
+}
+
+int dump_stream(const struct dump_source * src, uint64_t size, int out, off_t offset, int align, uint64_t * length, uint16_t * hash) {
+
+	struct dump_ring ring;
+	struct dump_buffer * buf;
+	struct timespec start, end;
+	pthread_t writer;
+	uint64_t pos;
+	uint64_t written;
+	uint64_t count;
+	uint64_t expected = size;
+	uint64_t reported = 0;
+	double seconds;
+	char line[128];
+	ssize_t ret;
+	size_t need;
+	int read_error;
+	int error;
+	int idx;
+	int i;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.out = out;
+	ring.offset = offset;
+
+	/* Skipped zero blocks must read back as zeros */
+	if ( ftruncate(out, offset) < 0 ) {
+		ERROR_INFO("Cannot truncate output file");
+		return -1;
+	}
+
+	for ( i = 0; i < DUMP_BUFFERS; ++i ) {
+		ring.buf[i].data = buffer_alloc(DUMP_BUFFER_SIZE);
+		if ( ! ring.buf[i].data ) {
+			while ( i-- > 0 )
+				buffer_free(ring.buf[i].data);
+			ALLOC_ERROR_RETURN(-1);
+		}
+	}
+
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pos = 0;
+
+	if ( pthread_create(&writer, NULL, dump_writer, &ring) != 0 ) {
+		ERROR_INFO("Cannot create writer thread");
+		ring.error = 1;
+		goto clean;
+	}
+
+	dump_progress_begin(size);
+
+	idx = 0;
+	read_error = 0;
+
+	while ( pos < size ) {
+
+		buf = &ring.buf[idx];
+
+		pthread_mutex_lock(&ring.lock);
+		while ( buf->full && ! ring.error )
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		written = ring.written;
+		error = ring.error;
+		pthread_mutex_unlock(&ring.lock);
+
+		if ( error )
+			break;
+
+		dump_progress_update(&reported, written);
+
+		need = size - pos;
+		if ( need > DUMP_BUFFER_SIZE )
+			need = DUMP_BUFFER_SIZE;
+
+		ret = src->read(src->priv, buf->data, need, pos);
+		if ( ret < 0 ) {
+			PRINTF_ERROR("Reading from device failed");
+			read_error = 1;
+			pthread_mutex_lock(&ring.lock);
+			ring.error = 1;
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+
+		/* Source can be shorter (e.g. skipped bad blocks) */
+		if ( ret == 0 ) {
+			size = pos;
+			break;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		buf->len = ret;
+		buf->pos = pos;
+		buf->full = 1;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+
+		pos += ret;
+		idx = (idx + 1) % DUMP_BUFFERS;
+
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+
+	pthread_join(writer, NULL);
+
+	if ( ! ring.error ) {
+		if ( align < 0 )
+			*length = size;
+		else
+			*length = ( ring.p2 + ( 1ULL << align ) - 1 ) & ~( ( 1ULL << align ) - 1 );
+		if ( *length > size )
+			*length = size;
+		if ( hash ) {
+			/* Remove trimmed tail from hash, odd last byte is not hashed (like do_hash) */
+			pos = *length & ~1ULL;
+			if ( pos < ring.p2 )
+				ring.hash[pos % 2] ^= ring.p2_byte;
+			/* Tail is zeros and then 0xFF bytes from p1 */
+			if ( pos < ring.p1 )
+				pos = ring.p1;
+			count = size - pos;
+			if ( ( pos % 2 ? count / 2 : ( count + 1 ) / 2 ) % 2 )
+				ring.hash[0] ^= 0xFF;
+			if ( ( pos % 2 ? ( count + 1 ) / 2 : count / 2 ) % 2 )
+				ring.hash[1] ^= 0xFF;
+			memcpy(hash, ring.hash, sizeof(*hash));
+		}
+		/* Trailing 0xFF run is not written yet, but alignment can include part of it */
+		if ( ring.ff_start < *length && ring.ff_end > ring.ff_start ) {
+			ring.ff_end = *length;
+			if ( dump_write_ff(&ring) < 0 ) {
+				PRINTF_ERROR("Writing to output file failed");
+				read_error = 1;
+				ring.error = 1;
+			}
+		}
+		if ( ! ring.error && ftruncate(out, offset + *length) < 0 ) {
+			PRINTF_ERROR("Cannot truncate output file");
+			read_error = 1;
+			ring.error = 1;
+		}
+	}
+
+	if ( ! ring.error ) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		if ( seconds <= 0 )
+			seconds = 1e-9;
+		snprintf(line, sizeof(line), "Dumped %llu MB in %.1f s (%.1f MB/s)\n", (unsigned long long int)(size >> 20), seconds, size / seconds / (1 << 20));
+		dump_progress_end(expected, size, reported, line);
+	} else {
+		dump_progress_end(expected, size, reported, NULL);
+		if ( ! read_error )
+			PRINTF_ERROR("Dumping image failed");
+	}
+
+clean:
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+
+	for ( i = 0; i < DUMP_BUFFERS; ++i )
+		buffer_free(ring.buf[i].data);
+
+	free(ring.ff);
+
+	return ring.error ? -1 : 0;
+
+}
+
+struct dump_fd {
+	int fd;
+	int direct;
+	dump_map_func map;
+	void * map_priv;
+};
+
+static ssize_t dump_fd_read(void * priv, char * buf, size_t count, uint64_t pos) {
+
+	struct dump_fd * src = priv;
+	size_t done = 0;
+	size_t need;
+	ssize_t ret;
+
+	while ( done < count ) {
+		need = count - done;
+		/* Unused range is not read at all, zeros are written as hole */
+		if ( src->map && ! src->map(src->map_priv, pos + done, &need) ) {
+			memset(buf + done, 0, need);
+			done += need;
+			continue;
+		}
+		ret = pread(src->fd, buf + done, need, pos + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+#ifdef __linux__
+		/* Unaligned tail or device without O_DIRECT support, continue buffered */
+		if ( ret < 0 && errno == EINVAL && src->direct ) {
+			fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) & ~O_DIRECT);
+			src->direct = 0;
+			continue;
+		}
+#endif
+		if ( ret < 0 )
+			return -1;
+		if ( ret == 0 )
+			break;
+		done += ret;
+	}
+
+	if ( ! src->direct )
+		posix_fadvise(src->fd, pos, done, POSIX_FADV_DONTNEED);
+
+	return done;
+
+}
+
+int dump_copy_map(int fd, uint64_t size, int out, off_t offset, int align, dump_map_func map, void * map_priv, uint64_t * length, uint16_t * hash) {
+
+	struct dump_fd priv;
+	struct dump_source src;
+	int flags;
+	int ret;
+
+	priv.fd = fd;
+	priv.direct = 0;
+	priv.map = map;
+	priv.map_priv = map_priv;
+
+	src.read = dump_fd_read;
+	src.priv = &priv;
+
+	flags = fcntl(fd, F_GETFL);
+
+#ifdef __linux__
+	/* Bypass page cache, device is read only once */
+	if ( flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0 )
+		priv.direct = 1;
+#endif
+
+	if ( ! priv.direct )
+		posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	ret = dump_stream(&src, size, out, offset, align, length, hash);
+
+	if ( flags != -1 )
+		fcntl(fd, F_SETFL, flags);
+
+	return ret;
+
+}
+
+int dump_copy(int fd, uint64_t size, int out, off_t offset, int align, uint64_t * length, uint16_t * hash) {
+
+	return dump_copy_map(fd, size, out, offset, align, NULL, NULL, length, hash);
+
+}
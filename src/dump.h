@@ -0,0 +1,53 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sequential reader, returns number of bytes stored to buf, 0 at end or -1 */
+struct dump_source {
+	ssize_t (*read)(void * priv, char * buf, size_t count, uint64_t pos);
+	void * priv;
+};
+
+/*
+ * Copy (at most) size bytes from source to file out at offset.
+ * Zero blocks are not written (output is sparse file) and trailing 0xFF
+ * and then 0x00 bytes are trimmed, output length is rounded up to 2^align
+ * bytes and stored to length. Negative align disables trimming.
+ * If hash is not NULL, xor16 hash of the output (as in fiasco) is stored to it.
+ */
+int dump_stream(const struct dump_source * src, uint64_t size, int out, off_t offset, int align, uint64_t * length, uint16_t * hash);
+
+/* Same as dump_stream() for block device fd, which is read with O_DIRECT */
+int dump_copy(int fd, uint64_t size, int out, off_t offset, int align, uint64_t * length, uint16_t * hash);
+
+/*
+ * Returns nonzero if range starting at pos has to be read, count is reduced
+ * to length of range (at least 1 byte) with same result
+ */
+typedef int (*dump_map_func)(void * priv, uint64_t pos, size_t * count);
+
+/* Same as dump_copy(), but ranges for which map returns zero are not read and dumped as zeros */
+int dump_copy_map(int fd, uint64_t size, int out, off_t offset, int align, dump_map_func map, void * map_priv, uint64_t * length, uint16_t * hash);
+
+#endif
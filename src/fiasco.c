@@ -38,6 +38,8 @@
 #define FIASCO_WRITE_ERROR(file, fd, ...) do { ERROR_INFO_STR(file, __VA_ARGS__); if ( fd >= 0 ) close(fd); return -1; } while (0)
 #define READ_OR_FAIL(fiasco, buf, size) do { if ( read(fiasco->fd, buf, size) != size ) { FIASCO_READ_ERROR(fiasco, "Cannot read %d bytes", size); } } while (0)
 #define READ_OR_RETURN(fiasco, buf, size) do { if ( read(fiasco->fd, buf, size) != size ) return fiasco; } while (0)
+/* Failed stream is closed, so following images and fiasco_stream_end fail too */
+#define FIASCO_STREAM_ERROR(fiasco, image, ...) do { ERROR_INFO_STR(fiasco->orig_filename, __VA_ARGS__); close(fiasco->fd); fiasco->fd = -1; image_free(image); return -1; } while (0)
 #define WRITE_OR_FAIL_FREE(file, fd, buf, size, var) do { if ( ! simulate ) { if ( write(fd, buf, size) != (ssize_t)size ) { free(var); FIASCO_WRITE_ERROR(file, fd, "Cannot write %d bytes", size); } } } while (0)
 #define WRITE_OR_FAIL(file, fd, buf, size) WRITE_OR_FAIL_FREE(file, fd, buf, size, NULL)
 
@@ -52,7 +54,7 @@ struct fiasco * fiasco_alloc_empty(void) {
 
 }
 
-struct fiasco * fiasco_alloc_from_file(const char * file) {
+static struct fiasco * fiasco_parse_file(const char * file) {
 
 	uint8_t byte;
 	uint32_t length;
@@ -240,6 +242,109 @@ struct fiasco * fiasco_alloc_from_file(const char * file) {
 
 }
 
+/* Parsed fiasco file kept in memory by fiasco_cache_file */
+static struct {
+	struct fiasco * fiasco;
+	char * file;
+	struct stat st;
+} fiasco_cache;
+
+static int fiasco_cache_valid(const char * file) {
+
+	struct stat st;
+
+	if ( ! fiasco_cache.fiasco || strcmp(fiasco_cache.file, file) != 0 )
+		return 0;
+
+	if ( stat(file, &st) != 0 )
+		return 0;
+
+	return st.st_dev == fiasco_cache.st.st_dev && st.st_ino == fiasco_cache.st.st_ino && st.st_size == fiasco_cache.st.st_size && st.st_mtime == fiasco_cache.st.st_mtime;
+
+}
+
+int fiasco_cache_file(const char * file) {
+
+	struct fiasco * fiasco;
+	struct stat st;
+
+	if ( fiasco_cache_valid(file) )
+		return 0;
+
+	if ( fiasco_cache.fiasco )
+		fiasco_free(fiasco_cache.fiasco);
+	free(fiasco_cache.file);
+	memset(&fiasco_cache, 0, sizeof(fiasco_cache));
+
+	if ( stat(file, &st) != 0 )
+		return -1;
+
+	fiasco = fiasco_parse_file(file);
+	if ( ! fiasco )
+		return -1;
+
+	fiasco_cache.file = strdup(file);
+	if ( ! fiasco_cache.file ) {
+		fiasco_free(fiasco);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	fiasco_cache.fiasco = fiasco;
+	fiasco_cache.st = st;
+
+	return 0;
+
+}
+
+/* Copy of parsed fiasco with own file descriptor, images are not read and hashed again */
+static struct fiasco * fiasco_copy(const struct fiasco * src) {
+
+	struct image_list * list;
+	struct image * image;
+
+	struct fiasco * fiasco = fiasco_alloc_empty();
+	if ( ! fiasco )
+		return NULL;
+
+	memcpy(fiasco->name, src->name, sizeof(fiasco->name));
+	memcpy(fiasco->swver, src->swver, sizeof(fiasco->swver));
+
+	fiasco->orig_filename = strdup(src->orig_filename);
+	if ( ! fiasco->orig_filename ) {
+		fiasco_free(fiasco);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	fiasco->fd = dup(src->fd);
+	if ( fiasco->fd < 0 ) {
+		ERROR_INFO("Cannot open file %s", src->orig_filename);
+		fiasco_free(fiasco);
+		return NULL;
+	}
+
+	for ( list = src->first; list; list = list->next ) {
+		image = image_alloc_copy(list->image, fiasco->fd);
+		if ( ! image ) {
+			fiasco_free(fiasco);
+			return NULL;
+		}
+		fiasco_add_image(fiasco, image);
+	}
+
+	return fiasco;
+
+}
+
+struct fiasco * fiasco_alloc_from_file(const char * file) {
+
+	/* Cached fiasco stays in cache for next jobs, caller gets its copy */
+	if ( fiasco_cache_valid(file) )
+		return fiasco_copy(fiasco_cache.fiasco);
+
+	return fiasco_parse_file(file);
+
+}
+
 void fiasco_free(struct fiasco * fiasco) {
 
 	struct image_list * list = fiasco->first;
@@ -265,43 +370,11 @@ void fiasco_add_image(struct fiasco * fiasco, struct image * image) {
 
 }
 
-int fiasco_write_to_file(struct fiasco * fiasco, const char * file) {
+static int fiasco_write_header(struct fiasco * fiasco, const char * file, int fd) {
 
-	int fd = -1;
-	int i;
-	int device_count;
-	uint32_t size;
 	uint32_t length;
-	uint16_t hash;
 	uint8_t length8;
-	char ** device_hwrevs_bufs;
 	const char * str;
-	const char * type;
-	struct image_list * image_list;
-	struct image * image;
-	unsigned char buf[4096];
-
-	if ( ! fiasco )
-		return -1;
-
-	printf("Generating Fiasco image %s...\n", file);
-
-	if ( ! fiasco->first )
-		FIASCO_WRITE_ERROR(file, fd, "Nothing to write");
-
-	if ( strlen(fiasco->name)+1 > UINT8_MAX )
-		FIASCO_WRITE_ERROR(file, fd, "Fiasco name string is too long");
-
-	if ( strlen(fiasco->swver)+1 > UINT8_MAX )
-		FIASCO_WRITE_ERROR(file, fd, "SW version string is too long");
-
-	if ( ! simulate ) {
-		fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0644);
-		if ( fd < 0 ) {
-			ERROR_INFO("Cannot create file");
-			return -1;
-		}
-	}
 
 	printf("Writing Fiasco header...\n");
 
@@ -339,96 +412,155 @@ int fiasco_write_to_file(struct fiasco * fiasco, const char * file) {
 		WRITE_OR_FAIL(file, fd, fiasco->swver, length8);
 	};
 
-	printf("\n");
+	return 0;
 
-	image_list = fiasco->first;
+}
 
-	while ( image_list ) {
+/* Hash and size are at fixed offsets, so they can be patched after data are written */
+#define FIASCO_IMAGE_HASH_OFFSET	7
+#define FIASCO_IMAGE_SIZE_OFFSET	21
 
-		image = image_list->image;
+static int fiasco_write_image_header(const char * file, int fd, struct image * image) {
 
-		if ( ! image )
-			FIASCO_WRITE_ERROR(file, fd, "Empty image");
+	int i;
+	int device_count;
+	uint32_t size;
+	uint16_t hash;
+	uint8_t length8;
+	char ** device_hwrevs_bufs;
+	const char * type;
+	unsigned char buf[16];
 
-		printf("Writing image...\n");
-		image_print_info(image);
+	type = image_type_to_string(image->type);
+
+	if ( ! type )
+		FIASCO_WRITE_ERROR(file, fd, "Unknown image type");
 
-		type = image_type_to_string(image->type);
+	if ( image->version && strlen(image->version) > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, fd, "Image version string is too long");
 
-		if ( ! type )
-			FIASCO_WRITE_ERROR(file, fd, "Unknown image type");
+	if ( image->layout && strlen(image->layout) > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, fd, "Image layout is too long");
 
-		if ( image->version && strlen(image->version) > UINT8_MAX )
-			FIASCO_WRITE_ERROR(file, fd, "Image version string is too long");
+	device_hwrevs_bufs = device_list_alloc_to_bufs(image->devices);
 
-		if ( image->layout && strlen(image->layout) > UINT8_MAX )
-			FIASCO_WRITE_ERROR(file, fd, "Image layout is too long");
+	device_count = 0;
+	if ( device_hwrevs_bufs && device_hwrevs_bufs[0] )
+		for ( ; device_hwrevs_bufs[device_count]; ++device_count );
 
-		device_hwrevs_bufs = device_list_alloc_to_bufs(image->devices);
+	printf("Writing image header...\n");
 
-		device_count = 0;
-		if ( device_hwrevs_bufs && device_hwrevs_bufs[0] )
-			for ( ; device_hwrevs_bufs[device_count]; ++device_count );
+	/* signature */
+	WRITE_OR_FAIL_FREE(file, fd, "T", 1, device_hwrevs_bufs);
 
-		printf("Writing image header...\n");
+	/* number of subsections */
+	length8 = device_count+1;
+	if ( image->version )
+		++length8;
+	if ( image->layout )
+		++length8;
+	WRITE_OR_FAIL_FREE(file, fd, &length8, 1, device_hwrevs_bufs);
 
-		/* signature */
-		WRITE_OR_FAIL_FREE(file, fd, "T", 1, device_hwrevs_bufs);
+	/* unknown */
+	WRITE_OR_FAIL_FREE(file, fd, "\x2e\x19\x01\x01\x00", 5, device_hwrevs_bufs);
 
-		/* number of subsections */
-		length8 = device_count+1;
-		if ( image->version )
-			++length8;
-		if ( image->layout )
-			++length8;
+	/* checksum */
+	hash = htons(image->hash);
+	WRITE_OR_FAIL_FREE(file, fd, &hash, 2, device_hwrevs_bufs);
+
+	/* image type name */
+	memset(buf, 0, 12);
+	strncpy((char *)buf, type, 12);
+	WRITE_OR_FAIL_FREE(file, fd, buf, 12, device_hwrevs_bufs);
+
+	/* image size */
+	size = htonl(image->size);
+	WRITE_OR_FAIL_FREE(file, fd, &size, 4, device_hwrevs_bufs);
+
+	/* unknown */
+	WRITE_OR_FAIL_FREE(file, fd, "\x00\x00\x00\x00", 4, device_hwrevs_bufs);
+
+	/* append version subsection */
+	if ( image->version ) {
+		WRITE_OR_FAIL_FREE(file, fd, "1", 1, device_hwrevs_bufs); /* 1 - version */
+		length8 = strlen(image->version)+1; /* +1 for NULL term */
 		WRITE_OR_FAIL_FREE(file, fd, &length8, 1, device_hwrevs_bufs);
+		WRITE_OR_FAIL_FREE(file, fd, image->version, length8, device_hwrevs_bufs);
+	}
 
-		/* unknown */
-		WRITE_OR_FAIL_FREE(file, fd, "\x2e\x19\x01\x01\x00", 5, device_hwrevs_bufs);
+	/* append device & hwrevs subsection */
+	for ( i = 0; i < device_count; ++i ) {
+		WRITE_OR_FAIL_FREE(file, fd, "2", 1, device_hwrevs_bufs); /* 2 - device & hwrevs */
+		length8 = ((uint8_t *)(device_hwrevs_bufs[i]))[0];
+		WRITE_OR_FAIL_FREE(file, fd, &length8, 1, device_hwrevs_bufs);
+		WRITE_OR_FAIL_FREE(file, fd, device_hwrevs_bufs[i]+1, length8, device_hwrevs_bufs);
+	}
+	free(device_hwrevs_bufs);
 
-		/* checksum */
-		hash = htons(image->hash);
-		WRITE_OR_FAIL_FREE(file, fd, &hash, 2, device_hwrevs_bufs);
+	/* append layout subsection */
+	if ( image->layout ) {
+		WRITE_OR_FAIL(file, fd, "3", 1); /* 3 - layout */
+		length8 = strlen(image->layout);
+		WRITE_OR_FAIL(file, fd, &length8, 1);
+		WRITE_OR_FAIL(file, fd, image->layout, length8);
+	}
 
-		/* image type name */
-		memset(buf, 0, 12);
-		strncpy((char *)buf, type, 12);
-		WRITE_OR_FAIL_FREE(file, fd, buf, 12, device_hwrevs_bufs);
+	/* dummy byte - end of all subsections */
+	WRITE_OR_FAIL(file, fd, "\x00", 1);
 
-		/* image size */
-		size = htonl(image->size);
-		WRITE_OR_FAIL_FREE(file, fd, &size, 4, device_hwrevs_bufs);
+	return 0;
 
-		/* unknown */
-		WRITE_OR_FAIL_FREE(file, fd, "\x00\x00\x00\x00", 4, device_hwrevs_bufs);
-
-		/* append version subsection */
-		if ( image->version ) {
-			WRITE_OR_FAIL_FREE(file, fd, "1", 1, device_hwrevs_bufs); /* 1 - version */
-			length8 = strlen(image->version)+1; /* +1 for NULL term */
-			WRITE_OR_FAIL_FREE(file, fd, &length8, 1, device_hwrevs_bufs);
-			WRITE_OR_FAIL_FREE(file, fd, image->version, length8, device_hwrevs_bufs);
-		}
+}
 
-		/* append device & hwrevs subsection */
-		for ( i = 0; i < device_count; ++i ) {
-			WRITE_OR_FAIL_FREE(file, fd, "2", 1, device_hwrevs_bufs); /* 2 - device & hwrevs */
-			length8 = ((uint8_t *)(device_hwrevs_bufs[i]))[0];
-			WRITE_OR_FAIL_FREE(file, fd, &length8, 1, device_hwrevs_bufs);
-			WRITE_OR_FAIL_FREE(file, fd, device_hwrevs_bufs[i]+1, length8, device_hwrevs_bufs);
-		}
-		free(device_hwrevs_bufs);
+int fiasco_write_to_file(struct fiasco * fiasco, const char * file) {
 
-		/* append layout subsection */
-		if ( image->layout ) {
-			WRITE_OR_FAIL(file, fd, "3", 1); /* 3 - layout */
-			length8 = strlen(image->layout);
-			WRITE_OR_FAIL(file, fd, &length8, 1);
-			WRITE_OR_FAIL(file, fd, image->layout, length8);
+	int fd = -1;
+	uint32_t size;
+	struct image_list * image_list;
+	struct image * image;
+	unsigned char buf[4096];
+
+	if ( ! fiasco )
+		return -1;
+
+	printf("Generating Fiasco image %s...\n", file);
+
+	if ( ! fiasco->first )
+		FIASCO_WRITE_ERROR(file, fd, "Nothing to write");
+
+	if ( strlen(fiasco->name)+1 > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, fd, "Fiasco name string is too long");
+
+	if ( strlen(fiasco->swver)+1 > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, fd, "SW version string is too long");
+
+	if ( ! simulate ) {
+		fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if ( fd < 0 ) {
+			ERROR_INFO("Cannot create file");
+			return -1;
 		}
+	}
+
+	if ( fiasco_write_header(fiasco, file, fd) < 0 )
+		return -1;
+
+	printf("\n");
+
+	image_list = fiasco->first;
+
+	while ( image_list ) {
+
+		image = image_list->image;
+
+		if ( ! image )
+			FIASCO_WRITE_ERROR(file, fd, "Empty image");
+
+		printf("Writing image...\n");
+		image_print_info(image);
 
-		/* dummy byte - end of all subsections */
-		WRITE_OR_FAIL(file, fd, "\x00", 1);
+		if ( fiasco_write_image_header(file, fd, image) < 0 )
+			return -1;
 
 		printf("Writing image data...\n");
 
@@ -455,6 +587,137 @@ int fiasco_write_to_file(struct fiasco * fiasco, const char * file) {
 
 }
 
+int fiasco_stream_begin(struct fiasco * fiasco, const char * file) {
+
+	printf("Generating Fiasco image %s...\n", file);
+
+	if ( strlen(fiasco->name)+1 > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, -1, "Fiasco name string is too long");
+
+	if ( strlen(fiasco->swver)+1 > UINT8_MAX )
+		FIASCO_WRITE_ERROR(file, -1, "SW version string is too long");
+
+	free(fiasco->orig_filename);
+	fiasco->orig_filename = strdup(file);
+	if ( ! fiasco->orig_filename )
+		ALLOC_ERROR_RETURN(-1);
+
+	if ( ! simulate ) {
+		fiasco->fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if ( fiasco->fd < 0 ) {
+			ERROR_INFO("Cannot create file");
+			return -1;
+		}
+	}
+
+	if ( fiasco_write_header(fiasco, file, fiasco->fd) < 0 ) {
+		fiasco->fd = -1;
+		return -1;
+	}
+
+	printf("\n");
+	return 0;
+
+}
+
+int fiasco_stream_image(struct fiasco * fiasco, struct image * image, fiasco_dump_func dump, void * priv) {
+
+	const char * file = fiasco->orig_filename;
+	off_t header;
+	off_t data;
+	uint64_t length = 0;
+	uint16_t hash = 0;
+	uint32_t size;
+	int ret;
+
+	printf("Writing image %s...\n", image_type_to_string(image->type));
+
+	if ( fiasco->fd < 0 ) {
+		if ( ! simulate ) {
+			image_free(image);
+			return -1;
+		}
+		/* Simulate mode */
+		image_list_add(&fiasco->first, image);
+		return 0;
+	}
+
+	header = lseek(fiasco->fd, 0, SEEK_CUR);
+	if ( header == (off_t)-1 )
+		FIASCO_STREAM_ERROR(fiasco, image, "Cannot get offset");
+
+	/* Size and hash are not known yet */
+	image->size = 0;
+	image->hash = 0;
+
+	if ( fiasco_write_image_header(file, fiasco->fd, image) < 0 ) {
+		fiasco->fd = -1;
+		image_free(image);
+		return -1;
+	}
+
+	data = lseek(fiasco->fd, 0, SEEK_CUR);
+	if ( data == (off_t)-1 )
+		FIASCO_STREAM_ERROR(fiasco, image, "Cannot get offset");
+
+	ret = dump(priv, fiasco->fd, data, &length, &hash);
+
+	if ( ret != 0 || length == 0 || length > UINT32_MAX ) {
+		/* Drop image header */
+		if ( ret == 0 )
+			printf("Image %s is empty, skipping it...\n", image_type_to_string(image->type));
+		image_free(image);
+		if ( ftruncate(fiasco->fd, header) < 0 || lseek(fiasco->fd, header, SEEK_SET) == (off_t)-1 )
+			FIASCO_STREAM_ERROR(fiasco, NULL, "Cannot truncate file");
+		printf("\n");
+		return ret;
+	}
+
+	image->size = length;
+	image->hash = hash;
+
+	size = htonl(image->size);
+	hash = htons(image->hash);
+
+	if ( pwrite(fiasco->fd, &hash, 2, header + FIASCO_IMAGE_HASH_OFFSET) != 2 || pwrite(fiasco->fd, &size, 4, header + FIASCO_IMAGE_SIZE_OFFSET) != 4 )
+		FIASCO_STREAM_ERROR(fiasco, image, "Cannot write image header");
+
+	if ( lseek(fiasco->fd, data + length, SEEK_SET) == (off_t)-1 )
+		FIASCO_STREAM_ERROR(fiasco, image, "Cannot seek to end of image");
+
+	image_print_info(image);
+	image_list_add(&fiasco->first, image);
+
+	printf("\n");
+	return 0;
+
+}
+
+int fiasco_stream_end(struct fiasco * fiasco) {
+
+	int ret = 0;
+
+	if ( fiasco->fd >= 0 ) {
+		if ( fsync(fiasco->fd) < 0 )
+			ret = -1;
+		if ( close(fiasco->fd) < 0 )
+			ret = -1;
+		fiasco->fd = -1;
+		if ( ret < 0 )
+			ERROR_INFO("Cannot write file %s", fiasco->orig_filename);
+	} else if ( ! simulate ) {
+		/* Stream failed and was already closed */
+		ERROR("Fiasco file %s is incomplete", fiasco->orig_filename);
+		ret = -1;
+	}
+
+	if ( ret == 0 )
+		printf("Done\n\n");
+
+	return ret;
+
+}
+
 int fiasco_unpack(struct fiasco * fiasco, const char * dir) {
 
 	int fd;
@@ -21,6 +21,9 @@
 #ifndef FIASCO_H
 #define FIASCO_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "image.h"
 
 struct fiasco {
@@ -33,9 +36,17 @@ struct fiasco {
 
 struct fiasco * fiasco_alloc_empty(void);
 struct fiasco * fiasco_alloc_from_file(const char * file);
+/* Parse fiasco file and keep it in memory, next fiasco_alloc_from_file of unchanged file returns it */
+int fiasco_cache_file(const char * file);
 void fiasco_free(struct fiasco * fiasco);
 void fiasco_add_image(struct fiasco * fiasco, struct image * image);
 int fiasco_write_to_file(struct fiasco * fiasco, const char * file);
+
+/* Streaming writer, dump writes image data directly to fiasco file at offset */
+typedef int (*fiasco_dump_func)(void * priv, int fd, off_t offset, uint64_t * length, uint16_t * hash);
+int fiasco_stream_begin(struct fiasco * fiasco, const char * file);
+int fiasco_stream_image(struct fiasco * fiasco, struct image * image, fiasco_dump_func dump, void * priv);
+int fiasco_stream_end(struct fiasco * fiasco);
 int fiasco_unpack(struct fiasco * fiasco, const char * dir);
 void fiasco_print_info(struct fiasco * fiasco);
 
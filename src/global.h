@@ -10,6 +10,8 @@
 extern int simulate;
 extern int noverify;
 extern int verbose;
+extern char * mkii_tcp;
+extern int dump_fat;
 
 #define VERBOSE(...) do { if ( verbose ) { fprintf(stderr, __VA_ARGS__); } } while (0)
 #define WARNING(...) do { fprintf(stderr, "Warning: "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } while (0)
@@ -20,15 +20,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "global.h"
 #include "device.h"
 #include "image.h"
+#include "buffer.h"
 
 #define IMAGE_STORE_CUR(image) do { if ( image->is_shared_fd ) { image->cur = lseek(image->fd, 0, SEEK_CUR) - image->offset; if ( image->cur > image->size ) image->cur = image->size; } } while (0)
 #define IMAGE_RESTORE_CUR(image) do { if ( image->is_shared_fd ) { if ( image->cur <= image->size ) lseek(image->fd, image->offset + image->cur, SEEK_SET); else lseek(image->fd, image->offset + image->size, SEEK_SET); } } while (0)
@@ -86,8 +90,10 @@ static void image_missing_values_from_name(struct image * image, const char * na
 	}
 	free(device);
 
-	if ( image->devices && image->devices->device && ! image->devices->hwrevs )
+	if ( image->devices && image->devices->device && ! image->devices->hwrevs ) {
 		image->devices->hwrevs = hwrevs_alloc_from_string(hwrevs);
+		image->devices->hwrev_bits = hwrevs_alloc_to_bits(image->devices->hwrevs);
+	}
 
 	if ( ! image->version )
 		image->version = version;
@@ -155,11 +161,7 @@ char * image_name_alloc_from_values(struct image * image) {
 
 }
 
-static int image_append(struct image * image, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
-
-	enum image_type detected_type;
-
-	image->hash = image_hash_from_data(image);
+static int image_append_values(struct image * image, const char * device, const char * hwrevs, const char * version, const char * layout) {
 
 	image->devices = calloc(1, sizeof(struct device_list));
 	if ( ! image->devices ) {
@@ -178,6 +180,36 @@ static int image_append(struct image * image, const char * type, const char * de
 		}
 	}
 
+	if ( hwrevs && hwrevs[0] )
+		image->devices->hwrevs = hwrevs_alloc_from_string(hwrevs);
+	else
+		image->devices->hwrevs = NULL;
+
+	image->devices->hwrev_bits = hwrevs_alloc_to_bits(image->devices->hwrevs);
+
+	if ( version && version[0] )
+		image->version = strdup(version);
+	else
+		image->version = NULL;
+
+	if ( layout && layout[0] )
+		image->layout = strdup(layout);
+	else
+		image->layout = NULL;
+
+	return 0;
+
+}
+
+static int image_append(struct image * image, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
+
+	enum image_type detected_type;
+
+	image->hash = image_hash_from_data(image);
+
+	if ( image_append_values(image, device, hwrevs, version, layout) < 0 )
+		return -1;
+
 	detected_type = image_type_from_data(image);
 	image->type = detected_type;
 
@@ -195,21 +227,6 @@ static int image_append(struct image * image, const char * type, const char * de
 		}
 	}
 
-	if ( hwrevs && hwrevs[0] )
-		image->devices->hwrevs = hwrevs_alloc_from_string(hwrevs);
-	else
-		image->devices->hwrevs = NULL;
-
-	if ( version && version[0] )
-		image->version = strdup(version);
-	else
-		image->version = NULL;
-
-	if ( layout && layout[0] )
-		image->layout = strdup(layout);
-	else
-		image->layout = NULL;
-
 	return 0;
 
 }
@@ -244,6 +261,30 @@ static struct image * image_alloc(void) {
 
 }
 
+struct image * image_alloc_empty(const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
+
+	struct image * image = image_alloc();
+	if ( ! image )
+		return NULL;
+
+	/* No data, size and hash are filled by caller */
+	image->is_shared_fd = 1;
+	image->fd = -1;
+
+	image->type = image_type_from_string(type);
+	if ( image->type == IMAGE_UNKNOWN ) {
+		ERROR("Specified Image type %s is unknown", type);
+		free(image);
+		return NULL;
+	}
+
+	if ( image_append_values(image, device, hwrevs, version, layout) < 0 )
+		return NULL;
+
+	return image;
+
+}
+
 struct image * image_alloc_from_file(const char * file, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout) {
 
 	int fd;
@@ -330,6 +371,68 @@ struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, ui
 
 }
 
+struct image * image_alloc_copy(const struct image * src, int fd) {
+
+	struct device_list * device;
+	struct device_list ** next;
+	size_t count;
+
+	struct image * image = image_alloc();
+	if ( ! image )
+		return NULL;
+
+	/* Copy has same data and hash, but its own read position */
+	image->type = src->type;
+	image->hash = src->hash;
+	image->size = src->size;
+	image->fd = fd;
+	image->is_shared_fd = 1;
+	image->align = src->align;
+	image->offset = src->offset;
+
+	next = &image->devices;
+	for ( device = src->devices; device; device = device->next ) {
+
+		*next = calloc(1, sizeof(struct device_list));
+		if ( ! *next )
+			goto alloc_error;
+
+		(*next)->device = device->device;
+
+		if ( device->hwrevs ) {
+			for ( count = 0; device->hwrevs[count] != -1; ++count )
+				;
+			(*next)->hwrevs = malloc((count + 1) * sizeof(int16_t));
+			if ( ! (*next)->hwrevs )
+				goto alloc_error;
+			memcpy((*next)->hwrevs, device->hwrevs, (count + 1) * sizeof(int16_t));
+			(*next)->hwrev_bits = hwrevs_alloc_to_bits((*next)->hwrevs);
+		}
+
+		next = &(*next)->next;
+
+	}
+
+	if ( src->version ) {
+		image->version = strdup(src->version);
+		if ( ! image->version )
+			goto alloc_error;
+	}
+
+	if ( src->layout ) {
+		image->layout = strdup(src->layout);
+		if ( ! image->layout )
+			goto alloc_error;
+	}
+
+	return image;
+
+alloc_error:
+	image_free(image);
+	ALLOC_ERROR_RETURN(NULL);
+
+}
+
 void image_free(struct image * image) {
 
 	if ( ! image )
@@ -343,10 +446,16 @@ void image_free(struct image * image) {
 	while ( image->devices ) {
 		struct device_list * next = image->devices->next;
 		free(image->devices->hwrevs);
+		free(image->devices->hwrev_bits);
 		free(image->devices);
 		image->devices = next;
 	}
 
+	if ( image->data ) {
+		munlock(image->data, image->size);
+		free(image->data);
+	}
+
 	free(image->version);
 	free(image->layout);
 	free(image->orig_filename);
@@ -362,6 +471,11 @@ void image_seek(struct image * image, size_t whence) {
 	if ( whence > image->size )
 		return;
 
+	if ( image->data ) {
+		image->data_cur = whence;
+		return;
+	}
+
 	if ( whence >= image->size - image->align ) {
 		offset = lseek(image->fd, image->size - image->align - 1, SEEK_SET);
 		image->acur = whence - ( image->size - image->align );
@@ -385,6 +499,14 @@ size_t image_read(struct image * image, void * buf, size_t count) {
 	size_t new_count = 0;
 	size_t ret_count = 0;
 
+	if ( image->data ) {
+		if ( count > image->size - image->data_cur )
+			count = image->size - image->data_cur;
+		memcpy(buf, image->data + image->data_cur, count);
+		image->data_cur += count;
+		return count;
+	}
+
 	IMAGE_RESTORE_CUR(image);
 
 	if ( ! image->is_shared_fd || image->cur < image->size - image->align ) {
@@ -442,15 +564,15 @@ void image_list_add(struct image_list ** list, struct image * image) {
 	last->image = image;
 
 	if ( ! *list ) {
+		last->prev = last;
 		*list = last;
 		return;
 	}
 
-	while ( (*list)->next )
-		list = &((*list)->next);
-
-	last->prev = *list;
-	(*list)->next = last;
+	/* prev of first item is last item, so there is no need to walk list */
+	last->prev = (*list)->prev;
+	(*list)->prev->next = last;
+	(*list)->prev = last;
 
 }
 
@@ -467,15 +589,32 @@ void image_list_del(struct image_list * list) {
 
 void image_list_unlink(struct image_list * list) {
 
+	struct image_list * first;
+
 	if ( ! list )
 		return;
 
-	if ( list->prev )
+	if ( list->prev && list->prev->next == list ) {
+
 		list->prev->next = list->next;
 
-	if ( list->next )
+		if ( list->next ) {
+			list->next->prev = list->prev;
+		} else {
+			/* Removing last item, find first item which links to it */
+			first = list->prev;
+			while ( first->prev->next == first )
+				first = first->prev;
+			first->prev = list->prev;
+		}
+
+	} else if ( list->next ) {
+
+		/* Removing first item, next one becomes first */
 		list->next->prev = list->prev;
 
+	}
+
 	list->prev = NULL;
 	list->next = NULL;
 
@@ -492,19 +631,272 @@ static uint16_t do_hash(uint16_t * b, size_t len) {
 
 }
 
+/* Image is hashed in chunks of this size */
+#define IMAGE_HASH_BUF_SIZE	0x20000
+
 uint16_t image_hash_from_data(struct image * image) {
 
-	unsigned char buf[0x20000];
+	unsigned char * buf;
 	uint16_t hash = 0;
 	size_t ret;
+	int pooled;
+
+	/* Hash 0 is valid, so pool limit must not fail hashing */
+	buf = buffer_alloc(IMAGE_HASH_BUF_SIZE);
+	pooled = ( buf != NULL );
+	if ( ! buf )
+		buf = malloc(IMAGE_HASH_BUF_SIZE);
+	if ( ! buf ) {
+		/* Small buffer on stack is slower, but always available */
+		unsigned char small[4096];
+		image_seek(image, 0);
+		while ( ( ret = image_read(image, small, sizeof(small)) ) )
+			hash ^= do_hash((uint16_t *)small, ret);
+		return hash;
+	}
 
 	image_seek(image, 0);
-	while ( ( ret = image_read(image, buf, sizeof(buf)) ) )
+	while ( ( ret = image_read(image, buf, IMAGE_HASH_BUF_SIZE) ) )
 		hash ^= do_hash((uint16_t *)buf, ret);
 
+	if ( pooled )
+		buffer_free(buf);
+	else
+		free(buf);
 	return hash;
 }
 
+/* Prefetch at most this many bytes (and at most half of free RAM), bigger images (e.g. eMMC) are read from disk while flashing */
+#define PREFETCH_MAX_SIZE	(512UL << 20)
+
+/* Only smaller images are locked in RAM */
+#define PREFETCH_MLOCK_SIZE	(32UL << 20)
+
+enum prefetch_state {
+	PREFETCH_WAITING = 0,
+	PREFETCH_READING,
+	PREFETCH_DONE,
+	PREFETCH_CLAIMED,
+};
+
+struct prefetch_entry {
+	struct image * image;
+	enum prefetch_state state;
+	unsigned char * data;
+	size_t size;
+	int failed;
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	pthread_t thread;
+	int running;
+	int stop;
+	int count;
+	struct prefetch_entry * entries;
+} prefetch;
+
+/* Read image data without touching file offset, so other images on shared fd can be read meantime */
+static unsigned char * prefetch_read(struct image * image) {
+
+	unsigned char * data;
+	size_t len = image->size - image->align;
+	size_t done = 0;
+	ssize_t ret;
+
+	data = malloc(image->size);
+	if ( ! data )
+		return NULL;
+
+	while ( done < len ) {
+		ret = pread(image->fd, data + done, len - done, image->offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			free(data);
+			return NULL;
+		}
+		done += ret;
+	}
+
+	memset(data + len, 0xFF, image->align);
+
+	/* Keep data in RAM if allowed, failure is not fatal */
+	if ( image->size <= PREFETCH_MLOCK_SIZE )
+		mlock(data, image->size);
+
+	return data;
+
+}
+
+static void * prefetch_thread(void * arg) {
+
+	struct prefetch_entry * entry;
+	unsigned char * data;
+	int failed;
+	int i;
+
+	(void)arg;
+
+	for ( i = 0; i < prefetch.count; ++i ) {
+
+		entry = &prefetch.entries[i];
+
+		pthread_mutex_lock(&prefetch_lock);
+		if ( prefetch.stop ) {
+			pthread_mutex_unlock(&prefetch_lock);
+			break;
+		}
+		if ( entry->state != PREFETCH_WAITING ) {
+			pthread_mutex_unlock(&prefetch_lock);
+			continue;
+		}
+		entry->state = PREFETCH_READING;
+		pthread_mutex_unlock(&prefetch_lock);
+
+		data = prefetch_read(entry->image);
+		failed = ( data && ! noverify && do_hash((uint16_t *)data, entry->image->size) != entry->image->hash );
+
+		pthread_mutex_lock(&prefetch_lock);
+		entry->data = data;
+		entry->failed = failed;
+		entry->state = PREFETCH_DONE;
+		pthread_cond_broadcast(&prefetch_cond);
+		pthread_mutex_unlock(&prefetch_lock);
+
+	}
+
+	return NULL;
+
+}
+
+void image_prefetch_start(struct image_list * list) {
+
+	struct image_list * ptr;
+	uint64_t total = 0;
+	uint64_t max = PREFETCH_MAX_SIZE;
+	int count = 0;
+#ifdef _SC_AVPHYS_PAGES
+	long pages;
+	long page_size;
+#endif
+
+	if ( prefetch.running )
+		return;
+
+#ifdef _SC_AVPHYS_PAGES
+	pages = sysconf(_SC_AVPHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if ( pages > 0 && page_size > 0 && (uint64_t)pages * page_size / 2 < max )
+		max = (uint64_t)pages * page_size / 2;
+#endif
+
+	for ( ptr = list; ptr; ptr = ptr->next )
+		++count;
+
+	if ( count == 0 )
+		return;
+
+	prefetch.entries = calloc(count, sizeof(*prefetch.entries));
+	if ( ! prefetch.entries )
+		return;
+
+	for ( ptr = list; ptr; ptr = ptr->next ) {
+		if ( ptr->image->fd < 0 || ptr->image->data || total + ptr->image->size > max )
+			continue;
+		total += ptr->image->size;
+		prefetch.entries[prefetch.count].image = ptr->image;
+		prefetch.entries[prefetch.count].size = ptr->image->size;
+		++prefetch.count;
+	}
+
+	prefetch.stop = 0;
+
+	if ( prefetch.count == 0 || pthread_create(&prefetch.thread, NULL, prefetch_thread, NULL) != 0 ) {
+		free(prefetch.entries);
+		prefetch.entries = NULL;
+		prefetch.count = 0;
+		return;
+	}
+
+	prefetch.running = 1;
+
+}
+
+int image_prefetch_wait(struct image * image) {
+
+	struct prefetch_entry * entry = NULL;
+	int ret = 0;
+	int i;
+
+	if ( ! prefetch.running )
+		return 0;
+
+	pthread_mutex_lock(&prefetch_lock);
+
+	for ( i = 0; i < prefetch.count; ++i ) {
+		if ( prefetch.entries[i].image == image ) {
+			entry = &prefetch.entries[i];
+			break;
+		}
+	}
+
+	if ( entry ) {
+
+		while ( entry->state == PREFETCH_READING )
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+
+		if ( entry->state == PREFETCH_DONE && entry->failed ) {
+			ERROR("Image %s changed since it was loaded (hash mishmash)", image_type_to_string(image->type));
+			munlock(entry->data, image->size);
+			free(entry->data);
+			ret = -1;
+		} else if ( entry->state == PREFETCH_DONE && entry->data ) {
+			image->data = entry->data;
+			image->data_cur = 0;
+		}
+
+		/* Image is owned by caller now, thread does not touch it anymore */
+		entry->data = NULL;
+		entry->state = PREFETCH_CLAIMED;
+
+	}
+
+	pthread_mutex_unlock(&prefetch_lock);
+
+	return ret;
+
+}
+
+void image_prefetch_stop(void) {
+
+	int i;
+
+	if ( ! prefetch.running )
+		return;
+
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch.stop = 1;
+	pthread_mutex_unlock(&prefetch_lock);
+
+	pthread_join(prefetch.thread, NULL);
+
+	for ( i = 0; i < prefetch.count; ++i ) {
+		if ( prefetch.entries[i].data ) {
+			munlock(prefetch.entries[i].data, prefetch.entries[i].size);
+			free(prefetch.entries[i].data);
+		}
+	}
+
+	free(prefetch.entries);
+	prefetch.entries = NULL;
+	prefetch.count = 0;
+	prefetch.running = 0;
+
+}
+
 static const char * image_types[] = {
 	[IMAGE_XLOADER] = "xloader",
 	[IMAGE_2ND] = "2nd",
@@ -595,7 +987,7 @@ int image_hwrev_is_valid(struct image * image, int16_t hwrev) {
 	struct device_list * device_ptr = image->devices;
 
 	while ( device_ptr ) {
-		if ( hwrev_is_valid(device_ptr->hwrevs, hwrev) )
+		if ( device_hwrev_is_valid(device_ptr, hwrev) )
 			return 1;
 		device_ptr = device_ptr->next;
 	}
@@ -55,17 +55,24 @@ struct image {
 	size_t cur;
 	size_t acur;
 	char * orig_filename;
+
+	/* Whole image prefetched into memory, see image_prefetch_start */
+	unsigned char * data;
+	size_t data_cur;
 };
 
+/* prev of first item points to last item, next of last item is NULL */
 struct image_list {
 	struct image * image;
 	struct image_list * prev;
 	struct image_list * next;
 };
 
+struct image * image_alloc_empty(const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
 struct image * image_alloc_from_file(const char * file, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
 struct image * image_alloc_from_fd(int fd, const char * orig_filename, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
 struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, uint16_t hash, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout);
+struct image * image_alloc_copy(const struct image * image, int fd);
 void image_free(struct image * image);
 void image_seek(struct image * image, size_t whence);
 size_t image_read(struct image * image, void * buf, size_t count);
@@ -81,4 +88,13 @@ enum image_type image_type_from_string(const char * type);
 const char * image_type_to_string(enum image_type type);
 int image_hwrev_is_valid(struct image * image, int16_t hwrev);
 
+/*
+ * Read images from list into memory in background thread, so flashing
+ * does not wait for disk while device reboots or finishes previous image
+ */
+void image_prefetch_start(struct image_list * list);
+/* Wait until image is prefetched and use its data, returns -1 if data do not match image hash */
+int image_prefetch_wait(struct image * image);
+void image_prefetch_stop(void);
+
 #endif
@@ -20,12 +20,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 
-#include <libgen.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -36,6 +33,9 @@
 #include "image.h"
 #include "cal.h"
 #include "disk.h"
+#include "mtd.h"
+#include "dump.h"
+#include "verify.h"
 
 static int failed;
 
@@ -50,10 +50,14 @@ static char rd_mode[256];
 static int usb_host_mode = -1;
 static int root_device = -1;
 
+/* Opened CAL, changes are staged by setters and written by local_flush_config */
+static struct cal * local_cal;
+static int local_cal_dirty;
+
 #define min(a, b) (a < b ? a : b)
 #define local_cal_copy(dest, from, len) strncpy(dest, from, min(len, sizeof(dest)-1))
 #define local_cal_read(cal, str, ptr, len) ( cal_read_block(cal, str, &ptr, &len, 0) == 0 && ptr )
-#define local_cal_readcopy(cal, str, dest) do { void * ptr; unsigned long int len; if ( local_cal_read(cal, str, ptr, len) ) { local_cal_copy(dest, ptr, len); free(ptr); } } while ( 0 )
+#define local_cal_readcopy(cal, str, dest) do { void * ptr; unsigned long int len; if ( local_cal_read(cal, str, ptr, len) ) { local_cal_copy(dest, ptr, len); } } while ( 0 )
 
 #if defined(__linux__) && defined(__arm__)
 
@@ -67,8 +71,10 @@ static void local_cal_parse(void) {
 	if ( cal_init(&cal) < 0 || ! cal )
 		return;
 
+	local_cal = cal;
+
 	local_cal_readcopy(cal, "kernel-ver", kernel_ver);
-	local_cal_readcopy(cal, "initfs-ver", kernel_ver);
+	local_cal_readcopy(cal, "initfs-ver", initfs_ver);
 	local_cal_readcopy(cal, "nolo-ver", nolo_ver);
 	local_cal_readcopy(cal, "sw-release-ver", sw_ver);
 	local_cal_readcopy(cal, "content-ver", content_ver);
@@ -107,12 +113,52 @@ static void local_cal_parse(void) {
 	else
 		root_device = 0;
 
-	cal_finish(cal);
+}
+
+#endif
+
+#if defined(__linux__) && defined(__arm__)
+
+/* Opened mtd devices, kept open so e.g. mtd0 is read only once for xloader and secondary */
+static struct mtd * local_mtd[8];
+
+static struct mtd * local_mtd_get(int num) {
+
+	if ( num < 0 || num >= (int)(sizeof(local_mtd)/sizeof(local_mtd[0])) )
+		return NULL;
+
+	if ( ! local_mtd[num] )
+		local_mtd[num] = mtd_open(num, 0);
+
+	return local_mtd[num];
 
 }
 
 #endif
 
+void local_exit(void) {
+
+#if defined(__linux__) && defined(__arm__)
+	size_t i;
+#endif
+
+	if ( local_cal ) {
+		cal_finish(local_cal);
+		local_cal = NULL;
+		local_cal_dirty = 0;
+	}
+
+#if defined(__linux__) && defined(__arm__)
+
+	for ( i = 0; i < sizeof(local_mtd)/sizeof(local_mtd[0]); ++i ) {
+		if ( local_mtd[i] )
+			mtd_close(local_mtd[i]);
+		local_mtd[i] = NULL;
+	}
+#endif
+
+}
+
 int local_init(void) {
 
 #if defined(__linux__) && defined(__arm__)
@@ -198,59 +244,14 @@ enum device local_get_device(void) {
 
 }
 
-int local_flash_image(struct image * image) {
-
-	ERROR("Not implemented yet");
-	(void)image;
-	return -1;
-
-}
-
-static int local_nanddump(const char * file, int mtd, int offset, int length) {
-
-	struct statvfs buf;
-	char * command;
-	char * path;
-	size_t size;
-	int ret;
-
-	path = strdup(file);
-	if ( ! path )
-		return 1;
-
-	ret = statvfs(dirname(path), &buf);
-
-	free(path);
-
-	if ( ret == 0 && buf.f_bsize * buf.f_bfree < (long unsigned int)length ) {
-		ERROR("Not enough free space (have: %ju, need: %d)", (intmax_t)(buf.f_bsize * buf.f_bfree), length);
-		return 1;
-	}
-
-	size = snprintf(NULL, 0, "nanddump -o -b -s %d -l %d -f %s /dev/mtd%dro", offset, length, file, mtd);
-
-	command = malloc(size+1);
-	if ( ! command )
-		return 1;
-
-	snprintf(command, size+1, "nanddump -o -b -s %d -l %d -f %s /dev/mtd%dro", offset, length, file, mtd);
-
-	ret = system(command);
-
-	free(command);
-
-	return ret;
-
-}
-
-struct nanddump_args {
+struct mtdparts_args {
 	int valid;
 	int mtd;
 	int offset;
 	int length;
 };
 
-static struct nanddump_args nanddump_rx51[] = {
+static struct mtdparts_args mtdparts_rx51[] = {
 	[IMAGE_XLOADER]   = { 1, 0, 0x00000000, 0x00004000 },
 	[IMAGE_SECONDARY] = { 1, 0, 0x00004000, 0x0001C000 },
 	[IMAGE_KERNEL]    = { 1, 3, 0x00000800, 0x001FF800 },
@@ -259,7 +260,7 @@ static struct nanddump_args nanddump_rx51[] = {
 };
 
 /* FIXME: Is this table correct? */
-static struct nanddump_args nanddump_rx4x[] = {
+static struct mtdparts_args mtdparts_rx4x[] = {
 	[IMAGE_XLOADER]   = { 1, 0, 0x00000200, 0x00003E00 },
 	[IMAGE_SECONDARY] = { 1, 0, 0x00004000, 0x0001C000 },
 	[IMAGE_KERNEL]    = { 1, 2, 0x00000800, 0x0021F800 },
@@ -268,7 +269,7 @@ static struct nanddump_args nanddump_rx4x[] = {
 };
 
 /* FIXME: Is this table correct? */
-static struct nanddump_args nanddump_old[] = {
+static struct mtdparts_args mtdparts_old[] = {
 	[IMAGE_XLOADER]   = { 1, 0, 0x00000200, 0x00003E00 },
 	[IMAGE_SECONDARY] = { 1, 0, 0x00004000, 0x0001C000 },
 	[IMAGE_KERNEL]    = { 1, 2, 0x00000800, 0x001FF800 },
@@ -276,22 +277,122 @@ static struct nanddump_args nanddump_old[] = {
 	[IMAGE_ROOTFS]    = { 1, 4, 0x00000000, 0x0fb80000 },
 };
 
-struct nanddump_device {
+struct mtdparts_device {
 	size_t count;
-	struct nanddump_args * args;
+	struct mtdparts_args * args;
 };
 
-#define NANDDUMP(device, array) [device] = { .count = sizeof(array)/sizeof(array[0]), .args = array }
+#define MTDPARTS(device, array) [device] = { .count = sizeof(array)/sizeof(array[0]), .args = array }
 
-static struct nanddump_device nanddump[] = {
-	NANDDUMP(DEVICE_SU_18, nanddump_old),
-	NANDDUMP(DEVICE_RX_34, nanddump_old),
-	NANDDUMP(DEVICE_RX_44, nanddump_rx4x),
-	NANDDUMP(DEVICE_RX_48, nanddump_rx4x),
-	NANDDUMP(DEVICE_RX_51, nanddump_rx51),
+static struct mtdparts_device mtdparts[] = {
+	MTDPARTS(DEVICE_SU_18, mtdparts_old),
+	MTDPARTS(DEVICE_RX_34, mtdparts_old),
+	MTDPARTS(DEVICE_RX_44, mtdparts_rx4x),
+	MTDPARTS(DEVICE_RX_48, mtdparts_rx4x),
+	MTDPARTS(DEVICE_RX_51, mtdparts_rx51),
 };
 
-#undef NANDDUMP
+#undef MTDPARTS
+
+/* Kernel partition starts with header: "NOLO img" and kernel size, rest is zero padding */
+#define LOCAL_KERNEL_HEADER_SIZE 0x800
+
+struct local_flash_source {
+	struct image * image;
+	char header[LOCAL_KERNEL_HEADER_SIZE];
+	size_t header_size;
+};
+
+static ssize_t local_flash_read(void * priv, char * buf, size_t count, uint64_t pos) {
+
+	struct local_flash_source * source = priv;
+	size_t size;
+
+	if ( pos < source->header_size ) {
+		size = source->header_size - pos;
+		if ( size > count )
+			size = count;
+		memcpy(buf, source->header + pos, size);
+		return size;
+	}
+
+	return image_read(source->image, buf, count);
+
+}
+
+int local_flash_image(struct image * image) {
+
+	struct local_flash_source source;
+	struct dump_source src;
+	struct mtdparts_args * args;
+	struct mtd * mtd;
+	uint64_t offset;
+	uint64_t length;
+	int ret;
+
+	printf("Flash %s image...\n", image_type_to_string(image->type));
+
+	if ( device >= sizeof(mtdparts)/sizeof(mtdparts[0]) ) {
+		ERROR("Unsupported device");
+		return -1;
+	}
+
+	if ( image->type >= mtdparts[device].count || ! mtdparts[device].args[image->type].valid ) {
+		ERROR("Unsupported image type: %s", image_type_to_string(image->type));
+		return -1;
+	}
+
+	if ( device == DEVICE_RX_51 && image->type == IMAGE_ROOTFS ) {
+		ERROR("RX-51 rootfs is UBI partition, flash it with ubiformat to preserve erase counters (see doc/local-flash)");
+		return -1;
+	}
+
+	args = &mtdparts[device].args[image->type];
+
+	offset = args->offset;
+	length = args->length;
+
+	memset(&source, 0, sizeof(source));
+	source.image = image;
+
+	if ( image->type == IMAGE_KERNEL && offset == LOCAL_KERNEL_HEADER_SIZE ) {
+		memcpy(source.header, "NOLO img", 8);
+		source.header[8] = image->size & 0xFF;
+		source.header[9] = (image->size >> 8) & 0xFF;
+		source.header[10] = (image->size >> 16) & 0xFF;
+		source.header[11] = (image->size >> 24) & 0xFF;
+		source.header_size = LOCAL_KERNEL_HEADER_SIZE;
+		offset = 0;
+		length += LOCAL_KERNEL_HEADER_SIZE;
+	} else if ( offset != 0 && image->type != IMAGE_SECONDARY ) {
+		ERROR("Flashing %s image on this device is not supported", image_type_to_string(image->type));
+		return -1;
+	}
+
+	src.read = local_flash_read;
+	src.priv = &source;
+
+#if defined(__linux__) && defined(__arm__)
+	/* Cached content of read only mtd would be stale */
+	if ( args->mtd < (int)(sizeof(local_mtd)/sizeof(local_mtd[0])) && local_mtd[args->mtd] ) {
+		mtd_close(local_mtd[args->mtd]);
+		local_mtd[args->mtd] = NULL;
+	}
+#endif
+
+	/* Simulation only compares, device must not be opened for writing */
+	mtd = mtd_open(args->mtd, ! simulate);
+	if ( ! mtd )
+		return -1;
+
+	image_seek(image, 0);
+
+	ret = mtd_flash(mtd, offset, length, &src, source.header_size + image->size);
+
+	mtd_close(mtd);
+	return ret;
+
+}
 
 static void local_find_internal_mydocs(int * maj, int * min) {
 
@@ -378,16 +479,13 @@ static void local_find_internal_mydocs(int * maj, int * min) {
 
 }
 
-int local_dump_image(enum image_type image, const char * file) {
+int local_dump_image_to_fd(enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash) {
 
 	int ret = -1;
 	int fd = -1;
-	unsigned char * addr = NULL;
-	off_t nlen, len;
-	int align;
 	int maj, min;
-
-	printf("Dump %s image to file %s...\n", image_type_to_string(image), file);
+	struct mtdparts_args * args;
+	struct mtd * mtd;
 
 	if ( image == IMAGE_MMC ) {
 
@@ -397,7 +495,7 @@ int local_dump_image(enum image_type image, const char * file) {
 		local_find_internal_mydocs(&maj, &min);
 		if ( maj == -1 || min == -1 ) {
 			ERROR("Cannot find MyDocs mmc device: Slot 'internal' was not found");
-			goto clean;
+			return -1;
 		}
 
 		VERBOSE("Detected internal MyDocs mmc device: major=%d minor=%d\n", maj, min);
@@ -405,93 +503,241 @@ int local_dump_image(enum image_type image, const char * file) {
 		fd = disk_open_dev(maj, min, 1, 1);
 		if ( fd < 0 ) {
 			ERROR("Cannot open MyDocs mmc device in /dev/");
-			goto clean;
+			return -1;
 		}
 
-		ret = disk_dump_dev(fd, file);
+		ret = disk_dump_dev_to_fd(fd, out, offset, length, hash);
 
 		close(fd);
-		fd = -1;
+		return ret;
 
-	} else {
+	}
 
-		if ( device >= sizeof(nanddump)/sizeof(nanddump[0]) ) {
-			ERROR("Unsupported device");
-			goto clean;
-		}
+	if ( device >= sizeof(mtdparts)/sizeof(mtdparts[0]) ) {
+		ERROR("Unsupported device");
+		return -1;
+	}
 
-		if ( image >= nanddump[device].count ) {
-			ERROR("Unsupported image type: %s", image_type_to_string(image));
-			goto clean;
-		}
+	if ( image >= mtdparts[device].count || ! mtdparts[device].args[image].valid ) {
+		ERROR("Unsupported image type: %s", image_type_to_string(image));
+		return -1;
+	}
 
-		ret = local_nanddump(file, nanddump[device].args[image].mtd, nanddump[device].args[image].offset, nanddump[device].args[image].length);
+	args = &mtdparts[device].args[image];
 
-	}
+#if defined(__linux__) && defined(__arm__)
+	mtd = local_mtd_get(args->mtd);
+#else
+	mtd = NULL;
+#endif
+	if ( ! mtd )
+		return -1;
 
-	if ( ret != 0 ) {
-		ret = -1;
-		goto clean;
-	}
+	if ( image == IMAGE_ROOTFS )
+		return mtd_dump_ubi(mtd, args->offset, args->length, out, offset, 7, length, hash);
 
-	fd = open(file, O_RDWR);
-	if ( fd < 0 )
-		goto clean;
+	return mtd_dump(mtd, args->offset, args->length, out, offset, 7, length, hash);
 
-	len = lseek(fd, 0, SEEK_END);
-	if ( len == (off_t)-1 || len == 0 )
-		goto clean;
+}
 
-	addr = (unsigned char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+/* Size of NAND partition of image, 0 for eMMC and unknown images */
+uint64_t local_dump_image_max_size(enum image_type image) {
 
-	if ( addr == MAP_FAILED )
-		addr = NULL;
+	if ( image == IMAGE_MMC || device >= sizeof(mtdparts)/sizeof(mtdparts[0]) )
+		return 0;
 
-	if ( ! addr )
-		goto clean;
+	if ( image >= mtdparts[device].count || ! mtdparts[device].args[image].valid )
+		return 0;
 
-	for ( nlen = len; nlen > 0; --nlen )
-		if ( addr[nlen-1] != 0xFF )
-			break;
+	return mtdparts[device].args[image].length;
 
-	for ( ; nlen > 0; --nlen )
-		if ( addr[nlen-1] != 0x00 )
-			break;
+}
 
-	if ( image == IMAGE_MMC )
-		align = 8;
-	else
-		align = 7;
+int local_dump_image(enum image_type image, const char * file) {
+
+	int ret;
+	int fd;
+	uint64_t len;
+
+	printf("Dump %s image to file %s...\n", image_type_to_string(image), file);
 
-	if ( ( nlen & ( ( 1ULL << align ) - 1 ) ) != 0 )
-		nlen = ((nlen >> align) + 1) << align;
+	fd = creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if ( fd < 0 ) {
+		ERROR_INFO("Cannot create file %s", file);
+		printf("\n");
+		return -1;
+	}
 
-	if ( nlen == 0 ) {
+	ret = local_dump_image_to_fd(image, fd, 0, &len, NULL);
+
+	close(fd);
+
+	if ( ret != 0 ) {
+		unlink(file);
+	} else if ( len == 0 ) {
 		printf("File %s is empty, removing it...\n", file);
 		unlink(file);
-	} else if ( nlen != len ) {
-		printf("Truncating file %s to %d bytes...\n", file, (int)nlen);
-		if ( ftruncate(fd, nlen) < 0 )
-			ERROR_INFO("Cannot truncate file %s", file);
 	}
 
-clean:
-	if ( addr )
-		munmap((void *)addr, len);
+	printf("\n");
+	return ret;
+
+}
+
+int local_verify_image(struct image * image) {
+
+	struct mtdparts_args * args;
+	struct mtd * mtd;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t skip = 0;
+	int maj, min;
+	int ret;
+	int fd;
+
+	if ( image->type == IMAGE_MMC ) {
+
+		maj = -1;
+		min = -1;
+
+		local_find_internal_mydocs(&maj, &min);
+		if ( maj == -1 || min == -1 ) {
+			ERROR("Cannot find MyDocs mmc device: Slot 'internal' was not found");
+			return -1;
+		}
+
+		fd = disk_open_dev(maj, min, 1, 1);
+		if ( fd < 0 ) {
+			ERROR("Cannot open MyDocs mmc device in /dev/");
+			return -1;
+		}
+
+		ret = verify_image_fd(image, fd);
 
-	if ( fd >= 0 )
 		close(fd);
+		return ret;
+
+	}
+
+	if ( device >= sizeof(mtdparts)/sizeof(mtdparts[0]) ) {
+		ERROR("Unsupported device");
+		return -1;
+	}
+
+	if ( image->type >= mtdparts[device].count || ! mtdparts[device].args[image->type].valid ) {
+		ERROR("Unsupported image type: %s", image_type_to_string(image->type));
+		return -1;
+	}
+
+	if ( device == DEVICE_RX_51 && image->type == IMAGE_ROOTFS ) {
+		ERROR("RX-51 rootfs is UBI partition with erase counters, it cannot be compared with image");
+		return -1;
+	}
+
+	args = &mtdparts[device].args[image->type];
+
+	offset = args->offset;
+	length = args->length;
+
+	/* Kernel is flashed with header from start of partition, see local_flash_image() */
+	if ( image->type == IMAGE_KERNEL && offset == LOCAL_KERNEL_HEADER_SIZE ) {
+		skip = LOCAL_KERNEL_HEADER_SIZE;
+		offset = 0;
+		length += LOCAL_KERNEL_HEADER_SIZE;
+	}
+
+	mtd = mtd_open(args->mtd, 0);
+	if ( ! mtd )
+		return -1;
+
+	ret = mtd_verify(mtd, offset, length, skip, image);
+
+	mtd_close(mtd);
+	return ret;
+
+}
+
+static int local_check_mtd(int num) {
+
+	struct mtd * mtd;
+	int ret;
+
+	mtd = mtd_open(num, 0);
+	if ( ! mtd )
+		return -1;
+
+	ret = mtd_check(mtd);
+	mtd_close(mtd);
 
 	printf("\n");
 	return ret;
 
 }
 
+/* Keep first error, read errors (1) are less important than failures (-1) */
+static void local_check_result(int * ret, int ret2) {
+
+	if ( ret2 < 0 || *ret == 0 )
+		*ret = ret2;
+
+}
+
 int local_check_badblocks(const char * device) {
 
-	ERROR("Not implemented yet");
-	(void)device;
-	return -1;
+	FILE * f;
+	char buf[256];
+	int ret = 0;
+	int num;
+	int maj, min;
+	int fd;
+
+	if ( device ) {
+
+		if ( sscanf(device, "/dev/mtd%d", &num) == 1 || sscanf(device, "mtd%d", &num) == 1 )
+			return local_check_mtd(num);
+
+		fd = open(device, O_RDONLY);
+		if ( fd < 0 ) {
+			ERROR_INFO("Cannot open %s", device);
+			return -1;
+		}
+
+		printf("Checking %s...\n", device);
+		ret = disk_check_dev(fd);
+		close(fd);
+		return ret;
+
+	}
+
+	f = fopen("/proc/mtd", "r");
+	if ( ! f ) {
+		ERROR_INFO("Cannot open /proc/mtd");
+		ret = -1;
+	} else {
+		while ( fgets(buf, sizeof(buf), f) )
+			if ( sscanf(buf, "mtd%d:", &num) == 1 )
+				local_check_result(&ret, local_check_mtd(num));
+		fclose(f);
+	}
+
+	maj = -1;
+	min = -1;
+
+	local_find_internal_mydocs(&maj, &min);
+	if ( maj == -1 || min == -1 )
+		return ret;
+
+	fd = disk_open_dev(maj, min, 1, 1);
+	if ( fd < 0 ) {
+		local_check_result(&ret, -1);
+		return ret;
+	}
+
+	printf("Checking MyDocs mmc device...\n");
+	local_check_result(&ret, disk_check_dev(fd));
+	close(fd);
+
+	return ret;
 
 }
 
@@ -503,6 +749,54 @@ int local_reboot_device(void) {
 
 }
 
+static int local_cal_write(const char * name, const void * data, size_t len) {
+
+	if ( ! local_cal ) {
+		ERROR("Cannot open CAL");
+		return -1;
+	}
+
+	if ( simulate )
+		return 0;
+
+	if ( cal_write_block(local_cal, name, data, len, 0) != 0 ) {
+		ERROR("Cannot write %s to CAL", name);
+		return -1;
+	}
+
+	local_cal_dirty = 1;
+	return 0;
+
+}
+
+static int local_cal_write_str(const char * name, char * dest, size_t size, const char * str) {
+
+	if ( strlen(str) >= size ) {
+		ERROR("Value for %s is too long", name);
+		return -1;
+	}
+
+	if ( local_cal_write(name, str, strlen(str)+1) != 0 )
+		return -1;
+
+	strcpy(dest, str);
+	return 0;
+
+}
+
+static int local_set_rd(int enable, const char * flags) {
+
+	char buf[sizeof(rd_mode)];
+
+	if ( enable )
+		snprintf(buf, sizeof(buf), "master%s%s", flags[0] ? "," : "", flags);
+	else
+		snprintf(buf, sizeof(buf), "%s", flags);
+
+	return local_cal_write_str("r&d_mode", rd_mode, sizeof(rd_mode), buf);
+
+}
+
 int local_get_root_device(void) {
 
 	return root_device;
@@ -511,9 +805,20 @@ int local_get_root_device(void) {
 
 int local_set_root_device(int device) {
 
-	ERROR("Not implemented yet");
-	(void)device;
-	return -1;
+	const char * str;
+
+	if ( device == 1 )
+		str = "mmc";
+	else if ( device == 2 )
+		str = "usb";
+	else
+		str = "flash";
+
+	if ( local_cal_write("root_device", str, strlen(str)+1) != 0 )
+		return -1;
+
+	root_device = device;
+	return 0;
 
 }
 
@@ -525,9 +830,13 @@ int local_get_usb_host_mode(void) {
 
 int local_set_usb_host_mode(int enable) {
 
-	ERROR("Not implemented yet");
-	(void)enable;
-	return -1;
+	char value = enable ? 1 : 0;
+
+	if ( local_cal_write("usb_host_mode", &value, 1) != 0 )
+		return -1;
+
+	usb_host_mode = value;
+	return 0;
 
 }
 
@@ -542,9 +851,10 @@ int local_get_rd_mode(void) {
 
 int local_set_rd_mode(int enable) {
 
-	ERROR("Not implemented yet");
-	(void)enable;
-	return -1;
+	char flags[sizeof(rd_mode)];
+
+	local_get_rd_flags(flags, sizeof(flags));
+	return local_set_rd(enable, flags);
 
 }
 
@@ -573,9 +883,7 @@ int local_get_rd_flags(char * flags, size_t size) {
 
 int local_set_rd_flags(const char * flags) {
 
-	ERROR("Not implemented yet");
-	(void)flags;
-	return -1;
+	return local_set_rd(local_get_rd_mode(), flags);
 
 }
 
@@ -585,11 +893,17 @@ int16_t local_get_hwrev(void) {
 
 }
 
-int local_set_hwrev(int16_t hwrev) {
+int local_set_hwrev(int16_t new_hwrev) {
 
-	ERROR("Not implemented yet");
-	(void)hwrev;
-	return -1;
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%hd", new_hwrev);
+
+	if ( local_cal_write("hw-ver", buf, strlen(buf)+1) != 0 )
+		return -1;
+
+	hwrev = new_hwrev;
+	return 0;
 
 }
 
@@ -603,9 +917,7 @@ int local_get_kernel_ver(char * ver, size_t size) {
 
 int local_set_kernel_ver(const char * ver) {
 
-	ERROR("Not implemented yet");
-	(void)ver;
-	return -1;
+	return local_cal_write_str("kernel-ver", kernel_ver, sizeof(kernel_ver), ver);
 
 }
 
@@ -619,9 +931,7 @@ int local_get_initfs_ver(char * ver, size_t size) {
 
 int local_set_initfs_ver(const char * ver) {
 
-	ERROR("Not implemented yet");
-	(void)ver;
-	return -1;
+	return local_cal_write_str("initfs-ver", initfs_ver, sizeof(initfs_ver), ver);
 
 }
 
@@ -635,9 +945,7 @@ int local_get_nolo_ver(char * ver, size_t size) {
 
 int local_set_nolo_ver(const char * ver) {
 
-	ERROR("Not implemented yet");
-	(void)ver;
-	return -1;
+	return local_cal_write_str("nolo-ver", nolo_ver, sizeof(nolo_ver), ver);
 
 }
 
@@ -651,9 +959,7 @@ int local_get_sw_ver(char * ver, size_t size) {
 
 int local_set_sw_ver(const char * ver) {
 
-	ERROR("Not implemented yet");
-	(void)ver;
-	return -1;
+	return local_cal_write_str("sw-release-ver", sw_ver, sizeof(sw_ver), ver);
 
 }
 
@@ -667,8 +973,23 @@ int local_get_content_ver(char * ver, size_t size) {
 
 int local_set_content_ver(const char * ver) {
 
-	ERROR("Not implemented yet");
-	(void)ver;
-	return -1;
+	return local_cal_write_str("content-ver", content_ver, sizeof(content_ver), ver);
+
+}
+
+int local_flush_config(void) {
+
+	if ( ! local_cal_dirty )
+		return 0;
+
+	local_cal_dirty = 0;
+
+	/* All staged blocks are written together to save NAND program and erase cycles */
+	if ( cal_flush(local_cal) != 0 ) {
+		ERROR("Cannot write configuration to CAL");
+		return -1;
+	}
+
+	return 0;
 
 }
@@ -19,15 +19,22 @@
 #ifndef LOCAL_H
 #define LOCAL_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "image.h"
 #include "device.h"
 
 int local_init(void);
+void local_exit(void);
 
 enum device local_get_device(void);
 
 int local_flash_image(struct image * image);
+int local_verify_image(struct image * image);
 int local_dump_image(enum image_type image, const char * file);
+int local_dump_image_to_fd(enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash);
+uint64_t local_dump_image_max_size(enum image_type image);
 int local_check_badblocks(const char * device);
 
 int local_reboot_device(void);
@@ -62,4 +69,6 @@ int local_set_sw_ver(const char * ver);
 int local_get_content_ver(char * ver, size_t size);
 int local_set_content_ver(const char * ver);
 
+int local_flush_config(void);
+
 #endif
@@ -25,9 +25,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
-#include <unistd.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "global.h"
 
@@ -35,6 +37,12 @@
 #include "fiasco.h"
 #include "device.h"
 #include "operations.h"
+#include "dump.h"
+#include "daemon.h"
+#include "report.h"
+#include "local.h"
+#include "usb-trace.h"
+#include "buffer.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -54,8 +62,9 @@ static void show_usage(void) {
 		" -r              reboot device\n"
 		" -l              load kernel and initfs images to RAM\n"
 		" -f              flash all specified images\n"
+		" -V              verify all specified images on device (after flashing with -f)\n"
 		" -c              cold flash 2nd and secondary images\n"
-		" -x [/dev/mtd]   check for bad blocks on mtd device (default: all)\n"
+		" -x [device]     check bad blocks and read speed of mtd or mmc device (default: all)\n"
 		" -E file         dump all device images to one fiasco image\n"
 		" -e [dir]        dump all device images (or one -t) to directory (default: current)\n"
 		"\n"
@@ -99,6 +108,12 @@ static void show_usage(void) {
 
 		"Other options:\n"
 		" -i              identify images\n"
+		" -P host[:port]  use Mk II protocol over TCP (e.g. softupd) instead of USB\n"
+		" -a              dump only allocated clusters of FAT filesystem in mmc image\n"
+		" -J socket       run as daemon, accept jobs (options) on unix socket\n"
+		" -B file         run jobs (options) from batch file, one per line\n"
+		" -O file         write JSON report with timing of all operation phases\n"
+		" -L mb           limit memory used by transfer buffers to mb megabytes\n"
 		" -s              simulate, do not flash or write on disk\n"
 		" -n              disable hash, checksum and image type checking\n"
 		" -v              be verbose and noisy\n"
@@ -142,6 +157,16 @@ static void show_usage(void) {
 int simulate;
 int noverify;
 int verbose;
+char * mkii_tcp;
+int dump_fat;
+
+/* Device and its versions left by previous line of batch file */
+static struct device_info * batch_dev;
+static char nolo_ver[512];
+static char kernel_ver[512];
+static char initfs_ver[512];
+static char sw_ver[512];
+static char content_ver[512];
 
 /* arg = [[[dev:[hw:]]ver:]type:]file[%%lay] */
 static void parse_image_arg(char * arg, struct image_list ** image_first) {
@@ -326,10 +351,116 @@ static const char * image_tmp_name(enum image_type type) {
 
 }
 
+struct dump_fiasco_arg {
+	struct device_info * dev;
+	enum image_type type;
+};
+
+static int dump_fiasco_image(void * priv, int fd, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	struct dump_fiasco_arg * arg = priv;
+
+	return dev_dump_image_to_fd(arg->dev, arg->type, fd, offset, length, hash);
+
+}
+
+/* Images are dumped in this order, eMMC first as it is the largest one */
+static const enum image_type dump_order[] = {
+	IMAGE_MMC,
+	IMAGE_XLOADER,
+	IMAGE_SECONDARY,
+	IMAGE_KERNEL,
+	IMAGE_INITFS,
+	IMAGE_ROOTFS,
+};
+
+/* eMMC and NAND are independent devices, eMMC is dumped in separate thread */
+struct dump_mmc_arg {
+	struct device_info * dev;
+	struct fiasco * fiasco;
+	struct image * image;
+	int ret;
+};
+
+static void * dump_mmc_thread(void * priv) {
+
+	struct dump_mmc_arg * arg = priv;
+	struct dump_fiasco_arg dump_arg;
+
+	if ( arg->fiasco ) {
+		dump_arg.dev = arg->dev;
+		dump_arg.type = IMAGE_MMC;
+		arg->ret = fiasco_stream_image(arg->fiasco, arg->image, dump_fiasco_image, &dump_arg);
+	} else {
+		arg->ret = dev_dump_image(arg->dev, IMAGE_MMC, image_tmp_name(IMAGE_MMC));
+	}
+
+	return NULL;
+
+}
+
+static int dump_mmc_start(pthread_t * thread, struct dump_mmc_arg * arg, struct device_info * dev, struct fiasco * fiasco, struct image * image) {
+
+	/* Only local device has eMMC and NAND accessible at same time */
+	if ( dev->method != METHOD_LOCAL )
+		return -1;
+
+	arg->dev = dev;
+	arg->fiasco = fiasco;
+	arg->image = image;
+	arg->ret = 0;
+
+	if ( pthread_create(thread, NULL, dump_mmc_thread, arg) != 0 )
+		return -1;
+
+	return 0;
+
+}
+
+/* NAND images are staged next to fiasco file while eMMC is dumped, check that they fit there */
+static int dump_staging_fits(const char * file) {
+
+	struct statvfs buf;
+	uint64_t need = 0;
+	char * path;
+	size_t i;
+	int ret;
+
+	for ( i = 0; i < sizeof(dump_order)/sizeof(dump_order[0]); ++i )
+		need += local_dump_image_max_size(dump_order[i]);
+
+	path = strdup(file);
+	if ( ! path )
+		return 0;
+
+	ret = statvfs(dirname(path), &buf);
+	free(path);
+
+	/* Staged image is removed only after it is copied into fiasco file */
+	if ( ret != 0 || (uint64_t)buf.f_frsize * buf.f_bavail < 2 * need )
+		return 0;
+
+	return 1;
+
+}
+
+struct dump_file_arg {
+	int fd;
+	uint64_t size;
+};
+
+static int dump_fiasco_file(void * priv, int fd, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	struct dump_file_arg * arg = priv;
+
+	return dump_copy(arg->fd, arg->size, fd, offset, -1, length, hash);
+
+}
+
 int main(int argc, char **argv) {
 
 	const char * optstring = ":"
-	"b:rlfcx:E:e:"
+	"b:rlfVcx:E:e:"
 	"ID:U:R:F:H:K:T:N:S:C:"
 	"M:m:"
 	"t:d:w:"
@@ -337,6 +468,10 @@ int main(int argc, char **argv) {
 	"i"
 	"p"
 	"Q"
+	"P:"
+	"a"
+	"J:B:"
+	"O:L:"
 	"snvh"
 	"";
 	int c;
@@ -358,6 +493,7 @@ int main(int argc, char **argv) {
 	char * dev_dump_arg = NULL;
 
 	int dev_flash = 0;
+	int dev_verify = 0;
 	int dev_reboot = 0;
 	int dev_ident = 0;
 
@@ -399,6 +535,17 @@ int main(int argc, char **argv) {
 
 	int image_ident = 0;
 
+	int run_daemon = 0;
+	char * run_daemon_arg = NULL;
+	int run_batch = 0;
+	char * run_batch_arg = NULL;
+	char * job_opts[8];
+	int write_report = 0;
+	char * write_report_arg = NULL;
+	int report_id;
+	int buffer_limit = 0;
+	char * buffer_limit_arg = NULL;
+
 	int help = 0;
 
 	struct image_list * image_first = NULL;
@@ -421,22 +568,16 @@ int main(int argc, char **argv) {
 	enum device detected_device = DEVICE_UNKNOWN;
 	int16_t detected_hwrev = -1;
 
-	struct stat st;
-
 	int i;
 	char buf[512];
 	char * ptr = NULL;
-	char * tmp = NULL;
 
-	char nolo_ver[512];
-	char kernel_ver[512];
-	char initfs_ver[512];
-	char sw_ver[512];
-	char content_ver[512];
 
 	simulate = 0;
 	noverify = 0;
 	verbose = 0;
+	mkii_tcp = NULL;
+	dump_fat = 0;
 
 	show_title();
 
@@ -513,6 +654,9 @@ int main(int argc, char **argv) {
 			case 'f':
 				dev_flash = 1;
 				break;
+			case 'V':
+				dev_verify = 1;
+				break;
 			case 'r':
 				dev_reboot = 1;
 				break;
@@ -598,6 +742,29 @@ int main(int argc, char **argv) {
 				image_ident = 1;
 				break;
 
+			case 'P':
+				mkii_tcp = optarg;
+				break;
+			case 'a':
+				dump_fat = 1;
+				break;
+			case 'J':
+				run_daemon = 1;
+				run_daemon_arg = optarg;
+				break;
+			case 'B':
+				run_batch = 1;
+				run_batch_arg = optarg;
+				break;
+			case 'O':
+				write_report = 1;
+				write_report_arg = optarg;
+				break;
+			case 'L':
+				buffer_limit = 1;
+				buffer_limit_arg = optarg;
+				break;
+
 			case 's':
 				simulate = 1;
 				break;
@@ -622,19 +789,31 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
-	if ( dev_boot || dev_reboot || dev_load || dev_flash || dev_cold_flash || dev_ident || dev_check || dev_dump_fiasco || dev_dump
+	if ( write_report )
+		report_enable();
+
+	if ( buffer_limit ) {
+		if ( atoi(buffer_limit_arg) <= 0 || ( (size_t)atoi(buffer_limit_arg) << 20 ) < BUFFER_MIN_LIMIT ) {
+			ERROR("Invalid buffer limit '%s', minimum is %lu MB", buffer_limit_arg, BUFFER_MIN_LIMIT >> 20);
+			ret = 1;
+			goto clean;
+		}
+		buffer_set_limit((size_t)atoi(buffer_limit_arg) << 20);
+	}
+
+	if ( dev_boot || dev_reboot || dev_load || dev_flash || dev_verify || dev_cold_flash || dev_ident || dev_check || dev_dump_fiasco || dev_dump
 		|| set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc )
 		do_device = 1;
 
 	if ( dev_boot || dev_load || dev_cold_flash )
 		do_something = 1;
-	if ( dev_check || dev_dump_fiasco || dev_dump )
+	if ( dev_check || dev_verify || dev_dump_fiasco || dev_dump )
 		do_something = 1;
 	if ( dev_flash || dev_reboot || dev_ident || set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc )
 		do_something = 1;
 	if ( fiasco_un || fiasco_gen || image_ident )
 		do_something = 1;
-	if ( help )
+	if ( help || run_daemon || run_batch )
 		do_something = 1;
 
 	if ( ! do_something ) {
@@ -652,6 +831,50 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
+	/* daemon and batch */
+	if ( run_daemon || run_batch ) {
+		if ( run_daemon && run_batch ) {
+			ERROR("Cannot run daemon and batch file together");
+			ret = 1;
+			goto clean;
+		}
+		if ( daemon_is_job() ) {
+			ERROR("Daemon or batch option in job");
+			ret = 1;
+			goto clean;
+		}
+		if ( do_device || image_first || image_fiasco ) {
+			ERROR("Device and image options must be specified in job");
+			ret = 1;
+			goto clean;
+		}
+		/* Jobs reset global options, so pass them to every job */
+		i = 0;
+		if ( simulate )
+			job_opts[i++] = "-s";
+		if ( noverify )
+			job_opts[i++] = "-n";
+		if ( verbose )
+			job_opts[i++] = "-v";
+		if ( dump_fat )
+			job_opts[i++] = "-a";
+		if ( mkii_tcp ) {
+			job_opts[i++] = "-P";
+			job_opts[i++] = mkii_tcp;
+		}
+		job_opts[i] = NULL;
+		if ( run_daemon )
+			ret = daemon_run(run_daemon_arg, job_opts, main);
+		else
+			ret = daemon_run_file(run_batch_arg, job_opts, main);
+		ret = ( ret == 0 ) ? 0 : 1;
+		if ( batch_dev ) {
+			dev_free(batch_dev);
+			batch_dev = NULL;
+		}
+		goto clean;
+	}
+
 	/* load images from files */
 	if ( image_first && image_fiasco ) {
 		ERROR("Cannot specify normal and fiasco images together");
@@ -775,7 +998,7 @@ int main(int argc, char **argv) {
 	}
 
 	/* remove 2nd image when doing normal flash */
-	if ( dev_flash ) {
+	if ( dev_flash || dev_verify ) {
 		image_ptr = image_first;
 		while ( image_ptr ) {
 			struct image_list * next = image_ptr->next;
@@ -904,9 +1127,18 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
+	if ( dev_verify && ! image_first ) {
+		ERROR("No image specified for verifying");
+		ret = 1;
+		goto clean;
+	}
+
 	/* operations */
 	if ( do_device ) {
 
+		struct image_list * pending;
+		int identified = 0;
+		int config_done = 0;
 		int again = 1;
 
 		while ( again ) {
@@ -916,7 +1148,15 @@ int main(int argc, char **argv) {
 			if ( dev )
 				dev_free(dev);
 
-			dev = dev_detect();
+			if ( batch_dev ) {
+				/* Device is still in mode and identified by previous line of batch file */
+				dev = batch_dev;
+				batch_dev = NULL;
+				identified = 1;
+			} else {
+				dev = dev_detect();
+			}
+
 			if ( ! dev ) {
 				ERROR("No device detected");
 				break;
@@ -925,7 +1165,9 @@ int main(int argc, char **argv) {
 			/* cold flash */
 			if ( dev_cold_flash ) {
 
+				report_id = report_begin("cold flash", IMAGE_UNKNOWN);
 				ret = dev_cold_flash_images(dev, image_2nd, image_secondary);
+				report_end(report_id, 0, ret);
 				dev_free(dev);
 				dev = NULL;
 
@@ -947,91 +1189,100 @@ int main(int argc, char **argv) {
 
 			}
 
-			if ( ! dev->detected_device )
-				printf("Device: (not detected)\n");
-			else
-				printf("Device: %s\n", device_to_string(dev->detected_device));
-
-			if ( dev->detected_hwrev <= 0 )
-				printf("HW revision: (not detected)\n");
-			else
-				printf("HW revision: %d\n", dev->detected_hwrev);
-
-			nolo_ver[0] = 0;
-			dev_get_nolo_ver(dev, nolo_ver, sizeof(nolo_ver));
-			printf("NOLO version: %s\n", nolo_ver[0] ? nolo_ver : "(not detected)");
-
-			kernel_ver[0] = 0;
-			dev_get_kernel_ver(dev, kernel_ver, sizeof(kernel_ver));
-			printf("Kernel version: %s\n", kernel_ver[0] ? kernel_ver : "(not detected)");
-
-			initfs_ver[0] = 0;
-			dev_get_initfs_ver(dev, initfs_ver, sizeof(initfs_ver));
-			printf("Initfs version: %s\n", initfs_ver[0] ? initfs_ver : "(not detected)");
-
-			sw_ver[0] = 0;
-			dev_get_sw_ver(dev, sw_ver, sizeof(sw_ver));
-			printf("Software release version: %s\n", sw_ver[0] ? sw_ver : "(not detected)");
-
-			content_ver[0] = 0;
-			dev_get_content_ver(dev, content_ver, sizeof(content_ver));
-			printf("Content eMMC version: %s\n", content_ver[0] ? content_ver : "(not detected)");
-
-			ret = dev_get_root_device(dev);
-			printf("Root device: ");
-			if ( ret == 0 )
-				printf("flash");
-			else if ( ret == 1 )
-				printf("mmc");
-			else if ( ret == 2 )
-				printf("usb");
-			else
-				printf("(not detected)");
-			printf("\n");
+			/* identify device only once, not after every mode switch */
+			if ( ! identified || dev_ident ) {
 
-			ret = dev_get_usb_host_mode(dev);
-			printf("USB host mode: ");
-			if ( ret == 0 )
-				printf("disabled");
-			else if ( ret == 1 )
-				printf("enabled");
-			else
-				printf("(not detected)");
-			printf("\n");
+				report_id = report_begin("identify", IMAGE_UNKNOWN);
 
-			ret = dev_get_rd_mode(dev);
-			printf("R&D mode: ");
-			if ( ret == 0 )
-				printf("disabled");
-			else if ( ret == 1 )
-				printf("enabled");
-			else
-				printf("(not detected)");
-			printf("\n");
+				if ( ! dev->detected_device )
+					printf("Device: (not detected)\n");
+				else
+					printf("Device: %s\n", device_to_string(dev->detected_device));
 
-			if ( ret == 1 ) {
-				buf[0] = 0;
-				ret = dev_get_rd_flags(dev, buf, sizeof(buf));
-				printf("R&D flags: ");
-				if ( ret < 0 )
+				if ( dev->detected_hwrev <= 0 )
+					printf("HW revision: (not detected)\n");
+				else
+					printf("HW revision: %d\n", dev->detected_hwrev);
+
+				nolo_ver[0] = 0;
+				dev_get_nolo_ver(dev, nolo_ver, sizeof(nolo_ver));
+				printf("NOLO version: %s\n", nolo_ver[0] ? nolo_ver : "(not detected)");
+
+				kernel_ver[0] = 0;
+				dev_get_kernel_ver(dev, kernel_ver, sizeof(kernel_ver));
+				printf("Kernel version: %s\n", kernel_ver[0] ? kernel_ver : "(not detected)");
+
+				initfs_ver[0] = 0;
+				dev_get_initfs_ver(dev, initfs_ver, sizeof(initfs_ver));
+				printf("Initfs version: %s\n", initfs_ver[0] ? initfs_ver : "(not detected)");
+
+				sw_ver[0] = 0;
+				dev_get_sw_ver(dev, sw_ver, sizeof(sw_ver));
+				printf("Software release version: %s\n", sw_ver[0] ? sw_ver : "(not detected)");
+
+				content_ver[0] = 0;
+				dev_get_content_ver(dev, content_ver, sizeof(content_ver));
+				printf("Content eMMC version: %s\n", content_ver[0] ? content_ver : "(not detected)");
+
+				ret = dev_get_root_device(dev);
+				printf("Root device: ");
+				if ( ret == 0 )
+					printf("flash");
+				else if ( ret == 1 )
+					printf("mmc");
+				else if ( ret == 2 )
+					printf("usb");
+				else
 					printf("(not detected)");
+				printf("\n");
+
+				ret = dev_get_usb_host_mode(dev);
+				printf("USB host mode: ");
+				if ( ret == 0 )
+					printf("disabled");
+				else if ( ret == 1 )
+					printf("enabled");
 				else
-					printf("%s", buf);
+					printf("(not detected)");
 				printf("\n");
-			}
 
-			/* device identify */
-			if ( dev_ident ) {
-				if ( ! dev->detected_device ) {
-					dev_reboot_device(dev);
-					goto again;
+				ret = dev_get_rd_mode(dev);
+				printf("R&D mode: ");
+				if ( ret == 0 )
+					printf("disabled");
+				else if ( ret == 1 )
+					printf("enabled");
+				else
+					printf("(not detected)");
+				printf("\n");
+
+				if ( ret == 1 ) {
+					buf[0] = 0;
+					ret = dev_get_rd_flags(dev, buf, sizeof(buf));
+					printf("R&D flags: ");
+					if ( ret < 0 )
+						printf("(not detected)");
+					else
+						printf("%s", buf);
+					printf("\n");
 				}
-				dev_free(dev);
-				dev = NULL;
-				break;
-			}
 
-			printf("\n");
+				report_end(report_id, 0, 0);
+
+				/* device identify */
+				if ( dev_ident ) {
+					if ( ! dev->detected_device ) {
+						dev_reboot_device(dev);
+						goto again;
+					}
+					break;
+				}
+
+				printf("\n");
+
+				identified = 1;
+
+			}
 
 			/* filter images by device & hwrev */
 			if ( detected_device )
@@ -1095,9 +1346,15 @@ int main(int argc, char **argv) {
 			/* load */
 			if ( dev_load ) {
 				if ( image_kernel ) {
+					report_id = report_begin("load", IMAGE_KERNEL);
 					ret = dev_load_image(dev, image_kernel->image);
-					if ( ret < 0 )
+					report_end(report_id, ret == 0 ? image_kernel->image->size : 0, ret);
+					if ( ret == -EAGAIN )
 						goto again;
+					if ( ret < 0 ) {
+						ret = 1;
+						goto clean;
+					}
 
 					if ( image_kernel == image_first )
 						image_first = image_first->next;
@@ -1109,9 +1366,15 @@ int main(int argc, char **argv) {
 				}
 
 				if ( image_initfs ) {
+					report_id = report_begin("load", IMAGE_INITFS);
 					ret = dev_load_image(dev, image_initfs->image);
-					if ( ret < 0 )
+					report_end(report_id, ret == 0 ? image_initfs->image->size : 0, ret);
+					if ( ret == -EAGAIN )
 						goto again;
+					if ( ret < 0 ) {
+						ret = 1;
+						goto clean;
+					}
 
 					if ( image_initfs == image_first )
 						image_first = image_first->next;
@@ -1123,14 +1386,46 @@ int main(int argc, char **argv) {
 				}
 			}
 
-			/* flash */
-			if ( dev_flash ) {
+			/* read images into memory meantime flashing and device reboots, local flashing has nothing to overlap */
+			if ( dev_flash && dev->method == METHOD_USB )
+				image_prefetch_start(image_first);
+
+			/* flash and verify, images which cannot be flashed in current mode are postponed */
+			pending = NULL;
+			if ( dev_flash || dev_verify ) {
+				int verify_failed = 0;
 				image_ptr = image_first;
 				while ( image_ptr ) {
 					struct image_list * next = image_ptr->next;
-					ret = dev_flash_image(dev, image_ptr->image);
-					if ( ret < 0 )
-						goto again;
+					if ( dev_flash ) {
+						if ( ! dev_can_flash_image(dev, image_ptr->image) ) {
+							if ( ! pending )
+								pending = image_ptr;
+							image_ptr = next;
+							continue;
+						}
+						if ( image_prefetch_wait(image_ptr->image) < 0 ) {
+							ret = 1;
+							goto clean;
+						}
+						report_id = report_begin("flash", image_ptr->image->type);
+						ret = dev_flash_image(dev, image_ptr->image);
+						report_end(report_id, ret == 0 ? image_ptr->image->size : 0, ret);
+						/* Only mode switch is retried, failed transfer would fail again */
+						if ( ret == -EAGAIN )
+							goto again;
+						if ( ret < 0 ) {
+							ret = 1;
+							goto clean;
+						}
+					}
+					if ( dev_verify ) {
+						report_id = report_begin("verify", image_ptr->image->type);
+						ret = dev_verify_image(dev, image_ptr->image);
+						report_end(report_id, ret == 0 ? image_ptr->image->size : 0, ret);
+						if ( ret != 0 )
+							verify_failed = 1;
+					}
 
 					if ( image_ptr == image_first )
 						image_first = image_first->next;
@@ -1140,69 +1435,95 @@ int main(int argc, char **argv) {
 					image_list_del(image_ptr);
 					image_ptr = next;
 				}
+				if ( verify_failed ) {
+					ERROR("Verifying images failed");
+					ret = 1;
+					goto clean;
+				}
 			}
 
-			/* configuration */
+			/* configuration, done before leaving NOLO for postponed images */
 			ret = 0;
-			if ( set_rd_flags ) {
-				set_rd = 1;
-				set_rd_arg = "1";
-			}
+			if ( ! config_done && ( ! pending || dev_can_set_config(dev) ) ) {
 
-			if ( sw_ver[0] && dev_flash && ! set_sw && fiasco_in && fiasco_in->swver[0] && strcmp(fiasco_in->swver, sw_ver) != 0 ) {
-				set_sw = 1;
-				set_sw_arg = fiasco_in->swver;
-			}
+				if ( set_rd_flags ) {
+					set_rd = 1;
+					set_rd_arg = "1";
+				}
 
-			if ( set_root )
-				ret = dev_set_root_device(dev, atoi(set_root_arg));
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( sw_ver[0] && dev_flash && ! set_sw && fiasco_in && fiasco_in->swver[0] && strcmp(fiasco_in->swver, sw_ver) != 0 ) {
+					set_sw = 1;
+					set_sw_arg = fiasco_in->swver;
+				}
 
-			if ( set_usb )
-				ret = dev_set_usb_host_mode(dev, atoi(set_usb_arg));
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_root )
+					ret = dev_set_root_device(dev, atoi(set_root_arg));
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_rd )
-				ret = dev_set_rd_mode(dev, atoi(set_rd_arg));
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_usb )
+					ret = dev_set_usb_host_mode(dev, atoi(set_usb_arg));
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_rd_flags )
-				ret = dev_set_rd_flags(dev, set_rd_flags_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_rd )
+					ret = dev_set_rd_mode(dev, atoi(set_rd_arg));
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_hw )
-				ret = dev_set_hwrev(dev, atoi(set_hw_arg));
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_rd_flags )
+					ret = dev_set_rd_flags(dev, set_rd_flags_arg);
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_nolo )
-				ret = dev_set_nolo_ver(dev, set_nolo_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_hw )
+					ret = dev_set_hwrev(dev, atoi(set_hw_arg));
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_kernel )
-				ret = dev_set_kernel_ver(dev, set_kernel_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_nolo )
+					ret = dev_set_nolo_ver(dev, set_nolo_arg);
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_initfs )
-				ret = dev_set_initfs_ver(dev, set_initfs_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_kernel )
+					ret = dev_set_kernel_ver(dev, set_kernel_arg);
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_sw )
-				ret = dev_set_sw_ver(dev, set_sw_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_initfs )
+					ret = dev_set_initfs_ver(dev, set_initfs_arg);
+				if ( ret == -EAGAIN )
+					goto again;
 
-			if ( set_emmc )
-				ret = dev_set_content_ver(dev, set_emmc_arg);
-			if ( ret == -EAGAIN )
-				goto again;
+				if ( set_sw )
+					ret = dev_set_sw_ver(dev, set_sw_arg);
+				if ( ret == -EAGAIN )
+					goto again;
+
+				if ( set_emmc )
+					ret = dev_set_content_ver(dev, set_emmc_arg);
+				if ( ret == -EAGAIN )
+					goto again;
+
+				config_done = 1;
+
+				if ( dev_flush_config(dev) < 0 ) {
+					ret = 1;
+					goto clean;
+				}
+
+			}
+
+			/* switch to mode which can flash postponed images */
+			if ( pending ) {
+				ret = dev_flash_image(dev, pending->image);
+				if ( ret == -EAGAIN )
+					goto again;
+				ERROR("Cannot switch to mode which can flash image %s", image_type_to_string(pending->image->type));
+				ret = 1;
+				goto clean;
+			}
 
 			/* check */
 			if ( dev_check )
@@ -1212,12 +1533,6 @@ int main(int argc, char **argv) {
 
 			/* dump */
 
-			if ( dev_dump_fiasco ) {
-				dev_dump = 1;
-				tmp = strdup(dev_dump_fiasco_arg);
-				dev_dump_arg = dirname(tmp);
-			}
-
 			if ( dev_dump ) {
 
 				buf[0] = 0;
@@ -1240,9 +1555,14 @@ int main(int argc, char **argv) {
 					if ( ret != 0 )
 						goto clean;
 				} else {
-					for ( i = 0; i < IMAGE_COUNT; ++i )
-						if ( image_tmp_name(i) )
-							dev_dump_image(dev, i, image_tmp_name(i));
+					pthread_t mmc_thread;
+					struct dump_mmc_arg mmc_arg;
+					int mmc_parallel = ( dump_mmc_start(&mmc_thread, &mmc_arg, dev, NULL, NULL) == 0 );
+					for ( i = 0; i < (int)(sizeof(dump_order)/sizeof(dump_order[0])); ++i )
+						if ( dump_order[i] != IMAGE_MMC || ! mmc_parallel )
+							dev_dump_image(dev, dump_order[i], image_tmp_name(dump_order[i]));
+					if ( mmc_parallel )
+						pthread_join(mmc_thread, NULL);
 				}
 
 				if ( buf[0] )
@@ -1253,81 +1573,197 @@ int main(int argc, char **argv) {
 
 			}
 
-			/* dump fiasco */
+			/* dump fiasco, images are streamed directly to fiasco file */
 			if ( dev_dump_fiasco ) {
 
-				struct image_list * image_dump_first = NULL;
-				struct image * image_dump = NULL;
+				struct dump_fiasco_arg dump_arg;
+				struct dump_file_arg file_arg;
+				struct dump_mmc_arg mmc_arg;
+				struct image * image_dump[IMAGE_COUNT];
+				enum image_type filter = IMAGE_UNKNOWN;
+				enum image_type type;
+				pthread_t mmc_thread;
+				int mmc_parallel = 0;
+				int dump_ret = 0;
+				struct stat st;
 
-				for ( i = 0; i < IMAGE_COUNT; ++i ) {
+				if ( filter_type )
+					filter = image_type_from_string(filter_type_arg);
 
-					if ( ! image_tmp_name(i) || ( stat(image_tmp_name(i), &st) < 0 && errno == ENOENT ) )
-						continue;
+				fiasco_out = fiasco_alloc_empty();
+				if ( ! fiasco_out ) {
+					ERROR("Cannot write images to fiasco file %s", dev_dump_fiasco_arg);
+					dump_ret = -1;
+				} else {
 
-					buf[0] = 0;
-					snprintf(buf, sizeof(buf), "%hd", dev->detected_hwrev);
+					strncpy(fiasco_out->swver, sw_ver, sizeof(fiasco_out->swver));
+					fiasco_out->swver[sizeof(fiasco_out->swver)-1] = 0;
 
-					switch ( i ) {
-						case IMAGE_2ND:
-						case IMAGE_XLOADER:
-						case IMAGE_SECONDARY:
-							ptr = nolo_ver;
-							break;
+					if ( fiasco_stream_begin(fiasco_out, dev_dump_fiasco_arg) == 0 ) {
 
-						case IMAGE_KERNEL:
-							ptr = kernel_ver;
-							break;
+						memset(image_dump, 0, sizeof(image_dump));
 
-						case IMAGE_INITFS:
-							ptr = initfs_ver;
-							break;
+						for ( i = 0; i < (int)(sizeof(dump_order)/sizeof(dump_order[0])); ++i ) {
 
-						case IMAGE_ROOTFS:
-							ptr = sw_ver;
-							break;
+							type = dump_order[i];
 
-						case IMAGE_MMC:
-							ptr = content_ver;
-							break;
+							if ( filter_type && type != filter )
+								continue;
 
-						default:
-							ptr = NULL;
-							break;
-					}
+							buf[0] = 0;
+							snprintf(buf, sizeof(buf), "%hd", dev->detected_hwrev);
 
-					image_dump = image_alloc_from_file(image_tmp_name(i), image_type_to_string(i), device_to_string(dev->detected_device), buf, ptr, NULL);
+							switch ( type ) {
+								case IMAGE_XLOADER:
+								case IMAGE_SECONDARY:
+									ptr = nolo_ver;
+									break;
 
-					if ( ! image_dump )
-						continue;
+								case IMAGE_KERNEL:
+									ptr = kernel_ver;
+									break;
 
-					image_list_add(&image_dump_first, image_dump);
+								case IMAGE_INITFS:
+									ptr = initfs_ver;
+									break;
 
-				}
+								case IMAGE_ROOTFS:
+									ptr = sw_ver;
+									break;
 
-				printf("\n");
+								case IMAGE_MMC:
+									ptr = content_ver;
+									break;
 
-				fiasco_out = fiasco_alloc_empty();
-				if ( ! fiasco_out ) {
-					ERROR("Cannot write images to fiasco file %s", dev_dump_fiasco_arg);
-				} else {
-					strncpy(fiasco_out->swver, sw_ver, sizeof(fiasco_out->swver));
-					fiasco_out->swver[sizeof(fiasco_out->swver)-1] = 0;
-					fiasco_out->first = image_dump_first;
-					fiasco_write_to_file(fiasco_out, dev_dump_fiasco_arg);
-					fiasco_free(fiasco_out); /* this will also free list image_dump_first */
-				}
+								default:
+									ptr = NULL;
+									break;
+							}
+
+							image_dump[type] = image_alloc_empty(image_type_to_string(type), device_to_string(dev->detected_device), buf, ptr, NULL);
+
+						}
+
+						if ( filter_type && ! image_dump[filter] ) {
+							ERROR("Cannot dump image %s to fiasco file", filter_type_arg);
+							dump_ret = -1;
+						}
+
+						/*
+						 * Fiasco images are stored sequentially and size of eMMC image is not known
+						 * until its dump finish, so NAND images are dumped to temporary files in
+						 * meantime and appended to fiasco file after eMMC image. NAND images are
+						 * small, so writing them twice costs less than waiting for eMMC. Without
+						 * space for them, or without eMMC (only RX-51 has it), all images are
+						 * dumped sequentially directly to fiasco file.
+						 */
+						if ( image_dump[IMAGE_MMC] && ! filter_type && dev->method == METHOD_LOCAL && dev->detected_device == DEVICE_RX_51 ) {
+							if ( dump_staging_fits(dev_dump_fiasco_arg) )
+								mmc_parallel = ( dump_mmc_start(&mmc_thread, &mmc_arg, dev, fiasco_out, image_dump[IMAGE_MMC]) == 0 );
+							else
+								printf("Not enough free space for temporary NAND images, dumping eMMC and NAND sequentially\n");
+						}
+
+						for ( i = 0; i < (int)(sizeof(dump_order)/sizeof(dump_order[0])); ++i ) {
+
+							type = dump_order[i];
+
+							if ( ! image_dump[type] || ( type == IMAGE_MMC && mmc_parallel ) )
+								continue;
+
+							if ( mmc_parallel ) {
+								snprintf(buf, sizeof(buf), "%s.%s", dev_dump_fiasco_arg, image_tmp_name(type));
+								if ( dev_dump_image(dev, type, buf) != 0 )
+									dump_ret = -1;
+								continue;
+							}
+
+							dump_arg.dev = dev;
+							dump_arg.type = type;
+
+							/* Without filter, images which device does not have are skipped */
+							if ( fiasco_stream_image(fiasco_out, image_dump[type], dump_fiasco_image, &dump_arg) != 0 && filter_type )
+								dump_ret = -1;
+							image_dump[type] = NULL;
+
+						}
 
-				for ( i = 0; i < IMAGE_COUNT; ++i )
-					if ( image_tmp_name(i) )
-						unlink(image_tmp_name(i));
+						if ( mmc_parallel ) {
 
-				free(tmp);
-				tmp = NULL;
-				dev_dump_arg = NULL;
+							pthread_join(mmc_thread, NULL);
+							image_dump[IMAGE_MMC] = NULL;
+							if ( mmc_arg.ret != 0 )
+								dump_ret = -1;
+
+							for ( i = 0; i < (int)(sizeof(dump_order)/sizeof(dump_order[0])); ++i ) {
+
+								type = dump_order[i];
+
+								if ( ! image_dump[type] )
+									continue;
+
+								snprintf(buf, sizeof(buf), "%s.%s", dev_dump_fiasco_arg, image_tmp_name(type));
+
+								/* Fiasco file is incomplete after failure, only remove staged images */
+								if ( dump_ret != 0 ) {
+									unlink(buf);
+									image_free(image_dump[type]);
+									image_dump[type] = NULL;
+									continue;
+								}
+
+								file_arg.fd = open(buf, O_RDONLY);
+								if ( file_arg.fd < 0 && errno == ENOENT ) {
+									/* Image was empty */
+									image_free(image_dump[type]);
+									image_dump[type] = NULL;
+									continue;
+								}
+
+								if ( file_arg.fd < 0 || fstat(file_arg.fd, &st) != 0 ) {
+									ERROR_INFO("Cannot read temporary image %s", buf);
+									if ( file_arg.fd >= 0 )
+										close(file_arg.fd);
+									unlink(buf);
+									image_free(image_dump[type]);
+									image_dump[type] = NULL;
+									dump_ret = -1;
+									continue;
+								}
+
+								file_arg.size = st.st_size;
+
+								if ( fiasco_stream_image(fiasco_out, image_dump[type], dump_fiasco_file, &file_arg) != 0 )
+									dump_ret = -1;
+								image_dump[type] = NULL;
+
+								close(file_arg.fd);
+								unlink(buf);
+
+							}
+
+						}
+
+						if ( fiasco_stream_end(fiasco_out) != 0 )
+							dump_ret = -1;
+
+					} else {
+						dump_ret = -1;
+					}
+
+					fiasco_free(fiasco_out);
+					fiasco_out = NULL;
+
+				}
+
+				if ( dump_ret != 0 ) {
+					ret = 1;
+					goto clean;
+				}
 
 			}
 
-			if ( ! dev_dump_fiasco ) {
+			if ( dev_dump ) {
 
 				for ( i = 0; i < IMAGE_COUNT; ++i ) {
 
@@ -1397,12 +1833,16 @@ int main(int argc, char **argv) {
 			/* boot */
 			if ( dev_boot ) {
 				dev_boot_device(dev, dev_boot_arg);
+				dev_free(dev);
+				dev = NULL;
 				break;
 			}
 
 			/* reboot */
 			if ( dev_reboot ) {
 				dev_reboot_device(dev);
+				dev_free(dev);
+				dev = NULL;
 				break;
 			}
 
@@ -1422,6 +1862,8 @@ again:
 	/* clean */
 clean:
 
+	image_prefetch_stop();
+
 	if ( ! image_fiasco ) {
 		image_ptr = image_first;
 		while ( image_ptr ) {
@@ -1434,8 +1876,24 @@ clean:
 	if ( fiasco_in )
 		fiasco_free(fiasco_in);
 
+	/* Next line of batch file continues with still connected device */
+	if ( dev && ret == 0 && daemon_is_batch() ) {
+		batch_dev = dev;
+		dev = NULL;
+	}
+
 	if ( dev )
 		dev_free(dev);
 
+	if ( verbose ) {
+		usb_trace_print();
+		buffer_print();
+	}
+
+	buffer_trim();
+
+	if ( write_report )
+		report_write(write_report_arg, ret);
+
 	return ret;
 }
@@ -0,0 +1,60 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Mk II wire format, shared by the flasher and the softupd server */
+
+#ifndef MKII_PROTO_H
+#define MKII_PROTO_H
+
+#include <stdint.h>
+
+#define MKII_OUT		0x8810001B
+#define MKII_IN			0x8800101B
+
+#define MKII_PING		0x00
+#define MKII_GET		0x01
+#define MKII_TELL		0x02
+#define MKII_FLASH_BEGIN	0x03
+#define MKII_FLASH_HEADER	0x04
+#define MKII_FLASH_CHANNEL	0x05
+#define MKII_FLASH_STATUS	0x06
+#define MKII_FLASH_DATA		0x08
+#define MKII_FLASH_PROGRESS	0x0B
+#define MKII_REBOOT		0x0C
+#define MKII_RESPONCE		0x20
+
+/* Size of one raw data chunk sent after MKII_FLASH_DATA */
+#define MKII_DATA_CHUNK		0x100000
+
+/* Default TCP port of the softupd server (0xFFFF-softupd) */
+#define MKII_TCP_PORT		15999
+
+struct mkii_message {
+	uint32_t header;
+	uint16_t size;
+	uint16_t zero;
+	uint8_t num;
+	uint8_t type;
+	char data[];
+} __attribute__((__packed__));
+
+/* Header (6 bytes) of message, value of size field counts rest of message */
+#define MKII_HEADER_SIZE	6
+
+#endif
@@ -0,0 +1,238 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "device.h"
+#include "usb-device.h"
+#include "mkii.h"
+#include "mkii-proto.h"
+#include "mkii-tcp.h"
+
+static const struct usb_flash_device mkii_tcp_flash_device = {
+	.protocol = FLASH_MKII,
+};
+
+static int mkii_tcp_wait(int sock, short events, int timeout) {
+
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = sock;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while ( ret < 0 && errno == EINTR );
+
+	if ( ret <= 0 )
+		return -1;
+
+	return 0;
+
+}
+
+static int mkii_tcp_write_all(int sock, const void * buf, size_t size, int timeout) {
+
+	const char * ptr = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < size ) {
+		if ( mkii_tcp_wait(sock, POLLOUT, timeout) < 0 )
+			return -1;
+		ret = send(sock, ptr + done, size - done, MSG_NOSIGNAL);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return done;
+
+}
+
+static int mkii_tcp_read_all(int sock, void * buf, size_t size, int timeout) {
+
+	char * ptr = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < size ) {
+		if ( mkii_tcp_wait(sock, POLLIN, timeout) < 0 )
+			return -1;
+		ret = recv(sock, ptr + done, size - done, 0);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return done;
+
+}
+
+static int mkii_tcp_send(struct usb_device_info * dev, const void * buf, size_t size, int timeout) {
+
+	return mkii_tcp_write_all(dev->mkii_sock, buf, size, timeout);
+
+}
+
+/* TCP is stream, so read header first and then exactly one message body */
+static int mkii_tcp_receive(struct usb_device_info * dev, void * buf, size_t size, int timeout) {
+
+	struct mkii_message * msg = buf;
+	size_t body;
+	size_t len;
+
+	if ( size < MKII_HEADER_SIZE )
+		return -1;
+
+	if ( mkii_tcp_read_all(dev->mkii_sock, buf, MKII_HEADER_SIZE, timeout) < 0 )
+		return -1;
+
+	body = ntohs(msg->size);
+	if ( body > size - MKII_HEADER_SIZE ) {
+		/* Skip whole body, so next message is read from its start */
+		while ( body > 0 ) {
+			len = body < size - MKII_HEADER_SIZE ? body : size - MKII_HEADER_SIZE;
+			if ( len == 0 || mkii_tcp_read_all(dev->mkii_sock, (char *)buf + MKII_HEADER_SIZE, len, timeout) < 0 ) {
+				/* Stream position is lost, close connection */
+				close(dev->mkii_sock);
+				dev->mkii_sock = -1;
+				break;
+			}
+			body -= len;
+		}
+		ERROR("Mk II reply is too long");
+		return -1;
+	}
+
+	if ( mkii_tcp_read_all(dev->mkii_sock, (char *)buf + MKII_HEADER_SIZE, body, timeout) < 0 )
+		return -1;
+
+	return MKII_HEADER_SIZE + body;
+
+}
+
+static void mkii_tcp_close(struct usb_device_info * dev) {
+
+	close(dev->mkii_sock);
+	dev->mkii_sock = -1;
+
+}
+
+const struct mkii_transport mkii_tcp_transport = {
+	.channel = "tcp:raw",
+	.send = mkii_tcp_send,
+	.receive = mkii_tcp_receive,
+	.send_data = mkii_tcp_send,
+	.close = mkii_tcp_close,
+};
+
+struct usb_device_info * mkii_tcp_open(const char * address) {
+
+	struct usb_device_info * dev;
+	struct addrinfo hints;
+	struct addrinfo * res;
+	struct addrinfo * ai;
+	char host[256];
+	char port[16];
+	const char * ptr;
+	int sock = -1;
+	int one = 1;
+	int ret;
+
+	ptr = strrchr(address, ':');
+
+	/* host:port, but IPv6 address without port has more colons */
+	if ( ptr && ptr == strchr(address, ':') ) {
+		if ( (size_t)(ptr - address) >= sizeof(host) )
+			ERROR_RETURN("Host name is too long", NULL);
+		memcpy(host, address, ptr - address);
+		host[ptr - address] = 0;
+		snprintf(port, sizeof(port), "%s", ptr + 1);
+	} else {
+		snprintf(host, sizeof(host), "%s", address);
+		snprintf(port, sizeof(port), "%d", MKII_TCP_PORT);
+	}
+
+	printf("Connecting to Mk II server %s port %s...\n", host, port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if ( ret != 0 ) {
+		ERROR("Cannot resolve %s: %s", host, gai_strerror(ret));
+		return NULL;
+	}
+
+	for ( ai = res; ai; ai = ai->ai_next ) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ( sock < 0 )
+			continue;
+		if ( connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 )
+			break;
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if ( sock < 0 ) {
+		ERROR_INFO("Cannot connect to %s", address);
+		return NULL;
+	}
+
+	/* Mk II is request/response protocol, do not delay small messages */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	dev = calloc(1, sizeof(struct usb_device_info));
+	if ( ! dev ) {
+		close(sock);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	dev->flash_device = &mkii_tcp_flash_device;
+	dev->mkii_transport = &mkii_tcp_transport;
+	dev->mkii_sock = sock;
+
+	printf("Found Mk II server at %s\n", address);
+
+	return dev;
+
+}
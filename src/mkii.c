@@ -29,43 +29,56 @@
 #include "device.h"
 #include "usb-device.h"
 
-#define MKII_OUT	0x8810001B
-#define MKII_IN		0x8800101B
-
-#define MKII_PING	0x00
-#define MKII_GET	0x01
-#define MKII_TELL	0x02
-#define MKII_REBOOT	0x0C
-#define MKII_RESPONCE	0x20
-
-struct mkii_message {
-	uint32_t header;
-	uint16_t size;
-	uint16_t zero;
-	uint8_t num;
-	uint8_t type;
-	char data[];
-} __attribute__((__packed__));
+#include "printf-utils.h"
+#include "usb-trace.h"
+#include "report.h"
+#include "mkii-proto.h"
+
+static int mkii_usb_send(struct usb_device_info * dev, const void * buf, size_t size, int timeout) {
+
+	return usb_trace_bulk_write(dev->udev, USB_WRITE_EP, (char *)buf, size, timeout);
+
+}
+
+static int mkii_usb_receive(struct usb_device_info * dev, void * buf, size_t size, int timeout) {
+
+	return usb_trace_bulk_read(dev->udev, USB_READ_EP, (char *)buf, size, timeout);
+
+}
+
+static int mkii_usb_send_data(struct usb_device_info * dev, const void * buf, size_t size, int timeout) {
+
+	return usb_trace_bulk_write(dev->udev, USB_WRITE_DATA_EP, (char *)buf, size, timeout);
+
+}
 
+const struct mkii_transport mkii_usb_transport = {
+	.channel = "usb:raw",
+	.send = mkii_usb_send,
+	.receive = mkii_usb_receive,
+	.send_data = mkii_usb_send_data,
+	.close = NULL,
+};
 
-static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_message * in_msg, size_t data_size, struct mkii_message * out_msg, size_t out_size) {
+static uint8_t mkii_number = 0;
+
+static int mkii_send_receive(struct usb_device_info * dev, uint8_t type, struct mkii_message * in_msg, size_t data_size, struct mkii_message * out_msg, size_t out_size) {
 
 	int ret;
-	static uint8_t number = 0;
 
 	in_msg->header = MKII_OUT;
 	in_msg->size = htons(data_size + 4);
 	in_msg->zero = 0;
-	in_msg->num = number++;
+	in_msg->num = mkii_number++;
 	in_msg->type = type;
 
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)in_msg, data_size + sizeof(*in_msg), 5000);
+	ret = dev->mkii_transport->send(dev, in_msg, data_size + sizeof(*in_msg), 5000);
 	if ( ret < 0 )
 		return ret;
 	if ( (size_t)ret != data_size + sizeof(*in_msg) )
 		return -1;
 
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)out_msg, out_size, 5000);
+	ret = dev->mkii_transport->receive(dev, out_msg, out_size, 5000);
 	if ( ret < 0 )
 		return ret;
 
@@ -85,41 +98,242 @@ static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_me
 
 }
 
-int mkii_init(struct usb_device_info * dev) {
+struct mkii_request {
+	uint8_t type;
+	const char * data;
+	size_t size;
+	uint8_t num;
+	int ret;
+	char * out;
+	size_t out_size;
+};
+
+/* Read replies which are still on the way after failed receive, so next request does not get them */
+static void mkii_drain_replies(struct usb_device_info * dev, void * buf, size_t size, int pending) {
+
+	while ( pending-- > 0 )
+		if ( dev->mkii_transport->receive(dev, buf, size, 500) < 0 )
+			break;
+
+}
+
+/*
+ * Send all independent requests back to back and then collect responses.
+ * Responses are matched to requests by message number, so one slow reply
+ * costs one timeout and not one timeout per request. For every request
+ * ret is set to length of response data (stored to out) or -1.
+ */
+static int mkii_send_receive_queue(struct usb_device_info * dev, struct mkii_request * req, int count) {
 
 	char buf[2048];
 	struct mkii_message * msg;
+	int pending;
+	int ret;
+	int i;
+
+	msg = (struct mkii_message *)buf;
+	pending = 0;
+
+	for ( i = 0; i < count; ++i ) {
+
+		req[i].ret = -1;
+
+		if ( req[i].size > sizeof(buf) - sizeof(*msg) )
+			continue;
+
+		msg->header = MKII_OUT;
+		msg->size = htons(req[i].size + 4);
+		msg->zero = 0;
+		msg->num = mkii_number++;
+		msg->type = req[i].type;
+		if ( req[i].size )
+			memcpy(msg->data, req[i].data, req[i].size);
+
+		req[i].num = msg->num;
+
+		ret = dev->mkii_transport->send(dev, msg, req[i].size + sizeof(*msg), 5000);
+		if ( ret < 0 || (size_t)ret != req[i].size + sizeof(*msg) )
+			break;
+
+		++pending;
+
+	}
+
+	while ( pending > 0 ) {
+
+		ret = dev->mkii_transport->receive(dev, msg, sizeof(buf), 5000);
+		if ( ret < 0 ) {
+			mkii_drain_replies(dev, msg, sizeof(buf), pending);
+			return -1;
+		}
+
+		--pending;
+
+		if ( (size_t)ret < sizeof(*msg) || msg->header != MKII_IN || ntohs(msg->size) != ret - sizeof(*msg) + 4 )
+			continue;
+
+		for ( i = 0; i < count; ++i )
+			if ( req[i].ret < 0 && req[i].num == msg->num && msg->type == (req[i].type | MKII_RESPONCE) )
+				break;
+
+		if ( i == count )
+			continue;
+
+		ret -= sizeof(*msg);
+		if ( (size_t)ret > req[i].out_size - 1 )
+			ret = req[i].out_size - 1;
+
+		memcpy(req[i].out, msg->data, ret);
+		req[i].out[ret] = 0;
+		req[i].ret = ret;
+
+	}
+
+	for ( i = 0; i < count; ++i )
+		if ( req[i].ret < 0 )
+			return -1;
+
+	return 0;
+
+}
+
+enum mkii_key {
+	MKII_KEY_PRODUCT_CODE,
+	MKII_KEY_HW_BUILD,
+	MKII_KEY_SUPPORTED_IMAGES,
+	MKII_KEY_SW_RELEASE,
+	MKII_KEY_COUNT,
+};
+
+static const char * mkii_keys[MKII_KEY_COUNT] = {
+	[MKII_KEY_PRODUCT_CODE] = "/device/product_code",
+	[MKII_KEY_HW_BUILD] = "/device/hw_build",
+	[MKII_KEY_SUPPORTED_IMAGES] = "/update/supported_images",
+	[MKII_KEY_SW_RELEASE] = "/version/sw_release",
+};
+
+/* Responses to GET requests, len 0 means not received yet */
+struct mkii_cache {
+	int len[MKII_KEY_COUNT];
+	char value[MKII_KEY_COUNT][256];
+};
+
+static void mkii_cache_fill(struct usb_device_info * dev, const enum mkii_key * keys, int count) {
+
+	struct mkii_request req[MKII_KEY_COUNT];
+	int i;
+
+	if ( ! dev->mkii_cache || count > MKII_KEY_COUNT )
+		return;
+
+	for ( i = 0; i < count; ++i ) {
+		req[i].type = MKII_GET;
+		req[i].data = mkii_keys[keys[i]];
+		req[i].size = strlen(mkii_keys[keys[i]]);
+		req[i].out = dev->mkii_cache->value[keys[i]];
+		req[i].out_size = sizeof(dev->mkii_cache->value[keys[i]]);
+	}
+
+	mkii_send_receive_queue(dev, req, count);
+
+	for ( i = 0; i < count; ++i )
+		if ( req[i].ret > 0 )
+			dev->mkii_cache->len[keys[i]] = req[i].ret;
+
+}
+
+/* Returns length of cached response data (first byte is status) or -1 */
+static int mkii_cache_get(struct usb_device_info * dev, enum mkii_key key, char ** value) {
+
+	if ( ! dev->mkii_cache )
+		return -1;
+
+	if ( ! dev->mkii_cache->len[key] )
+		mkii_cache_fill(dev, &key, 1);
+
+	if ( ! dev->mkii_cache->len[key] )
+		return -1;
+
+	*value = dev->mkii_cache->value[key];
+	return dev->mkii_cache->len[key];
+
+}
+
+int mkii_init(struct usb_device_info * dev) {
+
+	char version[16];
+	char pong[16];
+	char told[16];
+	struct mkii_request req[2];
+	enum mkii_key keys[MKII_KEY_COUNT];
 	enum device device;
+	int count;
 	int ret;
 	char * newptr;
 	char * ptr;
+	char * value;
+	char buf[256];
 	enum image_type type;
 
 	printf("Initializing Mk II protocol...\n");
 
-	msg = (struct mkii_message *)buf;
+	if ( ! dev->mkii_transport )
+		dev->mkii_transport = &mkii_usb_transport;
+
+	if ( ! dev->mkii_cache ) {
+		dev->mkii_cache = calloc(1, sizeof(struct mkii_cache));
+		if ( ! dev->mkii_cache )
+			ALLOC_ERROR_RETURN(-1);
+	}
+
+	/* Ping and protocol version request, sent as one batch */
+	req[0].type = MKII_PING;
+	req[0].data = NULL;
+	req[0].size = 0;
+	req[0].out = pong;
+	req[0].out_size = sizeof(pong);
+
+	req[1].type = MKII_GET;
+	req[1].data = "/update/protocol_version";
+	req[1].size = sizeof("/update/protocol_version")-1;
+	req[1].out = version;
+	req[1].out_size = sizeof(version);
+
+	mkii_send_receive_queue(dev, req, 2);
 
-	ret = mkii_send_receive(dev->udev, MKII_PING, msg, 0, msg, sizeof(buf));
-	if ( ret != 0 )
+	if ( req[0].ret != 0 )
 		ERROR_RETURN("Cannot ping device", -1);
 
-	memcpy(msg->data, "/update/protocol_version", sizeof("/update/protocol_version")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/protocol_version")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
+	if ( req[1].ret < 2 || version[0] != 0 )
 		ERROR_RETURN("Cannot get Mk II protocol version", -1);
 
-	msg->data[ret] = 0;
-
-	if ( ret == 2 && msg->data[1] == 0x32 )
+	if ( req[1].ret == 2 && version[1] == 0x32 )
 		dev->data |= MKII_SUPPORT_SW_RELEASE;
 
-	printf("Detected Mk II protocol version: %s\n", msg->data);
+	printf("Detected Mk II protocol version: %s\n", version+1);
 
-	memcpy(msg->data, "/update/host_protocol_version\x00\x32", sizeof("/update/host_protocol_version\x00\x32")-1);
-	ret = mkii_send_receive(dev->udev, MKII_TELL, msg, sizeof("/update/host_protocol_version\x00\x32")-1, msg, sizeof(buf));
-	if ( ret != 1 || msg->data[0] != 0 )
+	/* Our version is told only to device which reported valid version */
+	req[0].type = MKII_TELL;
+	req[0].data = "/update/host_protocol_version\x00\x32";
+	req[0].size = sizeof("/update/host_protocol_version\x00\x32")-1;
+	req[0].out = told;
+	req[0].out_size = sizeof(told);
+
+	mkii_send_receive_queue(dev, req, 1);
+
+	if ( req[0].ret != 1 || told[0] != 0 )
 		ERROR_RETURN("Cannot send our protocol version", -1);
 
+	/* All device information, sent as second batch */
+	count = 0;
+	keys[count++] = MKII_KEY_PRODUCT_CODE;
+	keys[count++] = MKII_KEY_HW_BUILD;
+	keys[count++] = MKII_KEY_SUPPORTED_IMAGES;
+	if ( dev->data & MKII_SUPPORT_SW_RELEASE )
+		keys[count++] = MKII_KEY_SW_RELEASE;
+
+	mkii_cache_fill(dev, keys, count);
+
 	device = mkii_get_device(dev);
 
 	if ( ! dev->device )
@@ -132,13 +346,12 @@ int mkii_init(struct usb_device_info * dev) {
 
 	dev->hwrev = mkii_get_hwrev(dev);
 
-	memcpy(msg->data, "/update/supported_images", sizeof("/update/supported_images")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/supported_images")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
+	ret = mkii_cache_get(dev, MKII_KEY_SUPPORTED_IMAGES, &value);
+	if ( ret < 2 || value[0] != 0 )
 		ERROR_RETURN("Cannot get supported image types", -1);
 
-	msg->data[ret] = 0;
-	ptr = msg->data + 1;
+	snprintf(buf, sizeof(buf), "%s", value + 1);
+	ptr = buf;
 
 	printf("Supported images by current device configuration:");
 
@@ -159,32 +372,38 @@ int mkii_init(struct usb_device_info * dev) {
 	printf("\n");
 
 	memset(buf, 0, sizeof(buf));
-	if ( usb_device(dev->udev)->descriptor.bNumConfigurations >= 1 )
+	if ( dev->udev && usb_device(dev->udev)->descriptor.bNumConfigurations >= 1 )
 		usb_get_string_simple(dev->udev, usb_device(dev->udev)->config[0].iConfiguration, buf, sizeof(buf));
 	if ( strncmp(buf, "Firmware Upgrade Configuration", sizeof("Firmware Upgrade Configuration")) == 0 )
 		dev->data |= MKII_UPDATE_MODE;
 
+	/* softupd server over TCP is always ready for flashing */
+	if ( ! dev->udev )
+		dev->data |= MKII_UPDATE_MODE;
+
 	printf("Mode: %s\n", (dev->data & MKII_UPDATE_MODE) ? "Update" : "PC Suite");
 
 	return 0;
 
 }
 
+void mkii_exit(struct usb_device_info * dev) {
+
+	free(dev->mkii_cache);
+	dev->mkii_cache = NULL;
+
+}
+
 enum device mkii_get_device(struct usb_device_info * dev) {
 
-	char buf[2048];
-	struct mkii_message * msg;
+	char * value;
 	int ret;
 
-	msg = (struct mkii_message *)buf;
-
-	memcpy(msg->data, "/device/product_code", sizeof("/device/product_code")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/product_code")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
+	ret = mkii_cache_get(dev, MKII_KEY_PRODUCT_CODE, &value);
+	if ( ret < 2 || value[0] != 0 || value[1] == 0 )
 		return DEVICE_UNKNOWN;
 
-	msg->data[ret] = 0;
-	return device_from_string((char *)msg->data+1);
+	return device_from_string(value+1);
 
 }
 
@@ -199,10 +418,19 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 	uint8_t len;
 	uint16_t hash;
 	uint32_t size;
+	uint32_t chunk;
+	size_t sent;
+	size_t need;
+	size_t done;
+	char * data;
 	int ret;
+	int id;
 
-	ERROR("Not implemented yet");
-	return -1;
+	/* Data phase of Mk II protocol is known only for TCP transport */
+	if ( dev->udev ) {
+		ERROR("Flashing in Mk II protocol is supported only over TCP (-P)");
+		return -1;
+	}
 
 	if ( ! ( dev->data & (1UL << image->type) ) ) {
 		ERROR("Flashing image %s is not supported in current device configuration", image_type_to_string(image->type));
@@ -246,33 +474,21 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 	/* Device & hwrev */
 	if ( image->devices ) {
 
-		int i;
 		uint8_t len;
-		char buf[9];
-		char ** bufs = NULL;
+		char buf[255];
 		struct device_list * device = image->devices;
 
 		while ( device ) {
-			if ( device->device == dev->device && hwrev_is_valid(device->hwrevs, dev->hwrev) )
+			if ( device->device == dev->device && device_hwrev_is_valid(device, dev->hwrev) )
 				break;
 			device = device->next;
 		}
 
-		if ( device )
-			bufs = device_list_alloc_to_bufs(device);
-
-		if ( bufs ) {
-
-			memset(buf, 0, sizeof(buf));
-			snprintf(buf, 8+1, "%d", dev->hwrev);
+		if ( device ) {
 
-			for ( i = 0; bufs[i]; ++i ) {
-				len = ((uint8_t*)bufs[i])[0];
-				if ( MEMMEM(bufs[i]+1, len, buf, strlen(buf)) )
-					break;
-			}
+			len = device_hwrev_to_buf(device, dev->hwrev, buf, sizeof(buf));
 
-			if ( bufs[i] ) {
+			if ( len ) {
 				/* Device & hwrev string header */
 				memcpy(ptr, "\x32", 1);
 				ptr += 1;
@@ -280,12 +496,10 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 				memcpy(ptr, &len, 1);
 				ptr += 1;
 				/* Device & hwrev string */
-				memcpy(ptr, bufs[i]+1, len);
+				memcpy(ptr, buf, len);
 				ptr += len;
 			}
 
-			free(bufs);
-
 		}
 
 	}
@@ -322,15 +536,102 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 	memcpy(ptr, "\x00", 1);
 	ptr += 1;
 
-	ret = mkii_send_receive(dev->udev, 0x03, msg1, 0, msg1, sizeof(buf1));
+	if ( simulate ) {
+		printf("Sending and flashing image...\n");
+		printf_progressbar(image->size, image->size);
+		printf("Done\n");
+		return 0;
+	}
+
+	printf("Sending image header...\n");
+
+	id = report_begin("header send", image->type);
+
+	ret = mkii_send_receive(dev, MKII_FLASH_BEGIN, msg1, 0, msg1, sizeof(buf1));
 	if ( ret != 1 || msg1->data[0] != 0 )
-		return -1;
+		ERROR_RETURN("Cannot start flashing", -1);
 
-	ret = mkii_send_receive(dev->udev, 0x04, msg, ptr - msg->data, msg, sizeof(buf));
-	if ( ret != 9 )
-		return -1;
+	ret = mkii_send_receive(dev, MKII_FLASH_HEADER, msg, ptr - msg->data, msg, sizeof(buf));
+	if ( ret != 9 || msg->data[0] != 0 )
+		ERROR_RETURN("Sending image header failed", -1);
+
+	len = strlen(dev->mkii_transport->channel);
+	memcpy(msg1->data, "\x00\x00\x00\x00", 4);
+	memcpy(msg1->data+4, dev->mkii_transport->channel, len);
+	ret = mkii_send_receive(dev, MKII_FLASH_CHANNEL, msg1, 4+len, msg1, sizeof(buf1));
+	if ( ret != 1 || msg1->data[0] != 0 )
+		ERROR_RETURN("Cannot open data channel", -1);
+
+	report_end(id, ptr - msg->data, 0);
+
+	data = malloc(MKII_DATA_CHUNK);
+	if ( ! data )
+		ALLOC_ERROR_RETURN(-1);
+
+	printf("Sending and flashing image...\n");
+	printf_progressbar(0, image->size);
+	id = report_begin("data transfer", image->type);
+	image_seek(image, 0);
+	sent = 0;
+
+	while ( sent < image->size ) {
+
+		memcpy(msg1->data, "\x00\x00\x00\x00", 4);
+		ret = mkii_send_receive(dev, MKII_FLASH_STATUS, msg1, 4, msg1, sizeof(buf1));
+		if ( ret != 21 || msg1->data[0] != 0 )
+			break;
+
+		memcpy(msg1->data, "\x00\x00\x00\x64", 4);
+		ret = mkii_send_receive(dev, MKII_FLASH_PROGRESS, msg1, 4, msg1, sizeof(buf1));
+		if ( ret != 13 || msg1->data[0] != 0 )
+			break;
+
+		need = image->size - sent;
+		if ( need > MKII_DATA_CHUNK )
+			need = MKII_DATA_CHUNK;
+
+		done = 0;
+		while ( done < need ) {
+			ret = image_read(image, data + done, need - done);
+			if ( ret == 0 )
+				break;
+			done += ret;
+		}
+
+		if ( done != need )
+			break;
 
-	/* TODO: send image itself */
+		chunk = htonl(need);
+		memcpy(msg1->data, "\x00\x00\x00\x00", 4);
+		memcpy(msg1->data+4, &chunk, 4);
+		ret = mkii_send_receive(dev, MKII_FLASH_DATA, msg1, 8, msg1, sizeof(buf1));
+		if ( ret != 1 || msg1->data[0] != 0 )
+			break;
+
+		ret = dev->mkii_transport->send_data(dev, data, need, 1000);
+		if ( ret < 0 || (size_t)ret != need )
+			break;
+
+		sent += need;
+		printf_progressbar(sent, image->size);
+
+	}
+
+	free(data);
+
+	if ( sent != image->size )
+		PRINTF_ERROR_RETURN("Sending image failed", -1);
+
+	report_end(id, sent, 0);
+
+	id = report_begin("flash finish", image->type);
+	memcpy(msg1->data, "\x00\x00\x00\x00", 4);
+	ret = mkii_send_receive(dev, MKII_FLASH_STATUS, msg1, 4, msg1, sizeof(buf1));
+	if ( ret != 21 || msg1->data[0] != 0 )
+		ERROR_RETURN("Flashing image failed", -1);
+	report_end(id, 0, 0);
+
+	printf("Done\n");
 
 	return 0;
 
@@ -357,7 +658,7 @@ int mkii_reboot_device(struct usb_device_info * dev, int update) {
 	}
 
 	memcpy(msg->data, str, len);
-	ret = mkii_send_receive(dev->udev, MKII_REBOOT, msg, len, msg, sizeof(buf));
+	ret = mkii_send_receive(dev, MKII_REBOOT, msg, len, msg, sizeof(buf));
 	if ( ret != 1 || msg->data[0] != 0 )
 		ERROR_RETURN("Cannot send reboot command", -1);
 
@@ -442,19 +743,14 @@ int mkii_set_rd_flags(struct usb_device_info * dev, const char * flags) {
 
 int16_t mkii_get_hwrev(struct usb_device_info * dev) {
 
-	char buf[2048];
-	struct mkii_message * msg;
+	char * value;
 	int ret;
 
-	msg = (struct mkii_message *)buf;
-
-	memcpy(msg->data, "/device/hw_build", sizeof("/device/hw_build")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/hw_build")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
+	ret = mkii_cache_get(dev, MKII_KEY_HW_BUILD, &value);
+	if ( ret < 2 || value[0] != 0 || value[1] == 0 )
 		ERROR_RETURN("Cannot get hw revision", -1);
 
-	msg->data[ret] = 0;
-	return atoi(msg->data+1);
+	return atoi(value+1);
 
 }
 
@@ -526,22 +822,17 @@ int mkii_set_nolo_ver(struct usb_device_info * dev, const char * ver) {
 
 int mkii_get_sw_ver(struct usb_device_info * dev, char * ver, size_t size) {
 
-	char buf[2048];
-	struct mkii_message * msg;
+	char * value;
 	int ret;
 
 	if ( ! ( dev->data & MKII_SUPPORT_SW_RELEASE ) )
 		return -1;
 
-	msg = (struct mkii_message *)buf;
-
-	memcpy(msg->data, "/version/sw_release", sizeof("/version/sw_release")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/version/sw_release")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
+	ret = mkii_cache_get(dev, MKII_KEY_SW_RELEASE, &value);
+	if ( ret < 2 || value[0] != 0 || value[1] == 0 )
 		ERROR_RETURN("Cannot get sw release", -1);
 
-	msg->data[ret] = 0;
-	strncpy(ver, msg->data+1, size);
+	strncpy(ver, value+1, size);
 	ver[size-1] = 0;
 	return strlen(ver);
 
@@ -27,7 +27,19 @@
 #define MKII_SUPPORT_SW_RELEASE	(1UL << 30)
 #define MKII_UPDATE_MODE	(1UL << 31)
 
+/* Mk II messages can be carried over USB (bulk endpoints) or over TCP (softupd) */
+struct mkii_transport {
+	const char * channel;
+	int (*send)(struct usb_device_info * dev, const void * buf, size_t size, int timeout);
+	int (*receive)(struct usb_device_info * dev, void * buf, size_t size, int timeout);
+	int (*send_data)(struct usb_device_info * dev, const void * buf, size_t size, int timeout);
+	void (*close)(struct usb_device_info * dev);
+};
+
+extern const struct mkii_transport mkii_usb_transport;
+
 int mkii_init(struct usb_device_info * dev);
+void mkii_exit(struct usb_device_info * dev);
 
 enum device mkii_get_device(struct usb_device_info * dev);
 
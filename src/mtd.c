@@ -0,0 +1,797 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+#endif
+
+#include "global.h"
+#include "printf-utils.h"
+#include "dump.h"
+#include "mtd.h"
+#include "scan.h"
+#include "image.h"
+#include "verify.h"
+
+/* Partitions up to this size are read to memory on first use */
+#define MTD_CACHE_SIZE	(1UL << 20) /* 1MB */
+
+struct mtd {
+	int num;
+	int fd;
+	uint64_t size;
+	uint32_t erasesize;
+	uint32_t writesize;
+	int write;
+	/* Per eraseblock: 0 - unknown, 1 - good, 2 - bad */
+	unsigned char * bad;
+	char * cache;
+};
+
+/* UBI erase counter and volume identifier headers */
+#define UBI_EC_HDR_MAGIC	"UBI#"
+#define UBI_VID_HDR_MAGIC	"UBI!"
+#define UBI_HDR_SIZE	64
+#define UBI_VID_HDR_OFFSET	16
+
+struct mtd_range {
+	struct mtd * mtd;
+	uint64_t cur;
+	uint64_t end;
+	/* UBI: bytes at start of eraseblock which contain both headers, 0 - no UBI */
+	uint32_t ubi_hdr;
+	uint64_t ubi_skipped;
+};
+
+#ifdef __linux__
+
+struct mtd * mtd_open(int num, int write) {
+
+	struct mtd_info_user info;
+	struct mtd * mtd;
+	char buf[64];
+	uint64_t off;
+	ssize_t ret;
+	size_t done;
+
+	if ( write )
+		snprintf(buf, sizeof(buf), "/dev/mtd%d", num);
+	else
+		snprintf(buf, sizeof(buf), "/dev/mtd%dro", num);
+
+	mtd = calloc(1, sizeof(struct mtd));
+	if ( ! mtd )
+		ALLOC_ERROR_RETURN(NULL);
+
+	mtd->num = num;
+	mtd->write = write;
+	mtd->fd = open(buf, write ? O_RDWR : O_RDONLY);
+	if ( mtd->fd < 0 ) {
+		ERROR_INFO("Cannot open %s", buf);
+		free(mtd);
+		return NULL;
+	}
+
+	if ( ioctl(mtd->fd, MEMGETINFO, &info) != 0 || info.erasesize == 0 ) {
+		ERROR_INFO("Cannot get info about %s", buf);
+		mtd_close(mtd);
+		return NULL;
+	}
+
+	mtd->size = info.size;
+	mtd->erasesize = info.erasesize;
+	mtd->writesize = info.writesize ? info.writesize : 1;
+
+	mtd->bad = calloc(mtd->size / mtd->erasesize + 1, 1);
+	if ( ! mtd->bad ) {
+		mtd_close(mtd);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	if ( mtd->size > MTD_CACHE_SIZE )
+		return mtd;
+
+	/* Small partition (e.g. bootloaders in mtd0), keep whole content */
+	mtd->cache = malloc(mtd->size);
+	if ( ! mtd->cache )
+		return mtd;
+
+	for ( off = 0; off < mtd->size; off += mtd->erasesize ) {
+		if ( mtd_is_bad(mtd, off) )
+			continue;
+		done = 0;
+		while ( done < mtd->erasesize ) {
+			ret = pread(mtd->fd, mtd->cache + off + done, mtd->erasesize - done, off + done);
+			if ( ret < 0 && errno == EINTR )
+				continue;
+			if ( ret <= 0 )
+				break;
+			done += ret;
+		}
+		if ( done != mtd->erasesize ) {
+			free(mtd->cache);
+			mtd->cache = NULL;
+			break;
+		}
+	}
+
+	return mtd;
+
+}
+
+int mtd_is_bad(struct mtd * mtd, uint64_t offset) {
+
+	uint64_t block = offset / mtd->erasesize;
+	int64_t ofs = block * mtd->erasesize;
+	int ret;
+
+	if ( ! mtd->bad[block] ) {
+		ret = ioctl(mtd->fd, MEMGETBADBLOCK, &ofs);
+		/* NOR flash does not support bad blocks */
+		mtd->bad[block] = ( ret > 0 ) ? 2 : 1;
+	}
+
+	return mtd->bad[block] == 2;
+
+}
+
+static int mtd_erase_block(struct mtd * mtd, uint64_t offset) {
+
+	struct erase_info_user erase;
+
+	erase.start = offset;
+	erase.length = mtd->erasesize;
+
+	if ( ioctl(mtd->fd, MEMERASE, &erase) != 0 ) {
+		ERROR_INFO("Cannot erase block at 0x%08llx", (unsigned long long int)offset);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static int mtd_ecc_stats(struct mtd * mtd, uint32_t * corrected, uint32_t * failed) {
+
+	struct mtd_ecc_stats stats;
+
+	if ( ioctl(mtd->fd, ECCGETSTATS, &stats) != 0 )
+		return -1;
+
+	*corrected = stats.corrected;
+	*failed = stats.failed;
+	return 0;
+
+}
+
+#else
+
+struct mtd * mtd_open(int num, int write) {
+
+	ERROR("Not implemented yet");
+	(void)num;
+	(void)write;
+	return NULL;
+
+}
+
+int mtd_is_bad(struct mtd * mtd, uint64_t offset) {
+
+	(void)mtd;
+	(void)offset;
+	return 0;
+
+}
+
+static int mtd_erase_block(struct mtd * mtd, uint64_t offset) {
+
+	(void)mtd;
+	(void)offset;
+	return -1;
+
+}
+
+static int mtd_ecc_stats(struct mtd * mtd, uint32_t * corrected, uint32_t * failed) {
+
+	(void)mtd;
+	(void)corrected;
+	(void)failed;
+	return -1;
+
+}
+
+#endif
+
+void mtd_close(struct mtd * mtd) {
+
+	if ( mtd->fd >= 0 )
+		close(mtd->fd);
+	free(mtd->bad);
+	free(mtd->cache);
+	free(mtd);
+
+}
+
+uint64_t mtd_size(struct mtd * mtd) {
+
+	return mtd->size;
+
+}
+
+uint32_t mtd_erasesize(struct mtd * mtd) {
+
+	return mtd->erasesize;
+
+}
+
+static ssize_t mtd_read(struct mtd * mtd, char * buf, size_t count, uint64_t offset) {
+
+	ssize_t ret;
+
+	if ( mtd->cache ) {
+		memcpy(buf, mtd->cache + offset, count);
+		return count;
+	}
+
+	/* Corrected and uncorrectable ECC errors still return data, like nanddump */
+	do {
+		ret = pread(mtd->fd, buf, count, offset);
+	} while ( ret < 0 && errno == EINTR );
+
+	if ( ret == 0 )
+		return -1;
+
+	return ret;
+
+}
+
+static int mtd_read_full(struct mtd * mtd, char * buf, size_t count, uint64_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = mtd_read(mtd, buf + done, count - done, offset + done);
+		if ( ret < 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int mtd_is_erased(const char * buf, size_t size) {
+
+	size_t i;
+
+	for ( i = 0; i < size; ++i )
+		if ( (unsigned char)buf[i] != 0xFF )
+			return 0;
+
+	return 1;
+
+}
+
+static uint32_t mtd_ubi_be32(const char * ptr) {
+
+	const unsigned char * p = (const unsigned char *)ptr;
+
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+
+}
+
+/* Erased eraseblock or eraseblock with erase counter only (unmapped PEB) does not contain any data */
+static int mtd_ubi_is_empty(const char * hdr, uint32_t size) {
+
+	if ( mtd_is_erased(hdr, UBI_HDR_SIZE) )
+		return 1;
+
+	if ( memcmp(hdr, UBI_EC_HDR_MAGIC, 4) != 0 || mtd_ubi_be32(hdr + UBI_VID_HDR_OFFSET) != size - UBI_HDR_SIZE )
+		return 0;
+
+	return mtd_is_erased(hdr + size - UBI_HDR_SIZE, UBI_HDR_SIZE);
+
+}
+
+static ssize_t mtd_range_read(void * priv, char * buf, size_t count, uint64_t pos) {
+
+	struct mtd_range * range = priv;
+	struct mtd * mtd = range->mtd;
+	uint64_t block_end;
+	size_t done = 0;
+	size_t need;
+	ssize_t ret;
+
+	(void)pos;
+
+	while ( done < count && range->cur < range->end ) {
+
+		block_end = ( range->cur / mtd->erasesize + 1 ) * mtd->erasesize;
+
+		if ( mtd_is_bad(mtd, range->cur) ) {
+			PRINTF_END();
+			printf("Skipping bad block at 0x%08llx\n", (unsigned long long int)(range->cur - range->cur % mtd->erasesize));
+			range->cur = block_end;
+			continue;
+		}
+
+		/* Headers are read to output buffer, so eraseblock with data is not read twice */
+		if ( range->ubi_hdr && range->cur % mtd->erasesize == 0 && count - done >= range->ubi_hdr ) {
+			if ( mtd_read_full(mtd, buf + done, range->ubi_hdr, range->cur) < 0 )
+				return -1;
+			if ( mtd_ubi_is_empty(buf + done, range->ubi_hdr) ) {
+				++range->ubi_skipped;
+				range->cur = block_end;
+				continue;
+			}
+			done += range->ubi_hdr;
+			range->cur += range->ubi_hdr;
+			continue;
+		}
+
+		/* Not enough space for headers, check eraseblock in next call */
+		if ( range->ubi_hdr && range->cur % mtd->erasesize == 0 && done > 0 )
+			break;
+
+		need = count - done;
+		if ( need > block_end - range->cur )
+			need = block_end - range->cur;
+		if ( need > range->end - range->cur )
+			need = range->end - range->cur;
+
+		ret = mtd_read(mtd, buf + done, need, range->cur);
+		if ( ret < 0 )
+			return -1;
+
+		done += ret;
+		range->cur += ret;
+
+	}
+
+	return done;
+
+}
+
+int mtd_dump(struct mtd * mtd, uint64_t offset, uint64_t length, int out, off_t out_offset, int align, uint64_t * out_length, uint16_t * hash) {
+
+	struct mtd_range range;
+	struct dump_source src;
+
+	if ( offset > mtd->size || length > mtd->size - offset ) {
+		ERROR("Range 0x%llx-0x%llx is out of mtd%d", (unsigned long long int)offset, (unsigned long long int)(offset + length), mtd->num);
+		return -1;
+	}
+
+	memset(&range, 0, sizeof(range));
+	range.mtd = mtd;
+	range.cur = offset;
+	range.end = offset + length;
+
+	src.read = mtd_range_read;
+	src.priv = &range;
+
+	return dump_stream(&src, length, out, out_offset, align, out_length, hash);
+
+}
+
+int mtd_dump_ubi(struct mtd * mtd, uint64_t offset, uint64_t length, int out, off_t out_offset, int align, uint64_t * out_length, uint16_t * hash) {
+
+	struct mtd_range range;
+	struct dump_source src;
+	char hdr[UBI_HDR_SIZE];
+	uint64_t block;
+	uint32_t vid_hdr;
+	int ret;
+
+	if ( offset > mtd->size || length > mtd->size - offset ) {
+		ERROR("Range 0x%llx-0x%llx is out of mtd%d", (unsigned long long int)offset, (unsigned long long int)(offset + length), mtd->num);
+		return -1;
+	}
+
+	if ( offset % mtd->erasesize != 0 || length % mtd->erasesize != 0 )
+		return mtd_dump(mtd, offset, length, out, out_offset, align, out_length, hash);
+
+	/* Check erase counter header of first good eraseblock */
+	for ( block = offset; block < offset + length; block += mtd->erasesize )
+		if ( ! mtd_is_bad(mtd, block) )
+			break;
+
+	if ( block >= offset + length || mtd_read_full(mtd, hdr, sizeof(hdr), block) < 0 || memcmp(hdr, UBI_EC_HDR_MAGIC, 4) != 0 )
+		return mtd_dump(mtd, offset, length, out, out_offset, align, out_length, hash);
+
+	vid_hdr = mtd_ubi_be32(hdr + UBI_VID_HDR_OFFSET);
+	if ( vid_hdr < UBI_HDR_SIZE || vid_hdr > mtd->erasesize - UBI_HDR_SIZE )
+		return mtd_dump(mtd, offset, length, out, out_offset, align, out_length, hash);
+
+	printf("Detected UBI image, empty eraseblocks are omitted\n");
+
+	memset(&range, 0, sizeof(range));
+	range.mtd = mtd;
+	range.cur = offset;
+	range.end = offset + length;
+	range.ubi_hdr = vid_hdr + UBI_HDR_SIZE;
+
+	src.read = mtd_range_read;
+	src.priv = &range;
+
+	/* UBI image must consist of whole eraseblocks */
+	for ( align = 0; ( 1UL << align ) < mtd->erasesize; ++align )
+		;
+
+	ret = dump_stream(&src, length, out, out_offset, align, out_length, hash);
+
+	if ( ret == 0 )
+		printf("Omitted %llu empty eraseblocks (%llu MB)\n", (unsigned long long int)range.ubi_skipped, (unsigned long long int)(range.ubi_skipped * mtd->erasesize >> 20));
+
+	return ret;
+
+}
+
+int mtd_verify(struct mtd * mtd, uint64_t offset, uint64_t length, uint64_t skip, struct image * image) {
+
+	struct mtd_range range;
+	struct dump_source src;
+	char buf[256];
+	size_t need;
+
+	if ( offset > mtd->size || length > mtd->size - offset || skip + image->size > length ) {
+		ERROR("Image %s does not fit into mtd%d", image_type_to_string(image->type), mtd->num);
+		return -1;
+	}
+
+	memset(&range, 0, sizeof(range));
+	range.mtd = mtd;
+	range.cur = offset;
+	range.end = offset + length;
+
+	/* Data before image (e.g. kernel header) can be after skipped bad block */
+	while ( skip > 0 ) {
+		need = skip < sizeof(buf) ? skip : sizeof(buf);
+		if ( mtd_range_read(&range, buf, need, 0) != (ssize_t)need ) {
+			ERROR("Cannot read mtd%d", mtd->num);
+			return -1;
+		}
+		skip -= need;
+	}
+
+	src.read = mtd_range_read;
+	src.priv = &range;
+
+	/* NAND is one chip and bad blocks are skipped, read it sequentially */
+	return verify_image(image, &src, 1);
+
+}
+
+static int mtd_pread_block(struct mtd * mtd, char * buf, uint64_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < mtd->erasesize ) {
+		ret = pread(mtd->fd, buf + done, mtd->erasesize - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			ERROR_INFO("Cannot read block at 0x%08llx", (unsigned long long int)offset);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int mtd_pwrite_page(struct mtd * mtd, const char * buf, uint64_t offset) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < mtd->writesize ) {
+		ret = pwrite(mtd->fd, buf + done, mtd->writesize - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			ERROR_INFO("Cannot write page at 0x%08llx", (unsigned long long int)(offset + done));
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int mtd_source_fill(const struct dump_source * src, char * buf, size_t count, uint64_t pos) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = src->read(src->priv, buf + done, count - done, pos + done);
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+int mtd_flash(struct mtd * mtd, uint64_t offset, uint64_t length, const struct dump_source * src, uint64_t size) {
+
+	char * old = NULL;
+	char * new = NULL;
+	uint64_t cur = offset;
+	uint64_t end = offset + length;
+	uint64_t block;
+	uint64_t pos = 0;
+	size_t from, to, need, page;
+	int erase;
+	int ret = -1;
+	int written = 0;
+	int erased = 0;
+	int skipped = 0;
+
+	if ( offset > mtd->size || length > mtd->size - offset ) {
+		ERROR("Range 0x%llx-0x%llx is out of mtd%d", (unsigned long long int)offset, (unsigned long long int)end, mtd->num);
+		return -1;
+	}
+
+	if ( size > length ) {
+		ERROR("Image is too big for mtd%d (have: 0x%llx, need: 0x%llx)", mtd->num, (unsigned long long int)length, (unsigned long long int)size);
+		return -1;
+	}
+
+	if ( ! mtd->write && ! simulate ) {
+		ERROR("mtd%d is not opened for writing", mtd->num);
+		return -1;
+	}
+
+	if ( mtd->erasesize % mtd->writesize != 0 ) {
+		ERROR("Unsupported geometry of mtd%d", mtd->num);
+		return -1;
+	}
+
+	old = malloc(mtd->erasesize);
+	new = malloc(mtd->erasesize);
+	if ( ! old || ! new ) {
+		ALLOC_ERROR();
+		goto clean;
+	}
+
+	printf_progressbar(0, length);
+
+	while ( cur < end ) {
+
+		block = cur - cur % mtd->erasesize;
+
+		if ( mtd_is_bad(mtd, block) ) {
+			PRINTF_END();
+			printf("Skipping bad block at 0x%08llx\n", (unsigned long long int)block);
+			cur = block + mtd->erasesize;
+			continue;
+		}
+
+		/* Read-modify-write, block can contain other data before or after range (e.g. xloader and secondary) */
+		if ( mtd_pread_block(mtd, old, block) != 0 )
+			goto clean;
+
+		memcpy(new, old, mtd->erasesize);
+
+		from = cur - block;
+		to = mtd->erasesize;
+		if ( end - block < to )
+			to = end - block;
+
+		need = to - from;
+		if ( need > size - pos )
+			need = size - pos;
+
+		if ( need > 0 && mtd_source_fill(src, new + from, need, pos) != 0 ) {
+			ERROR("Cannot read image");
+			goto clean;
+		}
+
+		/* Rest of range is erased */
+		memset(new + from + need, 0xFF, to - from - need);
+
+		pos += need;
+		cur = block + to;
+
+		printf_progressbar(cur - offset, length);
+
+		if ( memcmp(old, new, mtd->erasesize) == 0 ) {
+			++skipped;
+			continue;
+		}
+
+		/* NAND page can be programmed only once after erase */
+		erase = 0;
+		for ( page = 0; page < mtd->erasesize; page += mtd->writesize ) {
+			if ( memcmp(old + page, new + page, mtd->writesize) != 0 && ! mtd_is_erased(old + page, mtd->writesize) ) {
+				erase = 1;
+				break;
+			}
+		}
+
+		if ( simulate ) {
+			erased += erase;
+			++written;
+			continue;
+		}
+
+		if ( erase ) {
+			if ( mtd_erase_block(mtd, block) != 0 )
+				goto clean;
+			memset(old, 0xFF, mtd->erasesize);
+			++erased;
+		}
+
+		for ( page = 0; page < mtd->erasesize; page += mtd->writesize ) {
+			if ( memcmp(old + page, new + page, mtd->writesize) == 0 )
+				continue;
+			if ( mtd_pwrite_page(mtd, new + page, block + page) != 0 )
+				goto clean;
+		}
+
+		++written;
+
+		/* Verify */
+		if ( mtd_pread_block(mtd, old, block) != 0 )
+			goto clean;
+
+		if ( memcmp(old, new, mtd->erasesize) != 0 ) {
+			PRINTF_END();
+			ERROR("Verification of block at 0x%08llx failed", (unsigned long long int)block);
+			goto clean;
+		}
+
+		if ( mtd->cache )
+			memcpy(mtd->cache + block, new, mtd->erasesize);
+
+	}
+
+	if ( pos < size ) {
+		PRINTF_END();
+		ERROR("Image does not fit to mtd%d, too many bad blocks", mtd->num);
+		goto clean;
+	}
+
+	printf_progressbar(length, length);
+	printf("Done, %d blocks written (%d erased), %d unchanged\n", written, erased, skipped);
+	ret = 0;
+
+clean:
+	free(old);
+	free(new);
+	return ret;
+
+}
+
+int mtd_check(struct mtd * mtd) {
+
+	uint32_t corrected = 0, failed = 0;
+	uint32_t corrected2, failed2;
+	uint64_t count = mtd->size / mtd->erasesize;
+	uint64_t num_bad = 0;
+	uint64_t num_corrected = 0;
+	uint64_t num_failed = 0;
+	uint64_t bytes = 0;
+	uint64_t start;
+	uint64_t begin;
+	uint64_t block;
+	uint32_t * usec;
+	char * state;
+	char * buf;
+	int ecc;
+
+	usec = calloc(count + 1, sizeof(*usec));
+	state = calloc(count + 1, 1);
+	buf = malloc(mtd->erasesize);
+	if ( ! usec || ! state || ! buf ) {
+		free(usec);
+		free(state);
+		free(buf);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	printf("Checking mtd%d (%llu blocks of %u kB)...\n", mtd->num, (unsigned long long int)count, mtd->erasesize >> 10);
+
+	ecc = ( mtd_ecc_stats(mtd, &corrected, &failed) == 0 );
+	if ( ! ecc )
+		printf("ECC statistics are not available\n");
+
+	printf_progressbar(0, count);
+	begin = scan_time();
+
+	/* NAND is one chip, so blocks are read sequentially and ECC counters are per block */
+	for ( block = 0; block < count; ++block ) {
+
+		state[block] = '.';
+
+		if ( mtd_is_bad(mtd, block * mtd->erasesize) ) {
+			state[block] = 'B';
+			usec[block] = SCAN_SKIPPED;
+			++num_bad;
+			continue;
+		}
+
+		start = scan_time();
+
+		/* Not from cache, read from device */
+		if ( pread(mtd->fd, buf, mtd->erasesize, block * mtd->erasesize) != (ssize_t)mtd->erasesize ) {
+			state[block] = 'U';
+			++num_failed;
+		} else {
+			bytes += mtd->erasesize;
+		}
+
+		usec[block] = scan_time() - start;
+
+		if ( ecc && mtd_ecc_stats(mtd, &corrected2, &failed2) == 0 ) {
+			if ( failed2 != failed ) {
+				if ( state[block] != 'U' )
+					++num_failed;
+				state[block] = 'U';
+			} else if ( corrected2 != corrected ) {
+				state[block] = 'C';
+				++num_corrected;
+			}
+			corrected = corrected2;
+			failed = failed2;
+		}
+
+		if ( block + 1 < count )
+			printf_progressbar(block + 1, count);
+
+	}
+
+	printf_progressbar(count, count);
+
+	scan_report(usec, count, 0, mtd->erasesize, bytes, scan_time() - begin);
+
+	if ( num_bad || num_corrected || num_failed ) {
+		printf("Block map (B - bad, C - corrected bitflips, U - uncorrectable):\n");
+		for ( block = 0; block < count; block += 64 )
+			printf("  0x%08llx %.*s\n", (unsigned long long int)(block * mtd->erasesize), (int)(count - block < 64 ? count - block : 64), state + block);
+	}
+
+	printf("mtd%d: %llu bad blocks, %llu blocks with corrected bitflips, %llu blocks with uncorrectable errors\n", mtd->num, (unsigned long long int)num_bad, (unsigned long long int)num_corrected, (unsigned long long int)num_failed);
+
+	free(usec);
+	free(state);
+	free(buf);
+
+	return num_failed ? 1 : 0;
+
+}
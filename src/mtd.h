@@ -0,0 +1,59 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef MTD_H
+#define MTD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct mtd;
+struct dump_source;
+struct image;
+
+/* Open /dev/mtdNro (or /dev/mtdN for write), small partitions are read to memory only once */
+struct mtd * mtd_open(int num, int write);
+void mtd_close(struct mtd * mtd);
+
+uint64_t mtd_size(struct mtd * mtd);
+uint32_t mtd_erasesize(struct mtd * mtd);
+int mtd_is_bad(struct mtd * mtd, uint64_t offset);
+
+/* Dump range of mtd to file out at out_offset, bad blocks and OOB data are omitted (like nanddump -o -b) */
+int mtd_dump(struct mtd * mtd, uint64_t offset, uint64_t length, int out, off_t out_offset, int align, uint64_t * out_length, uint16_t * hash);
+
+/*
+ * Same as mtd_dump(), but if range contains UBI image, erased and unmapped eraseblocks
+ * (without volume identifier header) are omitted. Output is still valid UBI image.
+ */
+int mtd_dump_ubi(struct mtd * mtd, uint64_t offset, uint64_t length, int out, off_t out_offset, int align, uint64_t * out_length, uint16_t * hash);
+
+/* Compare image with range of mtd after first skip bytes, bad blocks are skipped */
+int mtd_verify(struct mtd * mtd, uint64_t offset, uint64_t length, uint64_t skip, struct image * image);
+
+/*
+ * Write size bytes from src to range of mtd and erase rest of range, bad blocks are skipped.
+ * Only changed blocks are written and only blocks which cannot be programmed are erased.
+ */
+int mtd_flash(struct mtd * mtd, uint64_t offset, uint64_t length, const struct dump_source * src, uint64_t size);
+
+/* Read whole mtd, print bad blocks, blocks with ECC errors and read latency, returns 1 if some block is unreadable */
+int mtd_check(struct mtd * mtd);
+
+#endif
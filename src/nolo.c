@@ -26,6 +26,9 @@
 #include "image.h"
 #include "global.h"
 #include "printf-utils.h"
+#include "usb-trace.h"
+#include "report.h"
+#include "buffer.h"
 
 /* Request type */
 #define NOLO_WRITE		64
@@ -76,6 +79,9 @@
 #define NOLO_BOOT_MODE_NORMAL		0
 #define NOLO_BOOT_MODE_UPDATE		1
 
+/* Image data are sent in chunks of this size */
+#define NOLO_BUF_SIZE		0x20000
+
 #define NOLO_ERROR_RETURN(str, ...) do { nolo_error_log(dev, str == NULL); ERROR_RETURN(str, __VA_ARGS__); } while (0)
 
 static void nolo_error_log(struct usb_device_info * dev, int only_clear) {
@@ -88,7 +94,7 @@ static void nolo_error_log(struct usb_device_info * dev, int only_clear) {
 
 		memset(buf, 0, sizeof(buf));
 
-		ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_ERROR_LOG, 0, 0, buf, sizeof(buf), 2000);
+		ret = usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_ERROR_LOG, 0, 0, buf, sizeof(buf), 2000);
 		if ( ret < 0 )
 			break;
 
@@ -118,7 +124,7 @@ static int nolo_identify_string(struct usb_device_info * dev, const char * str,
 
 	memset(buf, 0, sizeof(buf));
 
-	ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, (char *)buf, sizeof(buf), 2000);
+	ret = usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, (char *)buf, sizeof(buf), 2000);
 	if ( ret < 0 )
 		NOLO_ERROR_RETURN("NOLO_IDENTIFY failed", -1);
 
@@ -148,10 +154,10 @@ static int nolo_set_string(struct usb_device_info * dev, char * str, char * arg)
 	if ( simulate )
 		return 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_STRING failed", -1);
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_STRING, 0, 0, arg, strlen(arg), 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_STRING, 0, 0, arg, strlen(arg), 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_SET_STRING failed", -1);
 
 	return 0;
@@ -162,10 +168,10 @@ static int nolo_get_string(struct usb_device_info * dev, char * str, char * out,
 
 	int ret = 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
 		return -1;
 
-	if ( ( ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_STRING, 0, 0, out, size-1, 2000) ) < 0 )
+	if ( ( ret = usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_STRING, 0, 0, out, size-1, 2000) ) < 0 )
 		return -1;
 
 	if ( (size_t)ret > size-1 )
@@ -208,9 +214,12 @@ int nolo_init(struct usb_device_info * dev) {
 
 	printf("Initializing NOLO...\n");
 
-	while ( val != 0 )
-		if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_STATUS, 0, 0, (char *)&val, 4, 2000) == -1 )
+	while ( val != 0 ) {
+		if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_STATUS, 0, 0, (char *)&val, 4, 2000) == -1 )
 			NOLO_ERROR_RETURN("NOLO_STATUS failed", -1);
+		if ( val != 0 )
+			report_retry();
+	}
 
 	/* clear error log */
 	nolo_error_log(dev, 1);
@@ -242,9 +251,8 @@ enum device nolo_get_device(struct usb_device_info * dev) {
 
 }
 
-static int nolo_send_image(struct usb_device_info * dev, struct image * image, int flash) {
+static int nolo_send_image_buf(struct usb_device_info * dev, struct image * image, int flash, char * buf, size_t buf_size) {
 
-	char buf[0x20000];
 	char * ptr;
 	const char * type;
 	uint8_t len;
@@ -254,6 +262,7 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	uint32_t sent;
 	int request;
 	int ret;
+	int id;
 
 	if ( flash )
 		printf("Send and flash image:\n");
@@ -302,33 +311,21 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	/* Device & hwrev */
 	if ( image->devices ) {
 
-		int i;
 		uint8_t len;
-		char buf[9];
-		char ** bufs = NULL;
+		char buf[255];
 		struct device_list * device = image->devices;
 
 		while ( device ) {
-			if ( device->device == dev->device && hwrev_is_valid(device->hwrevs, dev->hwrev) )
+			if ( device->device == dev->device && device_hwrev_is_valid(device, dev->hwrev) )
 				break;
 			device = device->next;
 		}
 
-		if ( device )
-			bufs = device_list_alloc_to_bufs(device);
+		if ( device ) {
 
-		if ( bufs ) {
+			len = device_hwrev_to_buf(device, dev->hwrev, buf, sizeof(buf));
 
-			memset(buf, 0, sizeof(buf));
-			snprintf(buf, 8+1, "%d", dev->hwrev);
-
-			for ( i = 0; bufs[i]; ++i ) {
-				len = ((uint8_t*)bufs[i])[0];
-				if ( MEMMEM(bufs[i]+1, len, buf, strlen(buf)) )
-					break;
-			}
-
-			if ( bufs[i] ) {
+			if ( len ) {
 				/* Device & hwrev string header */
 				memcpy(ptr, "\x32", 1);
 				ptr += 1;
@@ -336,12 +333,10 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 				memcpy(ptr, &len, 1);
 				ptr += 1;
 				/* Device & hwrev string */
-				memcpy(ptr, bufs[i]+1, len);
+				memcpy(ptr, buf, len);
 				ptr += len;
 			}
 
-			free(bufs);
-
 		}
 
 	}
@@ -367,27 +362,30 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 
 	printf("Sending image header...\n");
 
+	id = report_begin("header send", image->type);
 	if ( ! simulate ) {
-		if ( usb_control_msg(dev->udev, NOLO_WRITE, request, 0, 0, buf, ptr-buf, 2000) < 0 )
+		if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, request, 0, 0, buf, ptr-buf, 2000) < 0 )
 			NOLO_ERROR_RETURN("Sending image header failed", -1);
 	}
+	report_end(id, ptr-buf, 0);
 
 	if ( flash )
 		printf("Sending and flashing image...\n");
 	else
 		printf("Sending image...\n");
 	printf_progressbar(0, image->size);
+	id = report_begin("data transfer", image->type);
 	image_seek(image, 0);
 	sent = 0;
 	while ( sent < image->size ) {
 		need = image->size - sent;
-		if ( need > sizeof(buf) )
-			need = sizeof(buf);
+		if ( need > buf_size )
+			need = buf_size;
 		ret = image_read(image, buf, need);
 		if ( ret == 0 )
 			break;
 		if ( ! simulate ) {
-			if ( usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, buf, ret, 5000) != ret ) {
+			if ( usb_trace_bulk_write(dev->udev, USB_WRITE_DATA_EP, buf, ret, 5000) != ret ) {
 				PRINTF_END();
 				NOLO_ERROR_RETURN("Sending image failed", -1);
 			}
@@ -395,13 +393,16 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 		sent += ret;
 		printf_progressbar(sent, image->size);
 	}
+	report_end(id, sent, 0);
 
 	if ( flash ) {
 		printf("Finishing flashing...\n");
+		id = report_begin("flash finish", image->type);
 		if ( ! simulate ) {
-			if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SEND_FLASH_FINISH, 0, 0, NULL, 0, 30000) < 0 )
+			if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SEND_FLASH_FINISH, 0, 0, NULL, 0, 30000) < 0 )
 				NOLO_ERROR_RETURN("Finishing failed", -1);
 		}
+		report_end(id, 0, 0);
 	}
 
 	printf("Done\n");
@@ -410,6 +411,22 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 
 }
 
+static int nolo_send_image(struct usb_device_info * dev, struct image * image, int flash) {
+
+	char * buf;
+	int ret;
+
+	buf = buffer_alloc(NOLO_BUF_SIZE);
+	if ( ! buf )
+		ALLOC_ERROR_RETURN(-1);
+
+	ret = nolo_send_image_buf(dev, image, flash, buf, NOLO_BUF_SIZE);
+
+	buffer_free(buf);
+	return ret;
+
+}
+
 int nolo_load_image(struct usb_device_info * dev, struct image * image) {
 
 	if ( image->type != IMAGE_KERNEL && image->type != IMAGE_INITFS )
@@ -429,6 +446,7 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 	unsigned long long int last_total;
 	char buf[128];
 	char * ptr;
+	int id;
 
 	if ( image->type == IMAGE_ROOTFS )
 		flash = 1;
@@ -455,10 +473,12 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 
 		printf("Flashing image...\n");
 
+		id = report_begin("flash finish", image->type);
 		if ( ! simulate ) {
-			if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_FLASH_IMAGE, 0, index, NULL, 0, 10000) )
+			if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_FLASH_IMAGE, 0, index, NULL, 0, 10000) )
 				NOLO_ERROR_RETURN("Flashing failed", -1);
 		}
+		report_end(id, 0, 0);
 
 		printf("Done\n");
 
@@ -468,6 +488,7 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 
 		int state = 0;
 		last_total = 0;
+		id = report_begin("cmt erase", image->type);
 
 		if ( nolo_get_string(dev, "cmt:status", buf, sizeof(buf)) < 0 )
 			NOLO_ERROR_RETURN("cmt:status failed", -1);
@@ -490,13 +511,17 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 					printf_progressbar(last_total, last_total);
 					printf("Done\n");
 				}
-				if ( state <= 1 )
+				if ( state <= 1 ) {
 					printf("Programming CMT...\n");
+					report_end(id, 0, 0);
+					id = report_begin("cmt program", image->type);
+				}
 				if ( state <= 2 ) {
 					printf_progressbar(last_total, last_total);
 					printf("Done\n");
 				}
 
+				report_end(id, 0, 0);
 				state = 4;
 
 			} else if ( strncmp(buf, "error", sizeof("error")-1) == 0 ) {
@@ -523,6 +548,8 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 
 				if ( strcmp(buf, "program") == 0 && state <= 1 ) {
 					printf("Programming CMT...\n");
+					report_end(id, 0, 0);
+					id = report_begin("cmt program", image->type);
 					state = 2;
 				}
 
@@ -577,7 +604,7 @@ int nolo_boot_device(struct usb_device_info * dev, const char * cmdline) {
 		cmdline = NULL;
 	}
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_BOOT, mode, 0, (char *)cmdline, size, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_BOOT, mode, 0, (char *)cmdline, size, 2000) < 0 )
 		NOLO_ERROR_RETURN("Booting failed", -1);
 
 	return 0;
@@ -587,7 +614,7 @@ int nolo_boot_device(struct usb_device_info * dev, const char * cmdline) {
 int nolo_reboot_device(struct usb_device_info * dev) {
 
 	printf("Rebooting device...\n");
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_REBOOT, 0, 0, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_REBOOT, 0, 0, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_REBOOT failed", -1);
 	return 0;
 
@@ -596,7 +623,7 @@ int nolo_reboot_device(struct usb_device_info * dev) {
 int nolo_get_root_device(struct usb_device_info * dev) {
 
 	uint8_t device = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ROOT_DEVICE, (char *)&device, 1, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ROOT_DEVICE, (char *)&device, 1, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get root device", -1);
 	return device;
 
@@ -607,7 +634,7 @@ int nolo_set_root_device(struct usb_device_info * dev, int device) {
 	printf("Setting root device to %d...\n", device);
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, device, NOLO_ROOT_DEVICE, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, device, NOLO_ROOT_DEVICE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot set root device", -1);
 	return 0;
 
@@ -616,7 +643,7 @@ int nolo_set_root_device(struct usb_device_info * dev, int device) {
 int nolo_get_usb_host_mode(struct usb_device_info * dev) {
 
 	uint32_t enabled = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_USB_HOST_MODE, (void *)&enabled, 4, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_USB_HOST_MODE, (void *)&enabled, 4, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get USB host mode status", -1);
 	return enabled ? 1 : 0;
 
@@ -627,7 +654,7 @@ int nolo_set_usb_host_mode(struct usb_device_info * dev, int enable) {
 	printf("%s USB host mode...\n", enable ? "Enabling" : "Disabling");
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_USB_HOST_MODE, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_USB_HOST_MODE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot change USB host mode status", -1);
 	return 0;
 
@@ -636,7 +663,7 @@ int nolo_set_usb_host_mode(struct usb_device_info * dev, int enable) {
 int nolo_get_rd_mode(struct usb_device_info * dev) {
 
 	uint8_t enabled = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_RD_MODE, (char *)&enabled, 1, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_RD_MODE, (char *)&enabled, 1, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get R&D mode status", -1);
 	return enabled ? 1 : 0;
 
@@ -647,7 +674,7 @@ int nolo_set_rd_mode(struct usb_device_info * dev, int enable) {
 	printf("%s R&D mode...\n", enable ? "Enabling" : "Disabling");
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_RD_MODE, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_RD_MODE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot change R&D mode status", -1);
 	return 0;
 
@@ -660,7 +687,7 @@ int nolo_get_rd_flags(struct usb_device_info * dev, char * flags, size_t size) {
 	uint16_t add_flags = 0;
 	char * ptr = flags;
 
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ADD_RD_FLAGS, (char *)&add_flags, 2, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ADD_RD_FLAGS, (char *)&add_flags, 2, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get R&D flags", -1);
 
 	if ( add_flags & NOLO_RD_FLAG_NO_OMAP_WD )
@@ -760,10 +787,10 @@ int nolo_set_rd_flags(struct usb_device_info * dev, const char * flags) {
 	if ( simulate )
 		return 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, add_flags, NOLO_ADD_RD_FLAGS, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, add_flags, NOLO_ADD_RD_FLAGS, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot add R&D flags", -1);
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, del_flags, NOLO_DEL_RD_FLAGS, NULL, 0, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, del_flags, NOLO_DEL_RD_FLAGS, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot del R&D flags", -1);
 
 	return 0;
@@ -823,7 +850,7 @@ int nolo_get_nolo_ver(struct usb_device_info * dev, char * ver, size_t size) {
 
 	uint32_t version = 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_NOLO_VERSION, 0, 0, (char *)&version, 4, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_NOLO_VERSION, 0, 0, (char *)&version, 4, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get NOLO version", -1);
 
 	if ( (version & 255) > 1 )
@@ -882,7 +909,7 @@ int nolo_set_sw_ver(struct usb_device_info * dev, const char * ver) {
 	memcpy(ptr, ver, len);
 	ptr += len;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_SW_RELEASE, 0, 0, buf, ptr-buf, 2000) < 0 )
+	if ( usb_trace_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_SW_RELEASE, 0, 0, buf, ptr-buf, 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_SET_SW_RELEASE failed", -1);
 
 	return 0;
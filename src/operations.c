@@ -25,14 +25,18 @@
 #include "cold-flash.h"
 #include "nolo.h"
 #include "mkii.h"
+#include "mkii-tcp.h"
 #include "disk.h"
 #include "local.h"
+#include "report.h"
 
 #include "operations.h"
 
 struct device_info * dev_detect(void) {
 
+	static int detected = 0;
 	int ret = 0;
+	int id;
 	struct device_info * dev = NULL;
 	struct usb_device_info * usb = NULL;
 
@@ -41,19 +45,26 @@ struct device_info * dev_detect(void) {
 		goto clean;
 
 	/* LOCAL */
-	if ( local_init() == 0 ) {
+	if ( ! mkii_tcp && local_init() == 0 ) {
 		dev->method = METHOD_LOCAL;
 		dev->detected_device = local_get_device();
 		dev->detected_hwrev = local_get_hwrev();
 		return dev;
 	}
 
-	/* USB */
-	usb = usb_open_and_wait_for_device();
+	/* USB or Mk II over TCP */
+	id = report_begin(detected++ ? "re-enumerate" : "detect", IMAGE_UNKNOWN);
+	if ( mkii_tcp )
+		usb = mkii_tcp_open(mkii_tcp);
+	else
+		usb = usb_open_and_wait_for_device();
+	report_end(id, 0, usb ? 0 : -1);
 	if ( usb ) {
 		dev->method = METHOD_USB;
 		dev->usb = usb;
 
+		id = report_begin("init", IMAGE_UNKNOWN);
+
 		if ( dev->usb->flash_device->protocol == FLASH_NOLO )
 			ret = nolo_init(dev->usb);
 		else if ( dev->usb->flash_device->protocol == FLASH_COLD )
@@ -67,6 +78,8 @@ struct device_info * dev_detect(void) {
 			goto clean;
 		}
 
+		report_end(id, 0, ret);
+
 		if ( ret < 0 )
 			goto clean;
 
@@ -91,6 +104,9 @@ clean:
 
 void dev_free(struct device_info * dev) {
 
+	if ( dev->method == METHOD_LOCAL )
+		local_exit();
+
 	if ( dev->usb ) {
 		if ( dev->usb->flash_device->protocol == FLASH_DISK )
 			disk_exit(dev->usb);
@@ -138,7 +154,8 @@ int dev_load_image(struct device_info * dev, struct image * image) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_load_image(dev->usb, image);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -161,7 +178,8 @@ int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct
 		if ( protocol == FLASH_COLD )
 			return cold_flash(dev->usb, x2nd, secondary);
 
-		usb_switch_to_cold(dev->usb);
+		if ( usb_switch_to_cold(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -170,6 +188,41 @@ int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct
 
 }
 
+int dev_can_flash_image(struct device_info * dev, struct image * image) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return 1;
+
+	if ( dev->method == METHOD_USB ) {
+
+		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
+
+		if ( protocol == FLASH_NOLO )
+			return image->type != IMAGE_MMC;
+		else if ( protocol == FLASH_MKII )
+			/* Mk II data phase is supported only over TCP */
+			return ( ! dev->usb->udev && ( dev->usb->data & (1UL << image->type) ) ) ? 1 : 0;
+		else if ( protocol == FLASH_DISK )
+			return image->type == IMAGE_MMC;
+
+	}
+
+	return 0;
+
+}
+
+int dev_can_set_config(struct device_info * dev) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return 1;
+
+	if ( dev->method == METHOD_USB )
+		return dev->usb->flash_device->protocol == FLASH_NOLO;
+
+	return 0;
+
+}
+
 int dev_flash_image(struct device_info * dev, struct image * image) {
 
 	if ( dev->method == METHOD_LOCAL )
@@ -179,17 +232,24 @@ int dev_flash_image(struct device_info * dev, struct image * image) {
 
 		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
 
-		if ( protocol == FLASH_NOLO ) {
-			if ( image->type != IMAGE_MMC )
+		if ( dev_can_flash_image(dev, image) ) {
+			if ( protocol == FLASH_NOLO )
 				return nolo_flash_image(dev->usb, image);
-			usb_switch_to_update(dev->usb);
-			return -EAGAIN;
-		} else if ( protocol == FLASH_MKII ) {
-			if ( dev->usb->data & (1UL << image->type) )
+			else if ( protocol == FLASH_MKII )
 				return mkii_flash_image(dev->usb, image);
+			else if ( protocol == FLASH_DISK )
+				return disk_flash_image(dev->usb, image);
 		}
 
-		usb_switch_to_nolo(dev->usb);
+		/* eMMC can be flashed over USB only in Mass Storage mode */
+		if ( image->type == IMAGE_MMC ) {
+			if ( usb_switch_to_disk(dev->usb) < 0 )
+				return -1;
+			return -EAGAIN;
+		}
+
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -198,6 +258,27 @@ int dev_flash_image(struct device_info * dev, struct image * image) {
 
 }
 
+int dev_verify_image(struct device_info * dev, struct image * image) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return local_verify_image(image);
+
+	if ( dev->method == METHOD_USB ) {
+
+		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
+
+		if ( protocol == FLASH_DISK )
+			return disk_verify_image(dev->usb, image);
+
+		ERROR("Verify image via USB not in Mass Storage Mode is not supported");
+		return -1;
+
+	}
+
+	return -1;
+
+}
+
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file) {
 
 	if ( dev->method == METHOD_LOCAL )
@@ -219,14 +300,42 @@ int dev_dump_image(struct device_info * dev, enum image_type image, const char *
 
 }
 
+int dev_dump_image_to_fd(struct device_info * dev, enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return local_dump_image_to_fd(image, out, offset, length, hash);
+
+	if ( dev->method == METHOD_USB ) {
+
+		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
+
+		if ( protocol == FLASH_DISK )
+			return disk_dump_image_to_fd(dev->usb, image, out, offset, length, hash);
+
+		ERROR("Dump image via USB not in Mass Storage Mode is not supported");
+		return -1;
+
+	}
+
+	return -1;
+
+}
+
 int dev_check_badblocks(struct device_info * dev, const char * device) {
 
 	if ( dev->method == METHOD_LOCAL )
 		return local_check_badblocks(device);
 
 	if ( dev->method == METHOD_USB ) {
-		ERROR("Check for badblocks via USB is not supported");
+
+		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
+
+		if ( protocol == FLASH_DISK )
+			return disk_check_badblocks(dev->usb, device);
+
+		ERROR("Check for badblocks via USB not in Mass Storage Mode is not supported");
 		return -1;
+
 	}
 
 	return -1;
@@ -249,7 +358,8 @@ int dev_boot_device(struct device_info * dev, const char * cmdline) {
 		else if ( protocol == FLASH_MKII && cmdline && strcmp(cmdline, "update") == 0 )
 			return mkii_reboot_device(dev->usb, 1);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -274,7 +384,8 @@ int dev_reboot_device(struct device_info * dev) {
 		else if ( protocol == FLASH_MKII )
 			return mkii_reboot_device(dev->usb, 0);
 		else {
-			usb_switch_to_nolo(dev->usb);
+			if ( usb_switch_to_nolo(dev->usb) < 0 )
+				return -1;
 			return -EAGAIN;
 		}
 
@@ -314,7 +425,8 @@ int dev_set_root_device(struct device_info * dev, int device) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_root_device(dev->usb, device);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -353,7 +465,8 @@ int dev_set_usb_host_mode(struct device_info * dev, int enable) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_usb_host_mode(dev->usb, enable);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -392,7 +505,8 @@ int dev_set_rd_mode(struct device_info * dev, int enable) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_rd_mode(dev->usb, enable);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -431,7 +545,8 @@ int dev_set_rd_flags(struct device_info * dev, const char * flags) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_rd_flags(dev->usb, flags);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -472,7 +587,8 @@ int dev_set_hwrev(struct device_info * dev, int16_t hwrev) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_hwrev(dev->usb, hwrev);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -511,7 +627,8 @@ int dev_set_kernel_ver(struct device_info * dev, const char * ver) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_kernel_ver(dev->usb, ver);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -550,7 +667,8 @@ int dev_set_initfs_ver(struct device_info * dev, const char * ver) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_initfs_ver(dev->usb, ver);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -589,7 +707,8 @@ int dev_set_nolo_ver(struct device_info * dev, const char * ver) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_nolo_ver(dev->usb, ver);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -630,7 +749,8 @@ int dev_set_sw_ver(struct device_info * dev, const char * ver) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_sw_ver(dev->usb, ver);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -669,7 +789,8 @@ int dev_set_content_ver(struct device_info * dev, const char * ver) {
 		if ( protocol == FLASH_NOLO )
 			return nolo_set_content_ver(dev->usb, ver);
 
-		usb_switch_to_nolo(dev->usb);
+		if ( usb_switch_to_nolo(dev->usb) < 0 )
+			return -1;
 		return -EAGAIN;
 
 	}
@@ -677,3 +798,12 @@ int dev_set_content_ver(struct device_info * dev, const char * ver) {
 	return -1;
 
 }
+
+int dev_flush_config(struct device_info * dev) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return local_flush_config();
+
+	return 0;
+
+}
@@ -20,6 +20,9 @@
 #ifndef OPERATIONS_H
 #define OPERATIONS_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "image.h"
 #include "usb-device.h"
 
@@ -44,7 +47,14 @@ enum device dev_get_device(struct device_info * dev);
 int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct image * secondary);
 int dev_load_image(struct device_info * dev, struct image * image);
 int dev_flash_image(struct device_info * dev, struct image * image);
+
+/* Returns 1 if operation can be done in current mode of device without switching to another mode */
+int dev_can_flash_image(struct device_info * dev, struct image * image);
+int dev_can_set_config(struct device_info * dev);
+
+int dev_verify_image(struct device_info * dev, struct image * image);
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file);
+int dev_dump_image_to_fd(struct device_info * dev, enum image_type image, int out, off_t offset, uint64_t * length, uint16_t * hash);
 int dev_check_badblocks(struct device_info * dev, const char * device);
 
 int dev_boot_device(struct device_info * dev, const char * cmdline);
@@ -80,4 +90,6 @@ int dev_set_sw_ver(struct device_info * dev, const char * ver);
 int dev_get_content_ver(struct device_info * dev, char * ver, size_t size);
 int dev_set_content_ver(struct device_info * dev, const char * ver);
 
+int dev_flush_config(struct device_info * dev);
+
 #endif
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/select.h>
@@ -32,26 +34,108 @@
 
 int printf_prev = 0;
 
+/* Redraw progress bar at most this many times per second */
+#define PROGRESS_RATE		10
+/* When output is not terminal, print plain progress line every this many seconds */
+#define PROGRESS_PLAIN_INTERVAL	5
+
+static struct {
+	int init;
+	int tty;
+	int cols;
+	unsigned long long part;
+	unsigned long long total;
+	unsigned long long start;
+	unsigned long long last;
+} progress;
+
+/* Monotonic time in ms */
+static unsigned long long progress_time(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
 void printf_progressbar(unsigned long long part, unsigned long long total) {
 
-	char *columns = getenv("COLUMNS");
+	char *columns;
+	char info[64];
+	char bar[128];
+	unsigned long long now = progress_time();
+	unsigned long long elapsed;
+	unsigned long long rate;
+	unsigned long long eta;
 	int pc;
-	int tmp, cols = 80;
+	int tmp, cols;
+
+	if ( ! progress.init ) {
+		progress.tty = isatty(1);
+		progress.cols = 80;
+		columns = getenv("COLUMNS");
+		if ( columns )
+			progress.cols = atoi(columns);
+		if ( progress.cols > 115 )
+			progress.cols = 115;
+		progress.init = 1;
+	}
+
+	/* New progress bar */
+	if ( part == 0 || part < progress.part || total != progress.total ) {
+		progress.start = now;
+		progress.last = 0;
+	}
+
+	progress.part = part;
+	progress.total = total;
+
+	/* Drawing is slow on serial console, so draw only start, end and few times per second */
+	if ( part != 0 && part != total ) {
+		if ( progress.tty && now - progress.last < 1000 / PROGRESS_RATE )
+			return;
+		if ( ! progress.tty && now - progress.last < PROGRESS_PLAIN_INTERVAL * 1000 )
+			return;
+	}
+
+	progress.last = now;
 
 	/* percentage calculation */
 	pc = total == 0 ? 100 : (int)(part*100/total);
 	( pc < 0 ) ? pc = 0 : ( pc > 100 ) ? pc = 100 : 0;
 
+	/* throughput (only for bytes) and ETA */
+	info[0] = 0;
+	elapsed = now - progress.start;
+	if ( part > 0 && part < total && elapsed > 0 ) {
+		rate = part * 1000 / elapsed;
+		eta = rate ? ( total - part ) / rate : 0;
+		tmp = 0;
+		if ( total >= (1ULL << 20) )
+			tmp = snprintf(info, sizeof(info), " %.1f MB/s", (double)rate / (1 << 20));
+		if ( rate && eta < 100 * 3600 )
+			snprintf(info + tmp, sizeof(info) - tmp, " ETA %llu:%02llu", eta / 60, eta % 60);
+	}
+
+	if ( ! progress.tty ) {
+		printf("  %3d%%%s\n", pc, info);
+		fflush(stdout);
+		return;
+	}
+
+	cols = progress.cols - 15 - (int)strlen(info);
+	if ( cols < 10 )
+		cols = 10;
+	if ( cols > (int)sizeof(bar) - 1 )
+		cols = sizeof(bar) - 1;
+
+	for ( tmp = 0; tmp < cols; ++tmp )
+		bar[tmp] = ( tmp < cols*pc/100 ) ? '#' : '-';
+	bar[cols] = 0;
+
 	PRINTF_BACK();
-	PRINTF_ADD("\x1b[K  %3d%% [", pc);
-	if ( columns )
-		cols = atoi(columns);
-	if ( cols > 115 )
-		cols = 115;
-	cols-=15;
-	for ( tmp = cols*pc/100; tmp; tmp-- ) PRINTF_ADD("#");
-	for ( tmp = cols-(cols*pc/100); tmp; tmp-- ) PRINTF_ADD("-");
-	PRINTF_ADD("]");
+	PRINTF_ADD("\x1b[K  %3d%% [%s]%s", pc, bar, info);
 	if ( part == total ) PRINTF_END();
 	fflush(stdout);
 
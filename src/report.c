@@ -0,0 +1,191 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "image.h"
+#include "scan.h"
+#include "report.h"
+
+#define REPORT_MAX_DEPTH	16
+
+struct report_phase {
+	const char * name;
+	enum image_type type;
+	int parent;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	int retries;
+	int status;
+	int ended;
+};
+
+static struct {
+	int enabled;
+	uint64_t start;
+	struct report_phase * phases;
+	int count;
+	int alloc;
+	int stack[REPORT_MAX_DEPTH];
+	int depth;
+} report;
+
+void report_enable(void) {
+
+	report.enabled = 1;
+	report.start = scan_time();
+
+}
+
+int report_begin(const char * phase, enum image_type type) {
+
+	struct report_phase * phases;
+	struct report_phase * ptr;
+
+	if ( ! report.enabled || report.depth == REPORT_MAX_DEPTH )
+		return -1;
+
+	if ( report.count == report.alloc ) {
+		phases = realloc(report.phases, ( report.alloc + 64 ) * sizeof(*phases));
+		if ( ! phases )
+			return -1;
+		report.phases = phases;
+		report.alloc += 64;
+	}
+
+	ptr = &report.phases[report.count];
+	memset(ptr, 0, sizeof(*ptr));
+	ptr->name = phase;
+	ptr->type = type;
+	ptr->parent = report.depth ? report.stack[report.depth-1] : -1;
+	ptr->start = scan_time();
+
+	report.stack[report.depth++] = report.count;
+
+	return report.count++;
+
+}
+
+static void report_close(int id, uint64_t bytes, int status) {
+
+	struct report_phase * ptr = &report.phases[id];
+
+	ptr->end = scan_time();
+	ptr->bytes = bytes;
+	ptr->status = status;
+	ptr->ended = 1;
+
+}
+
+void report_end(int id, uint64_t bytes, int status) {
+
+	int i;
+
+	if ( ! report.enabled || id < 0 || id >= report.count || report.phases[id].ended )
+		return;
+
+	/* Inner phases which were not ended failed */
+	for ( i = report.depth - 1; i >= 0 && report.stack[i] != id; --i )
+		report_close(report.stack[i], 0, -1);
+
+	report_close(id, bytes, status);
+
+	if ( i >= 0 )
+		report.depth = i;
+
+}
+
+void report_retry(void) {
+
+	if ( report.enabled && report.depth > 0 )
+		++report.phases[report.stack[report.depth-1]].retries;
+
+}
+
+int report_write(const char * file, int status) {
+
+	struct report_phase * ptr;
+	const char * type;
+	char tmp[1024];
+	FILE * fp;
+	double time;
+	int i;
+
+	if ( ! report.enabled )
+		return 0;
+
+	while ( report.depth > 0 )
+		report_close(report.stack[--report.depth], 0, -1);
+
+	/* Write to temporary file and rename it, so readers never see partial report */
+	if ( snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp) )
+		ERROR_RETURN("Report file name is too long", -1);
+
+	fp = fopen(tmp, "w");
+	if ( ! fp ) {
+		ERROR_INFO("Cannot create report file %s", tmp);
+		return -1;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": \"%s\",\n", VERSION);
+	fprintf(fp, "  \"start_us\": %llu,\n", (unsigned long long int)report.start);
+	fprintf(fp, "  \"end_us\": %llu,\n", (unsigned long long int)scan_time());
+	fprintf(fp, "  \"status\": %d,\n", status);
+	fprintf(fp, "  \"phases\": [");
+
+	for ( i = 0; i < report.count; ++i ) {
+
+		ptr = &report.phases[i];
+		type = ptr->type ? image_type_to_string(ptr->type) : NULL;
+		time = ( ptr->end - ptr->start ) / 1e6;
+
+		fprintf(fp, "%s\n    { \"id\": %d, \"parent\": %d, \"phase\": \"%s\", ", i ? "," : "", i, ptr->parent, ptr->name);
+		if ( type )
+			fprintf(fp, "\"image\": \"%s\", ", type);
+		else
+			fprintf(fp, "\"image\": null, ");
+		fprintf(fp, "\"start_us\": %llu, \"end_us\": %llu, ", (unsigned long long int)ptr->start, (unsigned long long int)ptr->end);
+		fprintf(fp, "\"bytes\": %llu, \"mb_per_s\": %.2f, ", (unsigned long long int)ptr->bytes, time > 0 ? ptr->bytes / time / (1 << 20) : 0.0);
+		fprintf(fp, "\"retries\": %d, \"status\": %d }", ptr->retries, ptr->status);
+
+	}
+
+	fprintf(fp, "\n  ]\n}\n");
+
+	if ( fclose(fp) != 0 ) {
+		ERROR_INFO("Cannot write report file %s", tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	if ( rename(tmp, file) != 0 ) {
+		ERROR_INFO("Cannot rename report file %s to %s", tmp, file);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,45 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+/*
+ * Timing report of operation phases (detect, init, data transfer, ...)
+ * written as JSON. Phases can be nested and phase which was not ended
+ * (e.g. because of error) is ended together with its parent as failed.
+ * Functions do nothing until report_enable is called.
+ */
+void report_enable(void);
+
+/* Start phase, optionally for image (IMAGE_UNKNOWN if none), returns id for report_end */
+int report_begin(const char * phase, enum image_type type);
+void report_end(int id, uint64_t bytes, int status);
+
+/* Count retry of current phase */
+void report_retry(void);
+
+/* Write report with final status atomically to file */
+int report_write(const char * file, int status);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* O_DIRECT is Linux extension */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include "global.h"
+#include "printf-utils.h"
+#include "scan.h"
+#include "buffer.h"
+
+/* Size of one read request of block device */
+#define SCAN_REQUEST_SIZE	(1UL << 20) /* 1MB */
+#define SCAN_WORKERS		4
+
+/* Histogram buckets are 250us, 500us, 1ms, ... 1s and slower */
+#define SCAN_BUCKETS		14
+#define SCAN_BUCKET_BASE	250
+
+/* Region is slow if it takes this times longer than median */
+#define SCAN_SLOW_FACTOR	4
+#define SCAN_MAX_REGIONS	16
+
+uint64_t scan_time(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+static int scan_cmp(const void * a, const void * b) {
+
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+static void scan_print_time(uint32_t usec) {
+
+	if ( usec < 1000 )
+		printf("%5uus", usec);
+	else
+		printf("%5ums", usec / 1000);
+
+}
+
+void scan_report(const uint32_t * usec, uint64_t count, uint64_t offset, uint32_t size, uint64_t bytes, uint64_t elapsed) {
+
+	uint64_t hist[SCAN_BUCKETS];
+	uint64_t max = 0;
+	uint64_t num = 0;
+	uint64_t start;
+	uint64_t i;
+	uint32_t * sorted;
+	uint32_t median;
+	uint32_t limit;
+	uint32_t worst;
+	int regions;
+	int bucket;
+	int len;
+
+	memset(hist, 0, sizeof(hist));
+
+	sorted = malloc(count * sizeof(*sorted) + 1);
+	if ( ! sorted ) {
+		ALLOC_ERROR();
+		return;
+	}
+
+	for ( i = 0; i < count; ++i ) {
+		if ( usec[i] == SCAN_SKIPPED )
+			continue;
+		for ( bucket = 0; bucket < SCAN_BUCKETS - 1; ++bucket )
+			if ( usec[i] < (uint32_t)SCAN_BUCKET_BASE << bucket )
+				break;
+		if ( ++hist[bucket] > max )
+			max = hist[bucket];
+		sorted[num++] = usec[i];
+	}
+
+	if ( elapsed == 0 )
+		elapsed = 1;
+
+	printf("Read %llu MB in %.1f s (%.1f MB/s)\n", (unsigned long long int)(bytes >> 20), elapsed / 1e6, bytes / (elapsed / 1e6) / (1 << 20));
+
+	if ( num == 0 ) {
+		free(sorted);
+		return;
+	}
+
+	printf("Latency of %u kB reads:\n", size >> 10);
+
+	for ( bucket = 0; bucket < SCAN_BUCKETS; ++bucket ) {
+		if ( ! hist[bucket] )
+			continue;
+		printf("  %s", bucket == SCAN_BUCKETS - 1 ? ">=" : " <");
+		scan_print_time((uint32_t)SCAN_BUCKET_BASE << ( bucket == SCAN_BUCKETS - 1 ? bucket - 1 : bucket ));
+		printf(" %8llu ", (unsigned long long int)hist[bucket]);
+		for ( len = hist[bucket] * 50 / max; len >= 0; --len )
+			printf("#");
+		printf("\n");
+	}
+
+	qsort(sorted, num, sizeof(*sorted), scan_cmp);
+	median = sorted[num / 2];
+	free(sorted);
+
+	printf("Median latency:");
+	scan_print_time(median);
+	printf("\n");
+
+	/* Merge neighbour slow regions */
+	limit = median * SCAN_SLOW_FACTOR;
+	if ( limit < SCAN_BUCKET_BASE * SCAN_SLOW_FACTOR )
+		limit = SCAN_BUCKET_BASE * SCAN_SLOW_FACTOR;
+
+	regions = 0;
+	i = 0;
+
+	while ( i < count ) {
+
+		if ( usec[i] == SCAN_SKIPPED || usec[i] < limit ) {
+			++i;
+			continue;
+		}
+
+		start = i;
+		worst = 0;
+		for ( ; i < count && usec[i] != SCAN_SKIPPED && usec[i] >= limit; ++i )
+			if ( usec[i] > worst )
+				worst = usec[i];
+
+		if ( regions++ == SCAN_MAX_REGIONS ) {
+			printf("  ...\n");
+			continue;
+		} else if ( regions > SCAN_MAX_REGIONS ) {
+			continue;
+		}
+
+		if ( regions == 1 )
+			printf("Slow regions:\n");
+
+		printf("  0x%012llx-0x%012llx ", (unsigned long long int)(offset + start * size), (unsigned long long int)(offset + i * size));
+		scan_print_time(worst);
+		printf("\n");
+
+	}
+
+	if ( regions == 0 )
+		printf("No slow regions\n");
+
+}
+
+struct scan_dev {
+	pthread_mutex_t lock;
+	int fd;
+	int direct;
+	uint64_t size;
+	uint64_t count;
+	uint64_t next;
+	uint64_t done;
+	uint32_t * usec;
+	unsigned char * failed;
+};
+
+static int scan_dev_read(struct scan_dev * scan, char * buf, size_t count, uint64_t pos) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = pread(scan->fd, buf + done, count - done, pos + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+#ifdef __linux__
+		/* Device without O_DIRECT support, continue buffered */
+		if ( ret < 0 && errno == EINVAL && scan->direct ) {
+			fcntl(scan->fd, F_SETFL, fcntl(scan->fd, F_GETFL) & ~O_DIRECT);
+			scan->direct = 0;
+			continue;
+		}
+#endif
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static void * scan_dev_worker(void * priv) {
+
+	struct scan_dev * scan = priv;
+	char * buf;
+	uint64_t start;
+	uint64_t idx;
+	uint64_t pos;
+	size_t len;
+	int ret;
+
+	buf = buffer_alloc(SCAN_REQUEST_SIZE);
+	if ( ! buf )
+		return NULL;
+
+	while ( 1 ) {
+
+		pthread_mutex_lock(&scan->lock);
+		idx = scan->next++;
+		pthread_mutex_unlock(&scan->lock);
+
+		if ( idx >= scan->count )
+			break;
+
+		pos = idx * SCAN_REQUEST_SIZE;
+		len = scan->size - pos < SCAN_REQUEST_SIZE ? scan->size - pos : SCAN_REQUEST_SIZE;
+
+		start = scan_time();
+		ret = scan_dev_read(scan, buf, len, pos);
+		scan->usec[idx] = scan_time() - start;
+		if ( ret < 0 )
+			scan->failed[idx] = 1;
+
+		pthread_mutex_lock(&scan->lock);
+		scan->done += len;
+		if ( scan->done < scan->size )
+			printf_progressbar(scan->done, scan->size);
+		pthread_mutex_unlock(&scan->lock);
+
+	}
+
+	buffer_free(buf);
+	return NULL;
+
+}
+
+int scan_dev(int fd, uint64_t size) {
+
+	struct scan_dev scan;
+	pthread_t workers[SCAN_WORKERS];
+	uint64_t start;
+	uint64_t failed;
+	uint64_t i;
+	int flags;
+	int num;
+	int ret;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.fd = fd;
+	scan.size = size;
+	scan.count = ( size + SCAN_REQUEST_SIZE - 1 ) / SCAN_REQUEST_SIZE;
+
+	scan.usec = calloc(scan.count + 1, sizeof(*scan.usec));
+	scan.failed = calloc(scan.count + 1, 1);
+	if ( ! scan.usec || ! scan.failed ) {
+		free(scan.usec);
+		free(scan.failed);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	flags = fcntl(fd, F_GETFL);
+
+#ifdef __linux__
+	/* Measure device, not page cache */
+	if ( flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0 )
+		scan.direct = 1;
+#endif
+
+	pthread_mutex_init(&scan.lock, NULL);
+
+	printf("Reading %llu MB with %d workers...\n", (unsigned long long int)(size >> 20), SCAN_WORKERS);
+
+	printf_progressbar(0, size);
+	start = scan_time();
+
+	for ( num = 0; num < SCAN_WORKERS; ++num )
+		if ( pthread_create(&workers[num], NULL, scan_dev_worker, &scan) != 0 )
+			break;
+
+	/* Without any worker read at least in this thread */
+	if ( num == 0 )
+		scan_dev_worker(&scan);
+
+	for ( i = 0; i < (uint64_t)num; ++i )
+		pthread_join(workers[i], NULL);
+
+	if ( scan.done == size )
+		printf_progressbar(size, size);
+	else
+		PRINTF_END();
+
+	if ( scan.next < scan.count ) {
+		PRINTF_ERROR("Cannot allocate read buffer");
+		ret = -1;
+		goto clean;
+	}
+
+	scan_report(scan.usec, scan.count, 0, SCAN_REQUEST_SIZE, size, scan_time() - start);
+
+	failed = 0;
+	for ( i = 0; i < scan.count; ++i ) {
+		if ( ! scan.failed[i] )
+			continue;
+		if ( failed++ == 0 )
+			printf("Unreadable regions:\n");
+		if ( failed <= SCAN_MAX_REGIONS )
+			printf("  0x%012llx-0x%012llx\n", (unsigned long long int)(i * SCAN_REQUEST_SIZE), (unsigned long long int)((i + 1) * SCAN_REQUEST_SIZE));
+	}
+
+	if ( failed )
+		printf("Found %llu unreadable regions\n", (unsigned long long int)failed);
+	else
+		printf("No read errors\n");
+
+	ret = failed ? 1 : 0;
+
+clean:
+	if ( flags != -1 )
+		fcntl(fd, F_SETFL, flags);
+
+	pthread_mutex_destroy(&scan.lock);
+	free(scan.usec);
+	free(scan.failed);
+
+	return ret;
+
+}
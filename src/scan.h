@@ -0,0 +1,39 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+/* Latency of region which was not read (e.g. bad block) */
+#define SCAN_SKIPPED	UINT32_MAX
+
+uint64_t scan_time(void);
+
+/*
+ * Print latency histogram, regions much slower than median and throughput.
+ * usec contains read latency of each region of size bytes starting at offset.
+ */
+void scan_report(const uint32_t * usec, uint64_t count, uint64_t offset, uint32_t size, uint64_t bytes, uint64_t elapsed);
+
+/* Read whole block device by several workers with O_DIRECT, returns 1 if some regions are unreadable */
+int scan_dev(int fd, uint64_t size);
+
+#endif
@@ -0,0 +1,580 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Minimal softupd compatible Mk II server, writes received images to files */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "mkii-proto.h"
+
+#define MAX_TARGETS	16
+
+/* Values of state byte in MKII_FLASH_STATUS response */
+#define STATE_IDLE	0x01
+#define STATE_RECEIVING	0x03
+#define STATE_FINISHED	0x04
+
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+int verbose;
+
+struct target {
+	char type[13];
+	const char * file;
+};
+
+static struct target targets[MAX_TARGETS];
+static int targets_count;
+
+static const char * device = "RX-51";
+static const char * hwrev = "2101";
+static const char * sw_release;
+
+struct session {
+	int sock;
+	int fd;
+	const struct target * target;
+	uint16_t hash;
+	uint16_t data_hash;
+	uint32_t size;
+	uint32_t received;
+	int failed;
+	char * buf;
+};
+
+static int read_all(int sock, void * buf, size_t size) {
+
+	char * ptr = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < size ) {
+		ret = recv(sock, ptr + done, size - done, 0);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int write_all(int sock, const void * buf, size_t size) {
+
+	const char * ptr = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < size ) {
+		ret = send(sock, ptr + done, size - done, MSG_NOSIGNAL);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int reply(struct session * s, const struct mkii_message * req, const void * data, size_t size) {
+
+	char buf[2048];
+	struct mkii_message * msg = (struct mkii_message *)buf;
+
+	if ( size > sizeof(buf) - sizeof(*msg) )
+		return -1;
+
+	msg->header = MKII_IN;
+	msg->size = htons(size + 4);
+	msg->zero = 0;
+	msg->num = req->num;
+	msg->type = req->type | MKII_RESPONCE;
+	if ( size )
+		memcpy(msg->data, data, size);
+
+	return write_all(s->sock, msg, sizeof(*msg) + size);
+
+}
+
+static int reply_string(struct session * s, const struct mkii_message * req, const char * str) {
+
+	char buf[512];
+	size_t len;
+
+	if ( ! str )
+		return reply(s, req, "\x01", 1);
+
+	len = strlen(str);
+	if ( len > sizeof(buf) - 1 )
+		len = sizeof(buf) - 1;
+
+	buf[0] = 0;
+	memcpy(buf + 1, str, len);
+	return reply(s, req, buf, len + 1);
+
+}
+
+static uint16_t do_hash(uint16_t * b, size_t len) {
+
+	uint16_t result = 0;
+
+	for ( len >>= 1; len--; b = b+1 )
+		result^=b[0];
+
+	return result;
+
+}
+
+static void close_target(struct session * s) {
+
+	if ( s->fd >= 0 )
+		close(s->fd);
+	s->fd = -1;
+	s->target = NULL;
+
+}
+
+static int handle_get(struct session * s, const struct mkii_message * req, const char * key) {
+
+	char buf[512];
+	int i;
+
+	VERBOSE("GET %s\n", key);
+
+	if ( strcmp(key, "/update/protocol_version") == 0 )
+		return reply_string(s, req, "2");
+	else if ( strcmp(key, "/device/product_code") == 0 )
+		return reply_string(s, req, device);
+	else if ( strcmp(key, "/device/hw_build") == 0 )
+		return reply_string(s, req, hwrev);
+	else if ( strcmp(key, "/version/sw_release") == 0 )
+		return reply_string(s, req, sw_release);
+	else if ( strcmp(key, "/update/supported_images") == 0 ) {
+		buf[0] = 0;
+		for ( i = 0; i < targets_count; ++i ) {
+			if ( i != 0 )
+				strncat(buf, ",", sizeof(buf) - strlen(buf) - 1);
+			strncat(buf, targets[i].type, sizeof(buf) - strlen(buf) - 1);
+		}
+		return reply_string(s, req, buf);
+	}
+
+	return reply_string(s, req, NULL);
+
+}
+
+/* Parse fiasco subimage header and open output for image type */
+static int handle_header(struct session * s, const struct mkii_message * req, size_t size) {
+
+	char type[13];
+	uint16_t hash;
+	uint32_t image_size;
+	int i;
+
+	close_target(s);
+
+	if ( size < 23 || memcmp(req->data, "\x2E\x19\x01\x01", 4) != 0 )
+		return reply(s, req, "\x01\x00\x00\x00\x00\x00\x00\x00\x00", 9);
+
+	memcpy(&hash, req->data + 5, 2);
+	memcpy(type, req->data + 7, 12);
+	type[12] = 0;
+	memcpy(&image_size, req->data + 19, 4);
+
+	s->hash = ntohs(hash);
+	s->size = ntohl(image_size);
+	s->received = 0;
+	s->data_hash = 0;
+	s->failed = 0;
+
+	for ( i = 0; i < targets_count; ++i )
+		if ( strcmp(targets[i].type, type) == 0 )
+			break;
+
+	if ( i == targets_count ) {
+		ERROR("Image type %s is not supported", type);
+		return reply(s, req, "\x01\x00\x00\x00\x00\x00\x00\x00\x00", 9);
+	}
+
+	s->fd = open(targets[i].file, O_WRONLY | O_CREAT, 0644);
+	if ( s->fd < 0 ) {
+		ERROR_INFO("Cannot open %s", targets[i].file);
+		return reply(s, req, "\x01\x00\x00\x00\x00\x00\x00\x00\x00", 9);
+	}
+
+	s->target = &targets[i];
+
+	printf("Receiving %s image (%u bytes) to %s\n", type, s->size, targets[i].file);
+
+	return reply(s, req, "\x00\x00\x00\x00\x00\x00\x02\x00\x00", 9);
+
+}
+
+static int finish_target(struct session * s) {
+
+	struct stat st;
+
+	if ( fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(s->fd, s->size) < 0 )
+		s->failed = 1;
+
+	if ( fsync(s->fd) < 0 && errno != EINVAL )
+		s->failed = 1;
+
+	if ( s->data_hash != s->hash ) {
+		ERROR("Image hash mishmash (counted %#04x, got %#04x)", s->data_hash, s->hash);
+		s->failed = 1;
+	}
+
+	if ( s->failed )
+		ERROR("Writing %s image failed", s->target->type);
+	else
+		printf("Done\n");
+
+	close_target(s);
+	return s->failed ? -1 : 0;
+
+}
+
+/* Receive raw image data which follows MKII_FLASH_DATA message */
+static int handle_data(struct session * s, const struct mkii_message * req, size_t size) {
+
+	uint32_t chunk;
+	ssize_t ret;
+
+	if ( size != 8 || ! s->target )
+		return reply(s, req, "\x01", 1);
+
+	memcpy(&chunk, req->data + 4, 4);
+	chunk = ntohl(chunk);
+
+	if ( chunk > MKII_DATA_CHUNK || chunk > s->size - s->received )
+		return reply(s, req, "\x01", 1);
+
+	if ( reply(s, req, "\x00", 1) < 0 )
+		return -1;
+
+	if ( read_all(s->sock, s->buf, chunk) < 0 )
+		return -1;
+
+	s->data_hash ^= do_hash((uint16_t *)s->buf, chunk);
+
+	ret = pwrite(s->fd, s->buf, chunk, s->received);
+	if ( ret < 0 || (size_t)ret != chunk )
+		s->failed = 1;
+
+	s->received += chunk;
+
+	if ( s->received == s->size )
+		finish_target(s);
+
+	return 0;
+
+}
+
+static int handle_status(struct session * s, const struct mkii_message * req) {
+
+	char buf[21];
+	uint32_t received;
+
+	memset(buf, 0, sizeof(buf));
+
+	if ( s->failed )
+		buf[0] = 1;
+
+	if ( s->target )
+		buf[3] = STATE_RECEIVING;
+	else if ( s->size && s->received == s->size )
+		buf[3] = STATE_FINISHED;
+	else
+		buf[3] = STATE_IDLE;
+
+	received = htonl(s->received);
+	memcpy(buf + 16, &received, 4);
+
+	return reply(s, req, buf, sizeof(buf));
+
+}
+
+static int handle_progress(struct session * s, const struct mkii_message * req) {
+
+	char buf[13];
+	uint32_t remaining;
+
+	memset(buf, 0, sizeof(buf));
+	buf[3] = 1;
+	remaining = htonl(s->size - s->received);
+	memcpy(buf + 8, &remaining, 4);
+
+	return reply(s, req, buf, sizeof(buf));
+
+}
+
+static void serve(int sock) {
+
+	char buf[2048];
+	struct mkii_message * msg = (struct mkii_message *)buf;
+	struct session s;
+	size_t size;
+	int ret = 0;
+
+	memset(&s, 0, sizeof(s));
+	s.sock = sock;
+	s.fd = -1;
+	s.buf = malloc(MKII_DATA_CHUNK);
+	if ( ! s.buf ) {
+		ALLOC_ERROR();
+		return;
+	}
+
+	while ( ret >= 0 ) {
+
+		if ( read_all(sock, buf, MKII_HEADER_SIZE) < 0 )
+			break;
+
+		size = ntohs(msg->size);
+		if ( msg->header != MKII_OUT || size < 4 || size > sizeof(buf) - MKII_HEADER_SIZE - 1 ) {
+			ERROR("Invalid message");
+			break;
+		}
+
+		if ( read_all(sock, buf + MKII_HEADER_SIZE, size) < 0 )
+			break;
+
+		size -= 4;
+		msg->data[size] = 0;
+
+		switch ( msg->type ) {
+
+			case MKII_PING:
+				ret = reply(&s, msg, NULL, 0);
+				break;
+
+			case MKII_GET:
+				ret = handle_get(&s, msg, msg->data);
+				break;
+
+			case MKII_TELL:
+				VERBOSE("TELL %s\n", msg->data);
+				ret = reply(&s, msg, "\x00", 1);
+				break;
+
+			case MKII_FLASH_BEGIN:
+				close_target(&s);
+				ret = reply(&s, msg, "\x00", 1);
+				break;
+
+			case MKII_FLASH_HEADER:
+				ret = handle_header(&s, msg, size);
+				break;
+
+			case MKII_FLASH_CHANNEL:
+				VERBOSE("Data channel %s\n", size > 4 ? msg->data + 4 : "");
+				ret = reply(&s, msg, "\x00", 1);
+				break;
+
+			case MKII_FLASH_STATUS:
+				ret = handle_status(&s, msg);
+				break;
+
+			case MKII_FLASH_PROGRESS:
+				ret = handle_progress(&s, msg);
+				break;
+
+			case MKII_FLASH_DATA:
+				ret = handle_data(&s, msg, size);
+				break;
+
+			case MKII_REBOOT:
+				printf("Got reboot request (%s)\n", msg->data);
+				reply(&s, msg, "\x00", 1);
+				ret = -1;
+				break;
+
+			default:
+				ERROR("Unknown message type %#02x", msg->type);
+				ret = reply(&s, msg, "\x01", 1);
+				break;
+
+		}
+
+	}
+
+	close_target(&s);
+	free(s.buf);
+
+}
+
+static void show_usage(void) {
+
+	printf(""
+		"Usage: 0xFFFF-softupd [options] type:file [type:file...]\n"
+		"\n"
+		" -a addr         listen address (default: 127.0.0.1)\n"
+		" -p port         listen port (default: %d)\n"
+		" -d dev          reported device (default: %s)\n"
+		" -w hw           reported HW revision (default: %s)\n"
+		" -S ver          reported SW release version (default: none)\n"
+		" -1              exit after first connection\n"
+		" -v              be verbose and noisy\n"
+		" -h              show this help message\n"
+		"\n", MKII_TCP_PORT, device, hwrev);
+
+}
+
+int main(int argc, char **argv) {
+
+	const char * address = "127.0.0.1";
+	char port[16];
+	struct addrinfo hints;
+	struct addrinfo * res;
+	char * ptr;
+	int once = 0;
+	int sock;
+	int client;
+	int one = 1;
+	int ret;
+	int c;
+
+	snprintf(port, sizeof(port), "%d", MKII_TCP_PORT);
+
+	while ( ( c = getopt(argc, argv, "a:p:d:w:S:1vh") ) != -1 ) {
+		switch ( c ) {
+			case 'a':
+				address = optarg;
+				break;
+			case 'p':
+				snprintf(port, sizeof(port), "%s", optarg);
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'w':
+				hwrev = optarg;
+				break;
+			case 'S':
+				sw_release = optarg;
+				break;
+			case '1':
+				once = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				show_usage();
+				return 0;
+			default:
+				show_usage();
+				return 1;
+		}
+	}
+
+	for ( ; optind < argc; ++optind ) {
+		ptr = strchr(argv[optind], ':');
+		if ( ! ptr || ptr == argv[optind] || (size_t)(ptr - argv[optind]) >= sizeof(targets[0].type) || targets_count == MAX_TARGETS ) {
+			ERROR("Invalid target '%s'", argv[optind]);
+			return 1;
+		}
+		memcpy(targets[targets_count].type, argv[optind], ptr - argv[optind]);
+		targets[targets_count].type[ptr - argv[optind]] = 0;
+		targets[targets_count].file = ptr + 1;
+		++targets_count;
+	}
+
+	if ( targets_count == 0 ) {
+		show_usage();
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(address, port, &hints, &res);
+	if ( ret != 0 ) {
+		ERROR("Cannot resolve %s: %s", address, gai_strerror(ret));
+		return 1;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if ( sock < 0 ) {
+		ERROR_INFO("Cannot create socket");
+		freeaddrinfo(res);
+		return 1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if ( bind(sock, res->ai_addr, res->ai_addrlen) < 0 || listen(sock, 1) < 0 ) {
+		ERROR_INFO("Cannot listen on %s port %s", address, port);
+		freeaddrinfo(res);
+		close(sock);
+		return 1;
+	}
+
+	freeaddrinfo(res);
+
+	printf("Listening on %s port %s\n", address, port);
+
+	while ( 1 ) {
+
+		client = accept(sock, NULL, NULL);
+		if ( client < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			ERROR_INFO("Cannot accept connection");
+			break;
+		}
+
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		printf("Client connected\n");
+		serve(client);
+		close(client);
+		printf("Client disconnected\n");
+
+		if ( once )
+			break;
+
+	}
+
+	close(sock);
+	return 0;
+
+}
@@ -38,6 +38,7 @@
 #include "nolo.h"
 #include "cold-flash.h"
 #include "mkii.h"
+#include "report.h"
 
 #ifdef __linux__
 #ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
@@ -380,14 +381,30 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 void usb_close_device(struct usb_device_info * dev) {
 
-	if ( dev->flash_device->protocol != FLASH_COLD )
-		usb_reattach_kernel_driver(dev->udev, dev->flash_device->interface);
-	usb_close(dev->udev);
+	if ( dev->flash_device->protocol == FLASH_MKII )
+		mkii_exit(dev);
+
+	if ( dev->mkii_transport && dev->mkii_transport->close )
+		dev->mkii_transport->close(dev);
+
+	if ( dev->udev ) {
+		if ( dev->flash_device->protocol != FLASH_COLD )
+			usb_reattach_kernel_driver(dev->udev, dev->flash_device->interface);
+		usb_close(dev->udev);
+	}
+
 	free(dev);
 
 }
 
-void usb_switch_to_nolo(struct usb_device_info * dev) {
+int usb_switch_to_nolo(struct usb_device_info * dev) {
+
+	int id;
+
+	if ( ! dev->udev )
+		ERROR_RETURN("Cannot switch mode of device which is not connected via USB", -1);
+
+	id = report_begin("mode switch", IMAGE_UNKNOWN);
 
 	printf("\nSwitching to NOLO mode...\n");
 
@@ -398,9 +415,20 @@ void usb_switch_to_nolo(struct usb_device_info * dev) {
 	else if ( dev->flash_device->protocol == FLASH_DISK )
 		printf_and_wait("Unplug USB cable, turn device off, press ENTER and plug USB cable again");
 
+	report_end(id, 0, 0);
+
+	return 0;
+
 }
 
-void usb_switch_to_cold(struct usb_device_info * dev) {
+int usb_switch_to_cold(struct usb_device_info * dev) {
+
+	int id;
+
+	if ( ! dev->udev )
+		ERROR_RETURN("Cannot switch mode of device which is not connected via USB", -1);
+
+	id = report_begin("mode switch", IMAGE_UNKNOWN);
 
 	printf("\nSwitching to Cold Flash mode...\n");
 
@@ -411,9 +439,20 @@ void usb_switch_to_cold(struct usb_device_info * dev) {
 	else if ( dev->flash_device->protocol == FLASH_DISK )
 		printf_and_wait("Unplug USB cable, turn device off, press ENTER and plug USB cable again");
 
+	report_end(id, 0, 0);
+
+	return 0;
+
 }
 
-void usb_switch_to_update(struct usb_device_info * dev) {
+int usb_switch_to_update(struct usb_device_info * dev) {
+
+	int id;
+
+	if ( ! dev->udev )
+		ERROR_RETURN("Cannot switch mode of device which is not connected via USB", -1);
+
+	id = report_begin("mode switch", IMAGE_UNKNOWN);
 
 	printf("\nSwitching to Update mode...\n");
 
@@ -426,9 +465,20 @@ void usb_switch_to_update(struct usb_device_info * dev) {
 	else if ( dev->flash_device->protocol == FLASH_DISK )
 		printf_and_wait("Unplug USB cable, turn device off, press ENTER and plug USB cable again");
 
+	report_end(id, 0, 0);
+
+	return 0;
+
 }
 
-void usb_switch_to_disk(struct usb_device_info * dev) {
+int usb_switch_to_disk(struct usb_device_info * dev) {
+
+	int id;
+
+	if ( ! dev->udev )
+		ERROR_RETURN("Cannot switch mode of device which is not connected via USB", -1);
+
+	id = report_begin("mode switch", IMAGE_UNKNOWN);
 
 	printf("\nSwitching to RAW disk mode...\n");
 
@@ -444,4 +494,8 @@ void usb_switch_to_disk(struct usb_device_info * dev) {
 			printf_and_wait("Unplug USB cable, plug again, choose USB Mass Storage Mode and press ENTER");
 	}
 
+	report_end(id, 0, 0);
+
+	return 0;
+
 }
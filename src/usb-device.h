@@ -54,21 +54,27 @@ struct usb_flash_device {
 	enum device devices[DEVICE_COUNT];
 };
 
+struct mkii_transport;
+struct mkii_cache;
+
 struct usb_device_info {
 	enum device device;
 	int16_t hwrev;
 	const struct usb_flash_device * flash_device;
 	usb_dev_handle * udev;
 	int data;
+	const struct mkii_transport * mkii_transport;
+	int mkii_sock;
+	struct mkii_cache * mkii_cache;
 };
 
 const char * usb_flash_protocol_to_string(enum usb_flash_protocol protocol);
 struct usb_device_info * usb_open_and_wait_for_device(void);
 void usb_close_device(struct usb_device_info * dev);
 
-void usb_switch_to_nolo(struct usb_device_info * dev);
-void usb_switch_to_cold(struct usb_device_info * dev);
-void usb_switch_to_update(struct usb_device_info * dev);
-void usb_switch_to_disk(struct usb_device_info * dev);
+int usb_switch_to_nolo(struct usb_device_info * dev);
+int usb_switch_to_cold(struct usb_device_info * dev);
+int usb_switch_to_update(struct usb_device_info * dev);
+int usb_switch_to_disk(struct usb_device_info * dev);
 
 #endif
@@ -0,0 +1,218 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "global.h"
+#include "scan.h"
+#include "usb-trace.h"
+
+/* Latency buckets have 4 steps per power of two (precision about 20%) */
+#define TRACE_STEPS		4
+#define TRACE_BUCKETS		(32 * TRACE_STEPS)
+#define TRACE_KEYS		32
+
+enum usb_trace_call {
+	TRACE_CONTROL = 0,
+	TRACE_BULK_WRITE,
+	TRACE_BULK_READ,
+};
+
+struct usb_trace_key {
+	enum usb_trace_call call;
+	int type;
+	int code;
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint32_t max;
+	uint32_t hist[TRACE_BUCKETS];
+};
+
+/* libusb is used only from main thread, so no locking is needed */
+static struct usb_trace_key usb_trace_keys[TRACE_KEYS];
+static int usb_trace_count;
+
+static int usb_trace_bucket(uint32_t usec) {
+
+	int msb = 0;
+	int bucket;
+
+	if ( usec < TRACE_STEPS )
+		return usec;
+
+	while ( usec >> ( msb + 1 ) )
+		++msb;
+
+	bucket = msb * TRACE_STEPS + ( ( usec >> ( msb - 2 ) ) & ( TRACE_STEPS - 1 ) );
+	if ( bucket >= TRACE_BUCKETS )
+		bucket = TRACE_BUCKETS - 1;
+
+	return bucket;
+
+}
+
+/* Upper bound of latency in bucket */
+static uint32_t usb_trace_bucket_usec(int bucket) {
+
+	int msb = bucket / TRACE_STEPS;
+	uint64_t usec;
+
+	if ( bucket < TRACE_STEPS )
+		return bucket;
+
+	usec = ( (uint64_t)( TRACE_STEPS + bucket % TRACE_STEPS + 1 ) << msb ) / TRACE_STEPS - 1;
+	if ( usec > UINT32_MAX )
+		usec = UINT32_MAX;
+
+	return usec;
+
+}
+
+static void usb_trace_record(enum usb_trace_call call, int type, int code, uint64_t start, int ret) {
+
+	struct usb_trace_key * key = NULL;
+	uint64_t usec = scan_time() - start;
+	int i;
+
+	for ( i = 0; i < usb_trace_count; ++i ) {
+		if ( usb_trace_keys[i].call == call && usb_trace_keys[i].type == type && usb_trace_keys[i].code == code ) {
+			key = &usb_trace_keys[i];
+			break;
+		}
+	}
+
+	if ( ! key ) {
+		/* Last key collects all other calls */
+		key = &usb_trace_keys[usb_trace_count];
+		if ( usb_trace_count < TRACE_KEYS - 1 )
+			++usb_trace_count;
+		key->call = call;
+		key->type = type;
+		key->code = code;
+	}
+
+	if ( usec > UINT32_MAX )
+		usec = UINT32_MAX;
+
+	++key->calls;
+	if ( ret < 0 )
+		++key->errors;
+	else
+		key->bytes += ret;
+	if ( usec > key->max )
+		key->max = usec;
+	++key->hist[usb_trace_bucket(usec)];
+
+}
+
+int usb_trace_control_msg(usb_dev_handle * udev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	uint64_t start = scan_time();
+	int ret = usb_control_msg(udev, requesttype, request, value, index, bytes, size, timeout);
+
+	usb_trace_record(TRACE_CONTROL, requesttype, request, start, ret);
+	return ret;
+
+}
+
+int usb_trace_bulk_write(usb_dev_handle * udev, int ep, char * bytes, int size, int timeout) {
+
+	uint64_t start = scan_time();
+	int ret = usb_bulk_write(udev, ep, bytes, size, timeout);
+
+	usb_trace_record(TRACE_BULK_WRITE, 0, ep, start, ret);
+	return ret;
+
+}
+
+int usb_trace_bulk_read(usb_dev_handle * udev, int ep, char * bytes, int size, int timeout) {
+
+	uint64_t start = scan_time();
+	int ret = usb_bulk_read(udev, ep, bytes, size, timeout);
+
+	usb_trace_record(TRACE_BULK_READ, 0, ep, start, ret);
+	return ret;
+
+}
+
+static uint32_t usb_trace_percentile(struct usb_trace_key * key, int percent) {
+
+	uint64_t need = ( key->calls * percent + 99 ) / 100;
+	uint64_t sum = 0;
+	int bucket;
+
+	for ( bucket = 0; bucket < TRACE_BUCKETS; ++bucket ) {
+		sum += key->hist[bucket];
+		if ( sum >= need )
+			break;
+	}
+
+	/* Bucket bound can be above real maximum */
+	if ( bucket == TRACE_BUCKETS || usb_trace_bucket_usec(bucket) > key->max )
+		return key->max;
+
+	return usb_trace_bucket_usec(bucket);
+
+}
+
+static void usb_trace_print_time(uint32_t usec) {
+
+	if ( usec < 10000 )
+		printf(" %6uus", usec);
+	else
+		printf(" %6ums", usec / 1000);
+
+}
+
+void usb_trace_print(void) {
+
+	static const char * calls[] = {
+		[TRACE_CONTROL] = "control",
+		[TRACE_BULK_WRITE] = "bulk write",
+		[TRACE_BULK_READ] = "bulk read",
+	};
+	struct usb_trace_key * key;
+	int i;
+
+	if ( usb_trace_count == 0 )
+		return;
+
+	printf("USB latency:\n");
+	printf("  %-10s %-9s %8s %6s %12s %8s %8s %8s\n", "call", "request", "calls", "errors", "bytes", "p50", "p99", "max");
+
+	for ( i = 0; i < usb_trace_count; ++i ) {
+
+		key = &usb_trace_keys[i];
+
+		printf("  %-10s ", calls[key->call]);
+		if ( key->call == TRACE_CONTROL )
+			printf("0x%02x/%-4d", key->type, key->code);
+		else
+			printf("ep 0x%02x  ", key->code);
+		printf(" %8llu %6llu %12llu", (unsigned long long int)key->calls, (unsigned long long int)key->errors, (unsigned long long int)key->bytes);
+		usb_trace_print_time(usb_trace_percentile(key, 50));
+		usb_trace_print_time(usb_trace_percentile(key, 99));
+		usb_trace_print_time(key->max);
+		printf("\n");
+
+	}
+
+}
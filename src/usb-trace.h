@@ -0,0 +1,37 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef USB_TRACE_H
+#define USB_TRACE_H
+
+#include "usb-device.h"
+
+/*
+ * Wrappers of libusb transfer functions which measure latency of every
+ * call. Statistics are collected per control request or bulk endpoint and
+ * cost only one clock read per call, so tracing is always enabled.
+ */
+int usb_trace_control_msg(usb_dev_handle * udev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout);
+int usb_trace_bulk_write(usb_dev_handle * udev, int ep, char * bytes, int size, int timeout);
+int usb_trace_bulk_read(usb_dev_handle * udev, int ep, char * bytes, int size, int timeout);
+
+/* Print latency percentiles of all traced calls */
+void usb_trace_print(void);
+
+#endif
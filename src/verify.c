@@ -0,0 +1,405 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* O_DIRECT is Linux extension */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+
+#include "global.h"
+#include "printf-utils.h"
+#include "image.h"
+#include "dump.h"
+#include "verify.h"
+#include "buffer.h"
+
+/* Image and device are compared in chunks, mismatches are reported per block */
+#define VERIFY_CHUNK_SIZE	(1UL << 20) /* 1MB */
+#define VERIFY_BLOCK		4096
+#define VERIFY_WORKERS		4
+#define VERIFY_MAX_REGIONS	16
+
+#define VERIFY_FNV_BASIS	0xcbf29ce484222325ULL
+#define VERIFY_FNV_PRIME	0x100000001b3ULL
+
+struct verify {
+	pthread_mutex_t lock;
+	struct image * image;
+	const struct dump_source * src;
+	uint64_t size;
+	uint64_t count;
+	uint64_t next;
+	uint64_t done;
+	int error;
+	/* xor16 (as in fiasco) and FNV-1a of each chunk */
+	unsigned char hash_image[2];
+	unsigned char hash_dev[2];
+	uint64_t * fnv_image;
+	uint64_t * fnv_dev;
+	/* Bitmap of mismatching blocks */
+	unsigned char * mismatch;
+};
+
+static uint64_t verify_fnv(uint64_t hash, const unsigned char * data, size_t size) {
+
+	size_t i;
+
+	for ( i = 0; i < size; ++i ) {
+		hash ^= data[i];
+		hash *= VERIFY_FNV_PRIME;
+	}
+
+	return hash;
+
+}
+
+static void verify_xor(unsigned char * hash, const unsigned char * data, size_t size) {
+
+	size_t i;
+
+	/* Odd last byte is not hashed, like image_hash_from_data() */
+	for ( i = 0; i + 1 < size; i += 2 ) {
+		hash[0] ^= data[i];
+		hash[1] ^= data[i+1];
+	}
+
+}
+
+static int verify_read_image(struct verify * verify, char * buf, size_t count, uint64_t pos) {
+
+	size_t done = 0;
+	size_t ret;
+
+	image_seek(verify->image, pos);
+
+	while ( done < count ) {
+		ret = image_read(verify->image, buf + done, count - done);
+		if ( ret == 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static int verify_read_dev(struct verify * verify, char * buf, size_t count, uint64_t pos) {
+
+	size_t done = 0;
+	ssize_t ret;
+
+	while ( done < count ) {
+		ret = verify->src->read(verify->src->priv, buf + done, count - done, pos + done);
+		if ( ret <= 0 )
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+
+}
+
+static void * verify_worker(void * priv) {
+
+	struct verify * verify = priv;
+	unsigned char hash_image[2];
+	unsigned char hash_dev[2];
+	char * image_buf;
+	char * dev_buf;
+	uint64_t block;
+	uint64_t idx;
+	uint64_t pos;
+	size_t len;
+	size_t off;
+	size_t cmp;
+	int ret;
+
+	image_buf = buffer_alloc(VERIFY_CHUNK_SIZE);
+	dev_buf = buffer_alloc(VERIFY_CHUNK_SIZE);
+
+	if ( ! image_buf || ! dev_buf ) {
+		buffer_free(image_buf);
+		buffer_free(dev_buf);
+		return NULL;
+	}
+
+	while ( 1 ) {
+
+		/* Image is read by seek and read, so only one thread at time */
+		pthread_mutex_lock(&verify->lock);
+		if ( verify->error || verify->next >= verify->count ) {
+			pthread_mutex_unlock(&verify->lock);
+			break;
+		}
+		idx = verify->next++;
+		pos = idx * VERIFY_CHUNK_SIZE;
+		len = verify->size - pos < VERIFY_CHUNK_SIZE ? verify->size - pos : VERIFY_CHUNK_SIZE;
+		ret = verify_read_image(verify, image_buf, len, pos);
+		pthread_mutex_unlock(&verify->lock);
+
+		if ( ret < 0 ) {
+			PRINTF_ERROR("Cannot read image");
+			pthread_mutex_lock(&verify->lock);
+			verify->error = 1;
+			pthread_mutex_unlock(&verify->lock);
+			break;
+		}
+
+		if ( verify_read_dev(verify, dev_buf, len, pos) < 0 ) {
+			PRINTF_ERROR("Cannot read from device at 0x%llx", (unsigned long long int)pos);
+			pthread_mutex_lock(&verify->lock);
+			verify->error = 1;
+			pthread_mutex_unlock(&verify->lock);
+			break;
+		}
+
+		for ( off = 0; off < len; off += cmp ) {
+			cmp = len - off < VERIFY_BLOCK ? len - off : VERIFY_BLOCK;
+			if ( memcmp(image_buf + off, dev_buf + off, cmp) != 0 ) {
+				block = ( pos + off ) / VERIFY_BLOCK;
+				pthread_mutex_lock(&verify->lock);
+				verify->mismatch[block / 8] |= 1 << ( block % 8 );
+				pthread_mutex_unlock(&verify->lock);
+			}
+		}
+
+		memset(hash_image, 0, sizeof(hash_image));
+		memset(hash_dev, 0, sizeof(hash_dev));
+		verify_xor(hash_image, (unsigned char *)image_buf, len);
+		verify_xor(hash_dev, (unsigned char *)dev_buf, len);
+
+		verify->fnv_image[idx] = verify_fnv(VERIFY_FNV_BASIS, (unsigned char *)image_buf, len);
+		verify->fnv_dev[idx] = verify_fnv(VERIFY_FNV_BASIS, (unsigned char *)dev_buf, len);
+
+		pthread_mutex_lock(&verify->lock);
+		verify->hash_image[0] ^= hash_image[0];
+		verify->hash_image[1] ^= hash_image[1];
+		verify->hash_dev[0] ^= hash_dev[0];
+		verify->hash_dev[1] ^= hash_dev[1];
+		verify->done += len;
+		if ( verify->done < verify->size )
+			printf_progressbar(verify->done, verify->size);
+		pthread_mutex_unlock(&verify->lock);
+
+	}
+
+	buffer_free(image_buf);
+	buffer_free(dev_buf);
+	return NULL;
+
+}
+
+/* Hash of chunk hashes in order */
+static uint64_t verify_fnv_list(const uint64_t * list, uint64_t count) {
+
+	unsigned char bytes[8];
+	uint64_t hash = VERIFY_FNV_BASIS;
+	uint64_t i;
+	int j;
+
+	for ( i = 0; i < count; ++i ) {
+		for ( j = 0; j < 8; ++j )
+			bytes[j] = ( list[i] >> ( 8 * j ) ) & 0xFF;
+		hash = verify_fnv(hash, bytes, sizeof(bytes));
+	}
+
+	return hash;
+
+}
+
+int verify_image(struct image * image, const struct dump_source * src, int workers) {
+
+	struct verify verify;
+	pthread_t threads[VERIFY_WORKERS];
+	uint16_t hash_image;
+	uint16_t hash_dev;
+	uint64_t fnv_image;
+	uint64_t fnv_dev;
+	uint64_t blocks;
+	uint64_t bad;
+	uint64_t start;
+	uint64_t i;
+	int regions;
+	int num;
+	int ret;
+
+	printf("Verifying %s image...\n", image_type_to_string(image->type));
+
+	if ( workers > VERIFY_WORKERS )
+		workers = VERIFY_WORKERS;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.image = image;
+	verify.src = src;
+	verify.size = image->size;
+	verify.count = ( verify.size + VERIFY_CHUNK_SIZE - 1 ) / VERIFY_CHUNK_SIZE;
+
+	blocks = ( verify.size + VERIFY_BLOCK - 1 ) / VERIFY_BLOCK;
+
+	verify.fnv_image = calloc(verify.count + 1, sizeof(uint64_t));
+	verify.fnv_dev = calloc(verify.count + 1, sizeof(uint64_t));
+	verify.mismatch = calloc(blocks / 8 + 1, 1);
+	if ( ! verify.fnv_image || ! verify.fnv_dev || ! verify.mismatch ) {
+		free(verify.fnv_image);
+		free(verify.fnv_dev);
+		free(verify.mismatch);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	pthread_mutex_init(&verify.lock, NULL);
+
+	printf_progressbar(0, verify.size);
+
+	for ( num = 0; num < workers; ++num )
+		if ( pthread_create(&threads[num], NULL, verify_worker, &verify) != 0 )
+			break;
+
+	if ( num == 0 )
+		verify_worker(&verify);
+
+	for ( i = 0; i < (uint64_t)num; ++i )
+		pthread_join(threads[i], NULL);
+
+	if ( verify.done == verify.size )
+		printf_progressbar(verify.size, verify.size);
+	else
+		PRINTF_END();
+
+	if ( verify.error || verify.done != verify.size ) {
+		ERROR("Verifying %s image failed", image_type_to_string(image->type));
+		ret = -1;
+		goto clean;
+	}
+
+	memcpy(&hash_image, verify.hash_image, sizeof(hash_image));
+	memcpy(&hash_dev, verify.hash_dev, sizeof(hash_dev));
+	fnv_image = verify_fnv_list(verify.fnv_image, verify.count);
+	fnv_dev = verify_fnv_list(verify.fnv_dev, verify.count);
+
+	printf("Image hash: 0x%04x (expected 0x%04x), FNV-1a: 0x%016llx\n", hash_image, image->hash, (unsigned long long int)fnv_image);
+	printf("Device hash: 0x%04x, FNV-1a: 0x%016llx\n", hash_dev, (unsigned long long int)fnv_dev);
+
+	bad = 0;
+	regions = 0;
+	i = 0;
+
+	while ( i < blocks ) {
+
+		if ( ! ( ( verify.mismatch[i / 8] >> ( i % 8 ) ) & 1 ) ) {
+			++i;
+			continue;
+		}
+
+		start = i;
+		while ( i < blocks && ( ( verify.mismatch[i / 8] >> ( i % 8 ) ) & 1 ) )
+			++i;
+		bad += i - start;
+
+		if ( regions++ < VERIFY_MAX_REGIONS )
+			printf("  Mismatch at 0x%08llx-0x%08llx\n", (unsigned long long int)(start * VERIFY_BLOCK), (unsigned long long int)(i * VERIFY_BLOCK < verify.size ? i * VERIFY_BLOCK : verify.size));
+		else if ( regions == VERIFY_MAX_REGIONS + 1 )
+			printf("  ...\n");
+
+	}
+
+	if ( bad || hash_dev != hash_image || fnv_dev != fnv_image ) {
+		ERROR("Image %s on device does not match, %llu of %llu blocks differ", image_type_to_string(image->type), (unsigned long long int)bad, (unsigned long long int)blocks);
+		ret = 1;
+	} else {
+		printf("Image %s on device matches\n", image_type_to_string(image->type));
+		ret = 0;
+	}
+
+clean:
+	pthread_mutex_destroy(&verify.lock);
+	free(verify.fnv_image);
+	free(verify.fnv_dev);
+	free(verify.mismatch);
+
+	return ret;
+
+}
+
+struct verify_fd {
+	int fd;
+	int direct;
+};
+
+static ssize_t verify_fd_read(void * priv, char * buf, size_t count, uint64_t pos) {
+
+	struct verify_fd * src = priv;
+	ssize_t ret;
+
+	while ( 1 ) {
+		ret = pread(src->fd, buf, count, pos);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+#ifdef __linux__
+		/* Unaligned tail or device without O_DIRECT support, continue buffered */
+		if ( ret < 0 && errno == EINVAL && src->direct ) {
+			fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) & ~O_DIRECT);
+			src->direct = 0;
+			continue;
+		}
+#endif
+		return ret;
+	}
+
+}
+
+int verify_image_fd(struct image * image, int fd) {
+
+	struct verify_fd priv;
+	struct dump_source src;
+	int flags;
+	int ret;
+
+	priv.fd = fd;
+	priv.direct = 0;
+
+	src.read = verify_fd_read;
+	src.priv = &priv;
+
+	flags = fcntl(fd, F_GETFL);
+
+#ifdef __linux__
+	/* Read device, not page cache with just written data */
+	if ( flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0 )
+		priv.direct = 1;
+#endif
+
+	ret = verify_image(image, &src, VERIFY_WORKERS);
+
+	if ( flags != -1 )
+		fcntl(fd, F_SETFL, flags);
+
+	return ret;
+
+}
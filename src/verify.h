@@ -0,0 +1,36 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "image.h"
+#include "dump.h"
+
+/*
+ * Compare image with data read back from device by src, print hashes and mismatching blocks.
+ * With more workers src->read is called from several threads and must honour pos.
+ * Returns 0 if data are same, 1 if they differ and -1 on error.
+ */
+int verify_image(struct image * image, const struct dump_source * src, int workers);
+
+/* Compare image with start of block device, read by several workers with O_DIRECT */
+int verify_image_fd(struct image * image, int fd);
+
+#endif